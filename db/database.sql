@@ -1,17 +1,37 @@
 DROP TABLE recordings;
 
+-- Schema version 2 (PRAGMA user_version), see src/schema.h. date and time
+-- are only filled on rows from before version 1.
 CREATE TABLE IF NOT EXISTS info(
-    id TEXT NOT NULL PRIMARY KEY,
-    timestamp TEXT NOT NULL,
-    freq TEXT NOT NULL,
+    id INTEGER PRIMARY KEY AUTOINCREMENT,
+    date TEXT,
+    time TEXT,
+    freq TEXT,
     agency TEXT,
     transcript TEXT,
     audioPath TEXT,
-    audioDuration TEXT,
     postID TEXT,
-    postURL TEXT
+    postURL TEXT,
+    start_us INTEGER,
+    end_us INTEGER,
+    freq_hz INTEGER,
+    duration_ms INTEGER,
+    -- The audio file's name without directory or extension, which
+    -- transcripts are named after; audioPath changes under retention
+    segment TEXT
 );
 
+CREATE INDEX IF NOT EXISTS info_start ON info(start_us, freq_hz, duration_ms);
+CREATE INDEX IF NOT EXISTS info_freq_start ON info(freq_hz, start_us, duration_ms);
+CREATE INDEX IF NOT EXISTS info_segment ON info(segment);
+
+-- Version 0 to 1; the bus then fills in start_us and freq_hz in batches.
+-- ALTER TABLE info ADD COLUMN start_us INTEGER;
+-- ALTER TABLE info ADD COLUMN end_us INTEGER;
+-- ALTER TABLE info ADD COLUMN freq_hz INTEGER;
+-- ALTER TABLE info ADD COLUMN duration_ms INTEGER;
+-- PRAGMA user_version = 1;
+
 INSERT INTO
     recordings(
         id,
@@ -39,4 +59,7 @@ VALUES
 SELECT
     *
 FROM
-    recordings;
\ No newline at end of file
+    recordings;
+
+-- Adding segment to any version; src/schema.cpp fills it with path_stem().
+-- ALTER TABLE info ADD COLUMN segment TEXT;
@@ -0,0 +1,918 @@
+// Benchmarks
+//
+// Times the hot paths of the bus against a scratch database. Run with
+// `make bench`, or bin/bench [name] [rows] for a single benchmark.
+#include "database.h"
+#include "db_writer.h"
+#include "history.h"
+#include "message.h"
+#include "rollup.h"
+#include "schema.h"
+#include "search.h"
+#include "segment_store.h"
+#include "status_block.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mqueue.h>
+#include <mutex>
+#include <random>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using std::string;
+using namespace std::chrono;
+
+const char *const BENCH_DB_PATH = "/tmp/scannerbot_bench.db";
+
+// The info table as it was before schema versions
+const char *const INFO_TABLE_SQL =
+    "CREATE TABLE IF NOT EXISTS info(\
+        id INTEGER PRIMARY KEY AUTOINCREMENT,\
+        date TEXT, time TEXT, freq TEXT, agency TEXT,\
+        transcript TEXT, audioPath TEXT,\
+        postID TEXT, postURL TEXT);";
+
+// A fresh database holding an empty info table, in its original layout
+// unless current is set
+static void open_scratch(Database &database, bool current = false)
+{
+    unlink(BENCH_DB_PATH);
+    database.open(BENCH_DB_PATH);
+    if (current)
+        schema_init(database);
+    else
+        database.exec(INFO_TABLE_SQL);
+}
+
+// Row row of rows, spread evenly over 2023
+static time_t row_time(long row, long rows)
+{
+    struct tm start = {};
+    start.tm_year = 123;
+    start.tm_mday = 1;
+    start.tm_isdst = -1;
+    return mktime(&start) + time_t(row * (365.0 * 86400 / rows));
+}
+
+const char *const BENCH_FREQS[] = {"160.71M", "154.43M", "460.05M", "851.01M"};
+
+static string audio_path(long row)
+{
+    char path[96];
+    snprintf(path, sizeof(path), "/home/corey/scannerbot/audio/%02ld-%02ld-2023-%02ld:%02ld:%02ld.wav",
+             row % 12 + 1, row % 28 + 1, row / 3600 % 24, row / 60 % 60, row % 60);
+    return path;
+}
+
+static void report(const char *name, long rows, steady_clock::duration elapsed)
+{
+    double seconds = duration<double>(elapsed).count();
+    printf("%-28s %8ld rows %9.3f s %12.0f rows/s %8.2f us/row\n", name, rows, seconds,
+           rows / seconds, seconds * 1e6 / rows);
+}
+
+// Times body over rows rows, inside one transaction so that only the cost
+// of each statement is measured, not the journal syncs.
+static void time_rows(const char *name, long rows, Database &database,
+                      const std::function<void(long)> &body)
+{
+    auto start = steady_clock::now();
+    database.exec("BEGIN;");
+    for (long row = 0; row < rows; row++)
+        body(row);
+    database.exec("COMMIT;");
+    report(name, rows, steady_clock::now() - start);
+}
+
+static int print_row(void *, int argc, char **argv, char **column)
+{
+    for (int i = 0; i < argc; i++)
+        std::cout << column[i] << ": " << (argv[i] ? argv[i] : "NULL") << std::endl;
+    return 0;
+}
+
+// The insert the bus made before the statement cache: SQL text pasted
+// together per row and run through sqlite3_exec.
+static void bench_insert(long rows)
+{
+    Database database;
+
+    open_scratch(database);
+    time_rows("insert sqlite3_exec", rows, database, [&](long row)
+              {
+                  char insert_command[1024];
+                  snprintf(insert_command, sizeof(insert_command),
+                           "INSERT INTO info (date, time, audioPath) VALUES ('%s','%s','%s');",
+                           "01-02-2023", "12:34:56", audio_path(row).c_str());
+                  char *errmsg = 0;
+                  if (sqlite3_exec(database.handle(), insert_command, print_row, 0, &errmsg) != SQLITE_OK)
+                      sqlite3_free(errmsg);
+              });
+    database.close();
+
+    open_scratch(database);
+    time_rows("insert prepared", rows, database, [&](long row)
+              {
+                  Statement insert = database.prepare(
+                      "INSERT INTO info (date, time, audioPath) VALUES (?1, ?2, ?3);");
+                  insert.bind_text(1, "01-02-2023").bind_text(2, "12:34:56").bind_text(3, audio_path(row));
+                  insert.run();
+              });
+    database.close();
+}
+
+// Autocommit inserts, one journal sync each, against the same rows put
+// through the writer thread's group commits. Autocommit runs a fiftieth of
+// the rows; at a sync per row the full count would take minutes.
+static void bench_writer(long rows)
+{
+    Database database;
+    std::mutex dbMutex;
+    const char *insert_sql = "INSERT INTO info (date, time, audioPath) VALUES (?1, ?2, ?3);";
+
+    open_scratch(database);
+    long autocommit_rows = std::max(1L, rows / 50);
+    auto start = steady_clock::now();
+    for (long row = 0; row < autocommit_rows; row++)
+    {
+        Statement insert = database.prepare(insert_sql);
+        insert.bind_text(1, "01-02-2023").bind_text(2, "12:34:56").bind_text(3, audio_path(row));
+        insert.run();
+    }
+    report("insert autocommit", autocommit_rows, steady_clock::now() - start);
+    database.close();
+
+    open_scratch(database);
+    DatabaseWriter writer;
+    writer.start(&database, &dbMutex);
+    std::vector<std::future<bool>> done;
+    done.reserve(rows);
+    start = steady_clock::now();
+    for (long row = 0; row < rows; row++)
+        done.push_back(writer.submit(
+            [row, insert_sql](Database &db)
+            {
+                Statement insert = db.prepare(insert_sql);
+                insert.bind_text(1, "01-02-2023").bind_text(2, "12:34:56").bind_text(3, audio_path(row));
+                return insert.run();
+            }));
+    for (auto &future : done)
+        future.wait();
+    report("insert group commit", rows, steady_clock::now() - start);
+    writer.stop();
+    writer.print_stats(std::cout);
+    std::cout << std::endl;
+    database.close();
+}
+
+// Group-commit inserts while a pooled read-only connection scans info
+// over and over. In WAL mode the reader should not slow the writer.
+static void bench_readers(long rows)
+{
+    Database database;
+    std::mutex dbMutex;
+    open_scratch(database);
+    ReaderPool readers;
+    readers.open(BENCH_DB_PATH, 1);
+    DatabaseWriter writer;
+    writer.start(&database, &dbMutex);
+
+    std::atomic<bool> writing = true;
+    long scans = 0;
+    std::thread reader(
+        [&]
+        {
+            while (writing)
+            {
+                ReaderPool::Lease db = readers.acquire();
+                Statement count = db->prepare("SELECT count(*) FROM info WHERE audioPath LIKE '%:00.wav';");
+                count.step();
+                scans++;
+            }
+        });
+
+    std::vector<std::future<bool>> done;
+    done.reserve(rows);
+    auto start = steady_clock::now();
+    for (long row = 0; row < rows; row++)
+        done.push_back(writer.submit(
+            [row](Database &db)
+            {
+                Statement insert = db.prepare("INSERT INTO info (date, time, audioPath) VALUES (?1, ?2, ?3);");
+                insert.bind_text(1, "01-02-2023").bind_text(2, "12:34:56").bind_text(3, audio_path(row));
+                return insert.run();
+            }));
+    for (auto &future : done)
+        future.wait();
+    report("insert with reader", rows, steady_clock::now() - start);
+    writing = false;
+    reader.join();
+    printf("%-28s %8ld full scans alongside\n", "", scans);
+
+    writer.stop();
+    readers.close();
+    database.close();
+}
+
+const char *const RADIO_WORDS[] = {
+    "unit", "respond", "copy", "engine", "medic", "battalion", "dispatch", "fire",
+    "structure", "vehicle", "accident", "injuries", "traffic", "alarm", "smoke", "report",
+    "caller", "advises", "en", "route", "on", "scene", "clear", "available",
+    "north", "south", "east", "west", "avenue", "street", "boulevard", "freeway",
+    "patient", "transport", "hospital", "cancel", "command", "staging", "water", "supply",
+    "ten", "four", "negative", "affirmative", "standby", "checking", "request", "backup"};
+
+// Random radio-ish transcripts, 8 to 30 words, with unit numbers and street
+// numbers so there are rare terms as well as very common ones
+static string random_transcript(std::mt19937 &rng)
+{
+    const size_t vocabulary = sizeof(RADIO_WORDS) / sizeof(RADIO_WORDS[0]);
+    std::uniform_int_distribution<size_t> length(8, 30), pick(0, vocabulary - 1), number(1, 9999);
+    string text;
+    for (size_t i = 0, words = length(rng); i < words; i++)
+    {
+        if (i > 0)
+            text += ' ';
+        text += rng() % 8 == 0 ? std::to_string(number(rng)) : RADIO_WORDS[pick(rng)];
+    }
+    return text;
+}
+
+// Ranked full-text queries, with and without filters, over rows indexed
+// transcripts
+static void bench_search(long rows)
+{
+    Database database;
+    open_scratch(database, true);
+    search_init(database);
+
+    std::mt19937 rng(1);
+    time_rows("insert indexed", rows, database, [&](long row)
+              {
+                  const char *freq = BENCH_FREQS[row % 4];
+                  Statement insert = database.prepare(
+                      "INSERT INTO info (start_us, freq, freq_hz, audioPath, transcript) VALUES (?1, ?2, ?3, ?4, ?5);");
+                  insert.bind_int64(1, row_time(row, rows) * 1000000LL).bind_text(2, freq)
+                      .bind_int64(3, freq_hz(freq)).bind_text(4, audio_path(row)).bind_text(5, random_transcript(rng));
+                  insert.run();
+              });
+
+    const char *queries[] = {
+        "fire",
+        "structure fire smoke",
+        "4217",
+        "batt*",
+        "medic transport freq 460.05M",
+        "alarm since 2023-06-01 until 2023-06-30",
+    };
+    for (const char *args : queries)
+    {
+        SearchQuery query = parse_search(args);
+        const int runs = 20;
+        steady_clock::duration total{}, slowest{};
+        size_t found = 0;
+        for (int run = 0; run < runs; run++)
+        {
+            auto start = steady_clock::now();
+            found = search(database, query).size();
+            auto elapsed = steady_clock::now() - start;
+            total += elapsed;
+            slowest = std::max(slowest, elapsed);
+        }
+        printf("search %-40s %3zu hits %9.3f ms mean %9.3f ms max\n", args, found,
+               duration<double, std::milli>(total).count() / runs,
+               duration<double, std::milli>(slowest).count());
+    }
+    database.close();
+}
+
+// Range queries over one channel and over all of them: on the text date
+// and time columns, then again on the integer columns after migrating
+static void bench_range(long rows)
+{
+    Database database;
+    open_scratch(database);
+    time_rows("insert text dates", rows, database, [&](long row)
+              {
+                  time_t when = row_time(row, rows);
+                  char date[16], time[16];
+                  strftime(date, sizeof(date), "%d-%m-%Y", localtime(&when));
+                  strftime(time, sizeof(time), "%H:%M:%S", localtime(&when));
+                  Statement insert = database.prepare(
+                      "INSERT INTO info (date, time, freq, audioPath) VALUES (?1, ?2, ?3, ?4);");
+                  insert.bind_text(1, date).bind_text(2, time).bind_text(3, BENCH_FREQS[row % 4])
+                      .bind_text(4, audio_path(row));
+                  insert.run();
+              });
+
+    // One week in June, as the text columns and as epoch microseconds
+    time_t since = row_time(rows * 152 / 365, rows), until = since + 7 * 86400;
+    char since_text[32], until_text[32];
+    strftime(since_text, sizeof(since_text), "%Y-%m-%dT%H:%M:%S", localtime(&since));
+    strftime(until_text, sizeof(until_text), "%Y-%m-%dT%H:%M:%S", localtime(&until));
+
+    auto time_query = [&](const char *name, const char *sql, auto bind)
+    {
+        const int runs = 20;
+        long found = 0;
+        auto start = steady_clock::now();
+        for (int run = 0; run < runs; run++)
+        {
+            Statement query = database.prepare(sql);
+            bind(query);
+            query.step();
+            found = query.column_int64(0);
+        }
+        printf("%-28s %8ld rows %9.3f ms per query\n", name, found,
+               duration<double, std::milli>(steady_clock::now() - start).count() / runs);
+    };
+#define TEXT_WHEN "(substr(date, 7, 4) || '-' || substr(date, 4, 2) || '-' || substr(date, 1, 2) || 'T' || time)"
+    time_query("range text, one channel",
+               "SELECT count(*) FROM info WHERE freq = ?1 AND " TEXT_WHEN " BETWEEN ?2 AND ?3;",
+               [&](Statement &query)
+               { query.bind_text(1, BENCH_FREQS[2]).bind_text(2, since_text).bind_text(3, until_text); });
+    time_query("range text, all channels",
+               "SELECT count(*) FROM info WHERE " TEXT_WHEN " BETWEEN ?1 AND ?2;",
+               [&](Statement &query)
+               { query.bind_text(1, since_text).bind_text(2, until_text); });
+#undef TEXT_WHEN
+
+    auto start = steady_clock::now();
+    schema_init(database);
+    sqlite3_int64 after = 0;
+    bool more;
+    long batches = 0;
+    while (migrate_batch(database, after, 1000, more) and more)
+        batches++;
+    printf("%-28s %8ld rows %9.3f s in %ld batches\n", "migrate", rows,
+           duration<double>(steady_clock::now() - start).count(), batches);
+
+    time_query("range integer, one channel",
+               "SELECT count(*) FROM info WHERE freq_hz = ?1 AND start_us BETWEEN ?2 AND ?3;",
+               [&](Statement &query)
+               {
+                   query.bind_int64(1, freq_hz(BENCH_FREQS[2]))
+                       .bind_int64(2, since * 1000000LL)
+                       .bind_int64(3, until * 1000000LL);
+               });
+    time_query("range integer, all channels",
+               "SELECT count(*) FROM info WHERE start_us BETWEEN ?1 AND ?2;",
+               [&](Statement &query)
+               { query.bind_int64(1, since * 1000000LL).bind_int64(2, until * 1000000LL); });
+    database.close();
+}
+
+// What the rollup triggers add to each insert, and a week of hourly
+// airtime per channel grouped from info against read from the rollups
+static void bench_rollup(long rows)
+{
+    Database database;
+    auto insert_rows = [&](const char *name)
+    {
+        time_rows(name, rows, database, [&](long row)
+                  {
+                      Statement insert = database.prepare(
+                          "INSERT INTO info (start_us, freq, freq_hz, duration_ms, audioPath) "
+                          "VALUES (?1, ?2, ?3, ?4, ?5);");
+                      insert.bind_int64(1, row_time(row, rows) * 1000000LL)
+                          .bind_text(2, BENCH_FREQS[row % 4])
+                          .bind_int64(3, freq_hz(BENCH_FREQS[row % 4]))
+                          .bind_int64(4, 1000 + row % 9000)
+                          .bind_text(5, audio_path(row));
+                      insert.run();
+                  });
+    };
+    open_scratch(database, true);
+    insert_rows("insert without rollups");
+    database.close();
+    open_scratch(database, true);
+    rollup_init(database);
+    insert_rows("insert with rollups");
+
+    time_t since = row_time(rows * 152 / 365, rows), until = since + 7 * 86400;
+    auto time_query = [&](const char *name, const char *sql)
+    {
+        const int runs = 20;
+        long buckets = 0;
+        auto start = steady_clock::now();
+        for (int run = 0; run < runs; run++)
+        {
+            Statement query = database.prepare(sql);
+            query.bind_int64(1, since * 1000000LL).bind_int64(2, until * 1000000LL);
+            for (buckets = 0; query.step() == SQLITE_ROW; buckets++)
+                ;
+        }
+        printf("%-28s %8ld buckets %6.3f ms per query\n", name, buckets,
+               duration<double, std::milli>(steady_clock::now() - start).count() / runs);
+    };
+    time_query("hourly airtime from info",
+               "SELECT start_us - start_us % 3600000000, freq_hz, count(*), sum(duration_ms) FROM info"
+               " WHERE start_us >= ?1 AND start_us < ?2 GROUP BY 1, 2;");
+    time_query("hourly airtime from rollups",
+               "SELECT bucket_us, freq_hz, transmissions, airtime_ms FROM rollups"
+               " WHERE period = 'hour' AND bucket_us >= ?1 AND bucket_us < ?2;");
+    database.close();
+}
+
+// The bus's own mix: history already in the database, then new rows
+// inserted and given their transcripts through the writer, as the bus does,
+// while readers run searches, activity rollups and the latest rows. Run by
+// `make bench-db` against our SQLite build options and SQLite's defaults.
+static void bench_mix(long rows)
+{
+    Database database;
+    open_scratch(database, true);
+    search_init(database);
+    rollup_init(database);
+    printf("SQLite %s, threadsafe %d\n", sqlite3_libversion(), sqlite3_threadsafe());
+
+    std::mt19937 rng(1);
+    time_rows("insert history", rows, database, [&](long row)
+              {
+                  const char *freq = BENCH_FREQS[row % 4];
+                  Statement insert = database.prepare(
+                      "INSERT INTO info (start_us, freq, freq_hz, duration_ms, audioPath, transcript) "
+                      "VALUES (?1, ?2, ?3, ?4, ?5, ?6);");
+                  insert.bind_int64(1, row_time(row, rows) * 1000000LL).bind_text(2, freq)
+                      .bind_int64(3, freq_hz(freq)).bind_int64(4, 1000 + row % 9000)
+                      .bind_text(5, audio_path(row)).bind_text(6, random_transcript(rng));
+                  insert.run();
+              });
+
+    std::mutex dbMutex;
+    ReaderPool readers;
+    readers.open(BENCH_DB_PATH, 4);
+    DatabaseWriter writer;
+    writer.start(&database, &dbMutex);
+
+    // Each reader runs the queries in turn; totals are per query
+    struct Query
+    {
+        const char *name;
+        std::function<void(Database &)> run;
+        std::atomic<long> count = 0;
+        std::atomic<long long> nanos = 0;
+    };
+    time_t week = row_time(rows * 152 / 365, rows);
+    Query queries[] = {
+        {"search", [](Database &db)
+         { search(db, parse_search("structure fire")); }},
+        {"activity", [&](Database &db)
+         {
+             Statement select = db.prepare("SELECT count(*) FROM rollups"
+                                           " WHERE period = 'hour' AND bucket_us >= ?1 AND bucket_us < ?2;");
+             select.bind_int64(1, week * 1000000LL).bind_int64(2, (week + 7 * 86400) * 1000000LL);
+             select.step();
+         }},
+        {"latest", [](Database &db)
+         {
+             Statement select = db.prepare("SELECT id, freq, transcript FROM info ORDER BY start_us DESC LIMIT 20;");
+             while (select.step() == SQLITE_ROW)
+                 ;
+         }},
+    };
+    std::atomic<bool> writing = true;
+    std::vector<std::thread> reader_threads;
+    for (int reader = 0; reader < 4; reader++)
+        reader_threads.emplace_back(
+            [&]
+            {
+                for (size_t turn = 0; writing; turn++)
+                {
+                    Query &query = queries[turn % 3];
+                    auto start = steady_clock::now();
+                    {
+                        ReaderPool::Lease db = readers.acquire();
+                        query.run(*db);
+                    }
+                    query.nanos += duration_cast<nanoseconds>(steady_clock::now() - start).count();
+                    query.count++;
+                }
+            });
+
+    long live = std::max(1L, rows / 10);
+    std::vector<std::future<bool>> done;
+    done.reserve(2 * live);
+    auto start = steady_clock::now();
+    for (long row = rows; row < rows + live; row++)
+    {
+        const char *freq = BENCH_FREQS[row % 4];
+        done.push_back(writer.submit(
+            [row, rows, freq](Database &db)
+            {
+                Statement insert = db.prepare(
+                    "INSERT INTO info (start_us, freq, freq_hz, duration_ms, audioPath) VALUES (?1, ?2, ?3, ?4, ?5);");
+                insert.bind_int64(1, row_time(row, rows) * 1000000LL).bind_text(2, freq)
+                    .bind_int64(3, freq_hz(freq)).bind_int64(4, 1000 + row % 9000).bind_text(5, audio_path(row));
+                return insert.run();
+            }));
+        done.push_back(writer.submit(
+            [row, text = random_transcript(rng)](Database &db)
+            {
+                // Ids count up from 1 in insert order
+                Statement update = db.prepare("UPDATE info SET transcript = ?1 WHERE id = ?2;");
+                update.bind_text(1, text).bind_int64(2, row + 1);
+                return update.run();
+            }));
+    }
+    for (auto &future : done)
+        future.wait();
+    auto elapsed = steady_clock::now() - start;
+    writing = false;
+    for (auto &reader : reader_threads)
+        reader.join();
+
+    report("insert and transcribe", live, elapsed);
+    for (auto &query : queries)
+        printf("%-28s %8ld queries %8.0f /s %9.3f ms mean\n", query.name, query.count.load(),
+               query.count / duration<double>(elapsed).count(),
+               query.count ? query.nanos / 1e6 / query.count : 0.0);
+
+    writer.stop();
+    readers.close();
+    database.close();
+}
+
+// Segments stored one file each, as the recorder leaves them, against
+// the segment store's hourly packs: ingest, random reads of every segment,
+// and what each takes on disk. Reads come from the page cache in both.
+static void bench_store(long rows)
+{
+    const std::filesystem::path files_dir = "/tmp/scannerbot_bench_files", store_dir = "/tmp/scannerbot_bench_store";
+    std::filesystem::remove_all(files_dir);
+    std::filesystem::remove_all(store_dir);
+    std::filesystem::create_directories(files_dir);
+
+    // 5 to 60 KB, the size of 3 to 30 seconds of 16 kbps MP3
+    std::mt19937 rng(1);
+    std::vector<string> segments(rows);
+    size_t total = 0;
+    for (auto &segment : segments)
+    {
+        segment.resize(5000 + rng() % 55000);
+        for (auto &byte : segment)
+            byte = rng();
+        total += segment.size();
+    }
+    auto file_path = [&](long row)
+    { return (files_dir / (std::to_string(row) + ".mp3")).string(); };
+
+    auto start = steady_clock::now();
+    for (long row = 0; row < rows; row++)
+        std::ofstream(file_path(row), std::ios::binary) << segments[row];
+    sync();
+    report("store one file each", rows, steady_clock::now() - start);
+
+    SegmentStore store;
+    store.open(store_dir);
+    std::vector<SegmentId> ids(rows);
+    start = steady_clock::now();
+    // 200 transmissions an hour
+    for (long row = 0; row < rows; row++)
+        store.put(segments[row], row_time(0, 1) + row * 18, ids[row]);
+    store.sync();
+    report("store packed", rows, steady_clock::now() - start);
+
+    std::vector<long> order(rows);
+    for (long row = 0; row < rows; row++)
+        order[row] = row;
+    std::shuffle(order.begin(), order.end(), rng);
+    size_t bytes = 0;
+    start = steady_clock::now();
+    for (long row : order)
+    {
+        // The least a file can cost: open, size, read, close
+        int fd = open(file_path(row).c_str(), O_RDONLY);
+        struct stat file_stat;
+        fstat(fd, &file_stat);
+        string data(file_stat.st_size, '\0');
+        bytes += std::max(0L, (long)read(fd, data.data(), data.size()));
+        close(fd);
+    }
+    report("read one file each", rows, steady_clock::now() - start);
+    string data;
+    start = steady_clock::now();
+    for (long row : order)
+        bytes += store.get(ids[row], data) ? data.size() : 0;
+    report("read packed", rows, steady_clock::now() - start);
+    if (bytes != 2 * total)
+        printf("read back %zu of %zu bytes\n", bytes, 2 * total);
+
+    auto disk_usage = [](const std::filesystem::path &dir, long &files)
+    {
+        unsigned long long used = 0;
+        files = 0;
+        for (auto &file : std::filesystem::directory_iterator(dir))
+        {
+            struct stat file_stat;
+            if (stat(file.path().c_str(), &file_stat) == 0)
+                used += file_stat.st_blocks * 512ULL;
+            files++;
+        }
+        return used;
+    };
+    long files, packs;
+    auto files_used = disk_usage(files_dir, files), packs_used = disk_usage(store_dir, packs);
+    printf("%-28s %8ld files %9.1f MiB\n", "disk one file each", files, files_used / 1048576.0);
+    printf("%-28s %8ld files %9.1f MiB\n", "disk packed", packs, packs_used / 1048576.0);
+
+    store.close();
+    std::filesystem::remove_all(files_dir);
+    std::filesystem::remove_all(store_dir);
+}
+
+// History pages by keyset against the same pages by OFFSET, near the
+// start and deep into the table, with and without a channel filter
+static void bench_history(long rows)
+{
+    Database database;
+    open_scratch(database, true);
+    search_init(database);
+    std::mt19937 rng(1);
+    time_rows("insert history", rows, database, [&](long row)
+              {
+                  const char *freq = BENCH_FREQS[row % 4];
+                  Statement insert = database.prepare(
+                      "INSERT INTO info (start_us, freq, freq_hz, duration_ms, audioPath, transcript) "
+                      "VALUES (?1, ?2, ?3, ?4, ?5, ?6);");
+                  insert.bind_int64(1, row_time(row, rows) * 1000000LL).bind_text(2, freq)
+                      .bind_int64(3, freq_hz(freq)).bind_int64(4, 1000 + row % 9000)
+                      .bind_text(5, audio_path(row)).bind_text(6, random_transcript(rng));
+                  insert.run();
+              });
+
+    const long page_rows = 20, deep = std::min(10000L, rows / page_rows / 5);
+    for (const char *filter : {"", "freq 460.05M "})
+    {
+        // Walk to the deep page by cursor, then time both pages both ways
+        string first = string(filter) + "limit " + std::to_string(page_rows), cursor;
+        for (long page = 0; page < deep; page++)
+            cursor = history(database, parse_history(first + (cursor.empty() ? "" : " after " + cursor)),
+                             [](const HistoryRow &) { return true; });
+
+        auto time_page = [&](const char *how, long page, const std::function<void()> &run)
+        {
+            const int runs = 50;
+            auto start = steady_clock::now();
+            for (int i = 0; i < runs; i++)
+                run();
+            printf("history %-14s %-7s page %6ld %9.3f ms\n", filter[0] ? "one channel," : "all channels,",
+                   how, page, duration<double, std::milli>(steady_clock::now() - start).count() / runs);
+        };
+        for (long page : {0L, deep})
+        {
+            time_page("keyset", page, [&]
+                      { history(database, parse_history(first + (page ? " after " + cursor : "")),
+                                [](const HistoryRow &) { return true; }); });
+            string sql = string("SELECT id, start_us, transcript FROM info WHERE start_us IS NOT NULL") +
+                         (filter[0] ? " AND freq_hz = 460050000" : "") +
+                         " ORDER BY start_us DESC, id DESC LIMIT ?1 OFFSET ?2;";
+            time_page("offset", page, [&]
+                      {
+                          Statement select = database.prepare(sql.c_str());
+                          select.bind_int64(1, page_rows).bind_int64(2, page * page_rows);
+                          while (select.step() == SQLITE_ROW)
+                              ;
+                      });
+        }
+    }
+    database.close();
+}
+
+// Bus to recorder messages: a retune and its status reply through a pair
+// of message queues and a second thread, as between the two processes,
+// then decoding random and damaged messages, which must never read past
+// what was received
+static void bench_messages(long rows)
+{
+    const char *request_name = "/sb_bench_request", *reply_name = "/sb_bench_reply";
+    mq_unlink(request_name);
+    mq_unlink(reply_name);
+    struct mq_attr attr = {};
+    attr.mq_maxmsg = 10;
+    attr.mq_msgsize = MESSAGE_MAX_SIZE;
+    mqd_t request = mq_open(request_name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR, &attr);
+    mqd_t reply = mq_open(reply_name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR, &attr);
+    if (request == -1 or reply == -1)
+    {
+        perror("bench mq_open");
+        return;
+    }
+
+    std::thread recorder([&]
+                         {
+                             char message[MESSAGE_MAX_SIZE];
+                             RetuneMessage retune;
+                             for (long row = 0; row < rows; row++)
+                             {
+                                 ssize_t size = mq_receive(request, message, sizeof(message), nullptr);
+                                 StatusMessage status;
+                                 if (decode_message(message, size, retune))
+                                     status.freq_hz = retune.freq_hz;
+                                 send_message(reply, status);
+                             }
+                         });
+    long wrong = 0;
+    auto start = steady_clock::now();
+    for (long row = 0; row < rows; row++)
+    {
+        send_message(request, RetuneMessage{160710000ULL + row});
+        char message[MESSAGE_MAX_SIZE];
+        ssize_t size = mq_receive(reply, message, sizeof(message), nullptr);
+        StatusMessage status;
+        wrong += not decode_message(message, size, status) or status.freq_hz != 160710000ULL + row;
+    }
+    report("message round trip", rows, steady_clock::now() - start);
+    recorder.join();
+    mq_close(request);
+    mq_close(reply);
+    mq_unlink(request_name);
+    mq_unlink(reply_name);
+
+    char buffer[MESSAGE_MAX_SIZE];
+    start = steady_clock::now();
+    for (long row = 0; row < rows; row++)
+    {
+        StatusMessage status;
+        status.freq_hz = row;
+        size_t size = encode_message(status, buffer, sizeof(buffer));
+        wrong += not decode_message(buffer, size, status) or status.freq_hz != (uint64_t)row;
+    }
+    report("message encode and decode", rows, steady_clock::now() - start);
+
+    // Valid messages damaged one way or another: random bytes, one byte
+    // changed, cut short or run on. The first two may still decode, but
+    // only as one type and only from inside the buffer; the last two never.
+    std::mt19937 rng(1);
+    char valid[8][MESSAGE_MAX_SIZE];
+    size_t valid_sizes[8] = {
+        encode_message(StartMessage{160710000, 496, 25, 8000, 4000}, valid[0], MESSAGE_MAX_SIZE),
+        encode_message(RetuneMessage{460050000}, valid[1], MESSAGE_MAX_SIZE),
+        encode_message(GainMessage{496}, valid[2], MESSAGE_MAX_SIZE),
+        encode_message(SquelchMessage{25}, valid[3], MESSAGE_MAX_SIZE),
+        encode_message(QuitMessage{}, valid[4], MESSAGE_MAX_SIZE),
+        encode_message(StatusMessage{}, valid[5], MESSAGE_MAX_SIZE),
+        encode_segment_closed({}, "/home/corey/scannerbot/audio/01-02-2023-10:00:00.mp3", valid[6], MESSAGE_MAX_SIZE),
+        encode_segment_closed({}, "", valid[7], MESSAGE_MAX_SIZE),
+    };
+    long accepted = 0, misread = 0;
+    auto decode_all = [&](const char *message, size_t size)
+    {
+        StartMessage start_message;
+        RetuneMessage retune;
+        GainMessage gain;
+        SquelchMessage squelch;
+        QuitMessage quit;
+        StatusMessage status;
+        SegmentClosedMessage segment;
+        std::string_view path;
+        int decoded = decode_message(message, size, start_message) + decode_message(message, size, retune) +
+                      decode_message(message, size, gain) + decode_message(message, size, squelch) +
+                      decode_message(message, size, quit) + decode_message(message, size, status);
+        if (decode_segment_closed(message, size, segment, path))
+        {
+            decoded++;
+            misread += path.data() < message or path.data() + path.size() > message + size;
+        }
+        misread += decoded > 1;
+        return decoded == 1;
+    };
+    start = steady_clock::now();
+    for (long row = 0; row < rows; row++)
+    {
+        int which = row % 8;
+        size_t size = valid_sizes[which];
+        memcpy(buffer, valid[which], size);
+        switch (rng() % 4)
+        {
+        case 0:
+            size = rng() % (MESSAGE_MAX_SIZE + 1);
+            for (size_t i = 0; i < size; i++)
+                buffer[i] = rng();
+            accepted += decode_all(buffer, size);
+            continue;
+        case 1:
+            buffer[rng() % size] ^= 1 + rng() % 255;
+            accepted += decode_all(buffer, size);
+            continue;
+        case 2:
+            size = rng() % size;
+            break;
+        case 3:
+            size += 1 + rng() % (MESSAGE_MAX_SIZE - size);
+            break;
+        }
+        misread += decode_all(buffer, size);
+    }
+    report("message fuzz", rows, steady_clock::now() - start);
+    printf("%ld of %ld damaged messages decoded, %ld misread, %ld round trips wrong\n",
+           accepted, rows, misread, wrong);
+}
+
+// The recorder's status block: one update as the level watcher makes per
+// read of audio, one read as the bus or a monitor makes, and reads racing
+// updates from another thread. Every field of an update is the same
+// count, so a torn read shows as fields that differ.
+static void bench_status(long rows)
+{
+    const char *name = "/sb_bench_status";
+    StatusBlock writer, reader;
+    if (not writer.create(name) or not reader.open(name))
+        return;
+
+    auto start = steady_clock::now();
+    for (long row = 0; row < rows; row++)
+        writer.update([&](RecorderStatus &status)
+                      {
+                          status.samples += 2048;
+                          status.signal_dbfs = -30;
+                          status.updated_us = row;
+                      });
+    report("status update", rows, steady_clock::now() - start);
+
+    RecorderStatus status;
+    long failed = 0;
+    start = steady_clock::now();
+    for (long row = 0; row < rows; row++)
+        failed += not reader.read(status);
+    report("status read", rows, steady_clock::now() - start);
+
+    std::atomic<bool> done = false;
+    writer.update([](RecorderStatus &status) { status = RecorderStatus{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}; });
+    std::thread recorder([&]
+                         {
+                             for (uint64_t count = 1; not done; count++)
+                                 writer.update([&](RecorderStatus &status)
+                                               {
+                                                   status.freq_hz = status.samples = status.overruns = count;
+                                                   status.segments = status.updated_us = count;
+                                               });
+                         });
+    long torn = 0;
+    start = steady_clock::now();
+    for (long row = 0; row < rows; row++)
+    {
+        if (not reader.read(status))
+        {
+            failed++;
+            continue;
+        }
+        torn += status.samples != status.freq_hz or status.overruns != status.freq_hz or
+                status.segments != status.freq_hz or status.updated_us != (int64_t)status.freq_hz;
+    }
+    report("status read while updating", rows, steady_clock::now() - start);
+    done = true;
+    recorder.join();
+    printf("%ld torn reads, %ld failed\n", torn, failed);
+
+    reader.close();
+    writer.close();
+    shm_unlink(name);
+}
+
+struct Benchmark
+{
+    const char *name;
+    std::function<void(long)> run;
+    long default_rows = 100000;
+};
+
+const std::vector<Benchmark> benchmarks = {
+    {"insert", bench_insert},
+    {"writer", bench_writer},
+    {"readers", bench_readers},
+    {"search", bench_search, 1000000},
+    {"range", bench_range, 1000000},
+    {"rollup", bench_rollup, 1000000},
+    {"mix", bench_mix},
+    {"store", bench_store, 20000},
+    {"history", bench_history, 1000000},
+    {"messages", bench_messages},
+    {"status", bench_status, 10000000},
+};
+
+int main(int argc, char *argv[])
+{
+    const char *only = argc > 1 ? argv[1] : nullptr;
+
+    for (auto &benchmark : benchmarks)
+        if (not only or strcmp(only, benchmark.name) == 0)
+            benchmark.run(argc > 2 ? atol(argv[2]) : benchmark.default_rows);
+
+    unlink(BENCH_DB_PATH);
+    return 0;
+}
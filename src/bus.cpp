@@ -1,16 +1,36 @@
-#include "sqlite3.h"
+#include "classifier.h"
+#include "config.h"
+#include "database.h"
+#include "db_writer.h"
+#include "dedupe.h"
+#include "history.h"
+#include "message.h"
+#include "outbox.h"
+#include "publisher.h"
+#include "retention.h"
+#include "rollup.h"
+#include "schema.h"
+#include "scheduler.h"
+#include "search.h"
+#include "segment_store.h"
+#include "sinks.h"
+#include "status_block.h"
 #include <atomic>
 #include <chrono>
+#include <cmath>
 #include <csignal>
 #include <cstring>
 #include <exception>
 #include <fcntl.h>
 #include <filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <mqueue.h>
 #include <mutex>
 #include <ncurses.h>
 #include <spawn.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <thread>
@@ -27,7 +47,25 @@ using namespace std::this_thread;
 using namespace std::chrono;
 using namespace std::filesystem;
 
-sqlite3 *db;
+const char *const db_path = "db/info.db";
+// The writer's connection
+Database database;
+// Use this mutex to lock database
+std::mutex dbMutex;
+// Applies every change to database in group commits
+DatabaseWriter database_writer;
+// Read-only connections for everything that queries the database
+ReaderPool database_readers;
+// Moves the WAL back into the database file in the background
+Checkpointer checkpointer;
+// Fills in the integer columns of rows from before they existed
+SchemaMigrator schema_migrator;
+// Recompresses, packs and deletes old audio and rows per channel policy
+RetentionEngine retention;
+// Archived audio, packed into a file per hour
+SegmentStore segment_store;
+// Pages of history for local clients
+HistoryServer history_server;
 
 const path audio_dir("/home/corey/scannerbot/audio");
 const path transcript_dir("/home/corey/scannerbot/transcripts/");
@@ -43,52 +81,81 @@ std::mutex threadMapMutex;
 
 // The process ID of the running recorder program, if any. Set to -1 if not
 pid_t recorder_pid = -1;
-char *currentfreq = "160.71M";
+// The recorder's live telemetry, mapped once the recorder has made it
+StatusBlock recorder_status;
+// The frequency the recorder is tuned to; new audio files are tagged with it
+string currentfreq = "160.71M";
+// Use this mutex to lock currentfreq
+std::mutex currentfreqMutex;
+
+// Orders audio files for transcription by channel priority and deadline
+TranscriptionScheduler transcription_scheduler;
+// Keeps tones, data bursts and dead carrier away from the transcriber
+SpeechClassifier speech_classifier;
+// Hands transcripts to the long-lived publish service
+PublisherClient publisher;
+// Keeps repeated announcements from being posted over and over
+DuplicateFilter duplicate_filter;
+// Durable queue between new transcripts and the publisher
+Outbox outbox;
+// Every other output for transcripts
+SinkSet sinks;
 
 // The name of the recorder posix message queue
 const char *REC_MQ_NAME = "/sb_rec_inbox";
 const char *BUS_MQ_NAME = "/sb_bus_inbox";
 // Map of posix message queue names to their file descriptors
 std::unordered_map<const char *, mqd_t> mqdMap;
+// Use this mutex to lock reading the bus inbox, so a stop waiting for
+// the recorder to quit gets its status
+std::mutex busInboxMutex;
 
 void cleanup();
 void db_init();
 void interruptHandler();
 void kill_recorder();
 void mq_init();
+bool read_recorder_message(const timespec &, bool &);
 void run_cli();
 void run_recorder(string);
+int32_t gain_tenths_db(const string &);
+void run_transcriber(const TranscriptionJob &);
 void show_help();
 void watch_directories();
 
-static int callback(void *data, int argc, char **argv, char **azColName)
-{
-    for (int i = 0; i < argc; i++)
-    {
-        std::cout << azColName[i] << ": " << (argv[i] ? argv[i] : "NULL") << std::endl;
-    }
-    std::cout << std::endl;
-    return 0;
-}
-
 void cleanup()
 {
-    sqlite3_close(db);
-
     kill_recorder();
     do_watch = false;
 
+    // Join the threads first; the directory watcher still reads, writes
+    // and waits on the outbox until it sees do_watch
+    for (auto &[function, thread] : threadMap)
+        if (thread->joinable())
+            thread->join();
+
+    transcription_scheduler.stop();
+    outbox.stop();
+    publisher.stop();
+    sinks.stop();
+
+    history_server.stop();
+    schema_migrator.stop();
+    retention.stop();
+    segment_store.close();
+    database_writer.stop();
+    checkpointer.stop();
+    database_readers.close();
+    database.close();
+
     // Clean up message queues
     for (auto &[queue_name, mqd] : mqdMap)
     {
         mq_close(mqd);
         mq_unlink(queue_name);
     }
-
-    // Clean up threads
-    for (auto &[function, thread] : threadMap)
-        if (thread->joinable())
-            thread->join();
+    recorder_status.close();
+    shm_unlink(STATUS_SHM_NAME);
 }
 
 void interruptHandler(int signum)
@@ -103,19 +170,60 @@ void interruptHandler(int signum)
     exit(signum);
 }
 
+// Reads and reports one message from the recorder, waiting until deadline
+// for it; false if none came. quitting is whether it says the recorder is.
+// The recorder drops messages rather than wait on a full inbox, so the bus
+// keeps it read.
+bool read_recorder_message(const timespec &deadline, bool &quitting)
+{
+    char message[MESSAGE_MAX_SIZE];
+    ssize_t size = mq_timedreceive(mqdMap[BUS_MQ_NAME], message, sizeof(message), nullptr, &deadline);
+    if (size == -1)
+        return false;
+    quitting = false;
+
+    StatusMessage status;
+    SegmentClosedMessage closed;
+    std::string_view closed_path;
+    if (decode_message(message, size, status))
+    {
+        cout << "\n\nRecorder sez: "
+             << (status.state == RecorderState::shell_started   ? "shell started"
+                 : status.state == RecorderState::shell_stopped ? "shell stopped"
+                                                                : "quitting");
+        if (status.shell_pid != -1)
+            cout << " [PID " << status.shell_pid << "]";
+        quitting = status.state == RecorderState::quitting;
+    }
+    else if (decode_segment_closed(message, size, closed, closed_path))
+        cout << "\n\nRecorder sez: closed " << closed_path;
+    else
+        cout << "\n\nUnreadable message from the recorder";
+    return true;
+}
+
 void kill_recorder()
 {
     if (recorder_pid == -1)
         return;
 
-    // Message the recorder to kill its shell script, if any
-    string sndmsg("quit");
-    if (recorder_pid != -1)
-        mq_send(mqdMap[REC_MQ_NAME], sndmsg.c_str(),
-                sizeof(sndmsg), 0);
-    char *retmsg = new char[64];
-    mq_receive(mqdMap[BUS_MQ_NAME], retmsg, 64, 0);
-    cout << "\n\nRecorder sez: " << retmsg;
+    std::lock_guard<std::mutex> lock(busInboxMutex);
+
+    // Whatever is still queued from before can't be the answer. A deadline
+    // already past still gets messages that are there.
+    timespec deadline = {0, 0};
+    bool quitting = false;
+    while (read_recorder_message(deadline, quitting))
+        ;
+
+    // Message the recorder to kill its shell script, if any, and wait a
+    // little for it to say it has
+    send_message(mqdMap[REC_MQ_NAME], QuitMessage{});
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 2;
+    quitting = false;
+    while (not quitting and read_recorder_message(deadline, quitting))
+        ;
 
     // Kill entire recorder process group
     if (kill(recorder_pid, SIGTERM) == -1)
@@ -128,11 +236,20 @@ void kill_recorder()
     recorder_pid = -1;
 }
 
+// A gain in dB, as rtl_fm takes it, in tenths; MESSAGE_UNSET if it isn't one
+int32_t gain_tenths_db(const string &gain)
+{
+    char *end;
+    double value = strtod(gain.c_str(), &end);
+    return end == gain.c_str() ? MESSAGE_UNSET : (int32_t)lround(value * 10);
+}
+
 void run_recorder(string args)
 {
     // Terminate any existing recorder process
     kill_recorder();
-    char **recorder_args = new char *[20];
+    char recorder_name[] = "recorder";
+    char *recorder_args[] = {recorder_name, nullptr};
     // auto file_actions = posix_spawn_file_actions_init();
     int spawn_err = posix_spawn(&recorder_pid,
                                 "/home/corey/scannerbot/bin/recorder",
@@ -144,8 +261,26 @@ void run_recorder(string args)
         exit(EXIT_FAILURE);
     }
 
-    // Send command to recorder process
-    mq_send(mqdMap[REC_MQ_NAME], args.c_str(), sizeof(args), 0);
+    // Send command to recorder process, given as "start [f <freq>]
+    // [g <gain>] [l <squelch>] [s <rate>] [r <rate>]"
+    StartMessage start;
+    std::stringstream options(args);
+    string option, arg;
+    options >> option;
+    while (options >> option >> arg)
+    {
+        if (option == "f")
+            start.freq_hz = freq_hz(arg);
+        else if (option == "g")
+            start.gain_tenths_db = gain_tenths_db(arg);
+        else if (option == "l")
+            start.squelch = atoi(arg.c_str());
+        else if (option == "s")
+            start.sample_rate = freq_hz(arg);
+        else if (option == "r")
+            start.resample_rate = freq_hz(arg);
+    }
+    send_message(mqdMap[REC_MQ_NAME], start);
 
     cout << "\nRecorder has PID " << recorder_pid;
     int status;
@@ -156,10 +291,26 @@ void run_recorder(string args)
         cout << "\nRecorder did not exit normally";
 }
 
+void run_transcriber(const TranscriptionJob &job)
+{
+    string command = "python3 " +
+                     config_get("TRANSCRIBER_SCRIPT", "/home/corey/scannerbot/src/transcriber.py") +
+                     " \"";
+    command += job.audio_path;
+    command += "\"";
+    command += " > /dev/null";
+    [[maybe_unused]] int trans_ret_status = system(command.c_str());
+}
+
 void watch_directories()
 {
     unordered_set<string> seen_audio_files;
     unordered_set<string> seen_transcript_files;
+    // Channel each queued audio file was recorded on, by file stem, so its
+    // transcript can be grouped with others from the same channel
+    std::unordered_map<string, string> audio_channels;
+    // Duplicate filter's verdict on transcripts not yet stored, by file stem
+    std::unordered_map<string, bool> duplicate_transcripts;
 
     while (not do_shutdown and do_watch)
     {
@@ -202,81 +353,153 @@ void watch_directories()
             if (not is_regular_file(file.status()))
                 continue;
 
-            // Prepare to push to database
-            struct tm *raw = localtime(&audio_file_stats.st_ctim.tv_sec);
-            char time_buf[32];
-            memset(time_buf, '\0', 32);
-            strftime(time_buf, 32, "%d-%m-%Y %H:%M:%S", raw);
-            char date[16];
-            memset(date, '\0', 16);
-            char time[16];
-            memset(time, '\0', 16);
-            strncpy(date, time_buf, strcspn(time_buf, " "));
-            date[11] = '\0';
-            strcpy(time, strchr(time_buf, ' ')+1);
-            
-            char insert_command[1024];
-            memset(insert_command, '\0', 1024);
-            // Append command start
-            string command_prefix = "INSERT INTO info (date, time, audioPath) VALUES (";
-            strncat(insert_command, command_prefix.c_str(), command_prefix.length());
-            insert_command[strlen(insert_command)] = ' ';
-            // Append date
-            insert_command[strlen(insert_command)] = '\'';
-            strncat(insert_command, date, strlen(date));
-            insert_command[strlen(insert_command)] = '\'';
-            insert_command[strlen(insert_command)] = ',';
-            // Append time
-            insert_command[strlen(insert_command)] = '\'';
-            strncat(insert_command, time, strlen(time));
-            insert_command[strlen(insert_command)] = '\'';
-            insert_command[strlen(insert_command)] = ',';
-            // Append audio file path
-            insert_command[strlen(insert_command)] = '\'';
-            strncat(insert_command, path_buf, strlen(path_buf));
-            // Append command end
-            string command_postfix = "\');";
-            strncat(insert_command, command_postfix.c_str(), command_postfix.length());
-
-            cout << "\n" << insert_command;
-
-            char * errmsg = 0;
-            int resultcode = sqlite3_exec(db, insert_command, callback, 0, &errmsg);
-            if (resultcode != SQLITE_OK)
+            // Already recorded before a restart. A segment still without a
+            // transcript was queued when the bus stopped; unless its
+            // transcript is written and waiting to be stored, queue it again.
             {
-                std::cerr << "SQL error: " << errmsg << std::endl;
-                sqlite3_free(errmsg);
+                bool recorded = false, transcribed = false;
+                string recorded_freq;
+                {
+                    ReaderPool::Lease db = database_readers.acquire();
+                    Statement known = db->prepare(
+                        "SELECT transcript IS NOT NULL, coalesce(freq, '') FROM info WHERE segment = ?1;");
+                    known.bind_text(1, file.path().stem());
+                    if (known.step() == SQLITE_ROW)
+                    {
+                        recorded = true;
+                        transcribed = known.column_int64(0);
+                        recorded_freq = known.column_text(1);
+                    }
+                }
+                if (recorded)
+                {
+                    string stem = file.path().stem();
+                    if (not transcribed and not exists(transcript_dir / (stem + ".txt")))
+                    {
+                        cout << "\nRequeueing " << file.path() << " for transcription";
+                        audio_channels[stem] = recorded_freq;
+                        transcription_scheduler.submit(file.path(), recorded_freq);
+                    }
+                    continue;
+                }
             }
 
-            //  Send the new audio file to the transcriber.
-            string command = "python3 /home/corey/scannerbot/src/transcriber.py \"";
-            command += file.path();
-            command += "\"";
-            command += " > /dev/null";
-            [[maybe_unused]] int trans_ret_status = system(command.c_str());
+            // Segments without speech are archived but never transcribed.
+            path audio_path = file.path();
+            std::vector<int16_t> pcm;
+            bool speech = true;
+            if (speech_classifier.decode(audio_path, pcm))
+            {
+                SegmentFeatures features = speech_classifier.features(pcm);
+                speech = speech_classifier.is_speech(features);
+                speech_classifier.record(speech);
+                if (not speech)
+                {
+                    cout << "\nNo speech in " << audio_path << " (voiced "
+                         << features.voiced_fraction << ", modulation "
+                         << features.energy_modulation << "), archiving.";
+                    std::error_code err;
+                    create_directories(audio_dir / "archive", err);
+                    path archived = audio_dir / "archive" / audio_path.filename();
+                    rename(audio_path, archived, err);
+                    if (not err)
+                        audio_path = archived;
+                }
+            }
+            string freq;
+            {
+                std::lock_guard<std::mutex> lock(currentfreqMutex);
+                freq = currentfreq;
+            }
+
+            // Push to database. The file was last written as the segment
+            // closed, so that is its end.
+            long long end_us = audio_file_stats.st_mtim.tv_sec * 1000000LL + audio_file_stats.st_mtim.tv_nsec / 1000;
+            long long duration_ms = pcm.size() * 1000LL / SpeechClassifier::SAMPLE_RATE;
+            // Nothing waits on the row; the transcript's update is queued
+            // behind it.
+            database_writer.submit(
+                [audio_path, freq, end_us, duration_ms](Database &db)
+                {
+                    Statement insert = db.prepare(
+                        "INSERT INTO info (audioPath, freq, freq_hz, start_us, end_us, duration_ms, segment) "
+                        "VALUES (?1, ?2, nullif(?3, 0), ?4 - ?5 * 1000, ?4, nullif(?5, 0), ?6);");
+                    insert.bind_text(1, audio_path).bind_text(2, freq).bind_int64(3, freq_hz(freq))
+                        .bind_int64(4, end_us).bind_int64(5, duration_ms).bind_text(6, audio_path.stem());
+                    return insert.run();
+                });
+            cout << "\nAdded " << audio_path << " to the database";
+
+            if (not speech)
+                continue;
+
+            //  Queue the new audio file for the transcriber.
+            audio_channels[audio_path.stem()] = freq;
+            transcription_scheduler.submit(audio_path, freq);
         }
 
-        // Handle new transcripts.
+        // Handle new transcripts. Their writes are all queued before any is
+        // waited on, so a backlog is committed in a few batches.
+        struct StoredTranscript
+        {
+            path file;
+            string stem, text;
+            std::future<bool> stored;
+        };
+        std::vector<StoredTranscript> stored_transcripts;
         for (auto &file : directory_iterator(transcript_dir))
         {
             if (seen_transcript_files.count(file.path()) > 0)
                 continue;
 
+            // Skip subdirectories such as the streaming transcriber's live
+            // hypotheses; file_size() throws on them.
+            if (not is_regular_file(file.status()))
+                continue;
+
             // The file is too small to bother with.
             if (file.file_size() < 16)
                 continue;
 
             seen_transcript_files.insert(file.path());
 
-            if (not is_regular_file(file.status()))
+            // Store the new transcript and queue it for the publisher.
+            std::ifstream transcript(file.path());
+            std::stringstream text;
+            text << transcript.rdbuf();
+            string stem = file.path().stem();
+            // Near-duplicates are still stored, just not posted. Decide once
+            // so a retry doesn't match the transcript against itself.
+            auto decided = duplicate_transcripts.find(stem);
+            if (decided == duplicate_transcripts.end())
+                decided = duplicate_transcripts.emplace(
+                    stem, duplicate_filter.is_duplicate(audio_channels[stem], text.str())).first;
+            if (decided->second)
+                cout << "Not posting " << stem << ", it repeats a recent transcript" << std::endl;
+            stored_transcripts.push_back(
+                {file.path(), stem, text.str(),
+                 outbox.add_transcript(stem, text.str(), audio_channels[stem], not decided->second)});
+        }
+
+        for (auto &transcript : stored_transcripts)
+        {
+            if (not transcript.stored.get())
+            {
+                seen_transcript_files.erase(transcript.file); // Try again next pass
                 continue;
+            }
+            sinks.submit({transcript.stem, audio_channels[transcript.stem], transcript.text, time(nullptr)});
+            audio_channels.erase(transcript.stem);
+            duplicate_transcripts.erase(transcript.stem);
+        }
 
-            // Send the new transcript file to the publisher.
-            string command = "python3 /home/corey/scannerbot/src/publisher.py \"";
-            command += file.path();
-            command += "\"";
-            command += " > /dev/null";
-            [[maybe_unused]] int pub_ret_status = system(command.c_str());
+        // Catch up on what the recorder has said
+        {
+            std::lock_guard<std::mutex> lock(busInboxMutex);
+            timespec deadline = {0, 0};
+            bool quitting;
+            while (read_recorder_message(deadline, quitting))
+                ;
         }
 
         sleep_for(5s);
@@ -293,7 +516,20 @@ void show_help()
          << R"(    h   help      Show this list of commands   )" << '\n'
          << R"(    f   freq      Set radio frequency          )" << '\n'
          << R"(    g   gain      Set radio gain               )" << '\n'
-         << R"(    l   squelch   Set radio quelch             )"
+         << R"(    l   squelch   Set radio quelch             )" << '\n'
+         << R"(        stats     Show transcription latencies )" << '\n'
+         << R"(        search    Find transcripts by words,   )" << '\n'
+         << R"(                  e.g. search fire* since      )" << '\n'
+         << R"(                  2023-01-02 freq 160.71M      )" << '\n'
+         << R"(        activity  Show transmissions and      )" << '\n'
+         << R"(                  airtime per channel, e.g.    )" << '\n'
+         << R"(                  activity day since 2023-01-02)" << '\n'
+         << R"(        history   Page through transmissions, )" << '\n'
+         << R"(                  e.g. history freq 160.71M    )" << '\n'
+         << R"(        audio     Copy a row's audio to a file,)" << '\n'
+         << R"(                  e.g. audio 1234 out.mp3      )" << '\n'
+         << R"(        export    Write new rows to a Parquet  )" << '\n'
+         << R"(                  file for analytics           )"
          << std::endl;
 }
 
@@ -317,7 +553,26 @@ void run_cli()
 
             // Launch recorder
             if (threadMap.count("run_recorder") == 0)
+            {
+                // Remember the starting frequency, given as "f <freq>"
+                std::stringstream options(args);
+                string option, arg;
+                while (options >> option >> arg)
+                    if (option == "f")
+                    {
+                        std::lock_guard<std::mutex> lock(currentfreqMutex);
+                        currentfreq = arg;
+                    }
+
                 threadMap["run_recorder"] = new thread(run_recorder, user_input);
+            }
+
+            // Launch transcription workers
+            transcription_scheduler.start(config_get_int("TRANSCRIBE_WORKERS", 1),
+                                          run_transcriber);
+            publisher.start();
+            outbox.start(publisher);
+            sinks.start();
 
             // Launch directory watchers
             do_watch = true;
@@ -338,26 +593,49 @@ void run_cli()
             if (threadMap["watch_directories"]->joinable())
                 threadMap["watch_directories"]->join();
             threadMap.erase("watch_directories");
+
+            transcription_scheduler.stop();
+            outbox.stop();
+            publisher.stop();
+            sinks.stop();
         }
 
         else if (command == "gain" or command == "g")
         {
-            string message("gain " + args);
-            if (recorder_pid != -1)
-                mq_send(mqdMap[REC_MQ_NAME], message.c_str(),
-                        sizeof(message), 0);
+            GainMessage message{gain_tenths_db(args)};
+            if (recorder_pid == -1)
+                cout << "\nThe recorder has not started yet.";
+            else if (message.gain_tenths_db == MESSAGE_UNSET)
+                cout << "\nNot a gain.";
             else
+                send_message(mqdMap[REC_MQ_NAME], message);
+        }
+
+        else if (command == "squelch" or command == "l")
+        {
+            char *end;
+            SquelchMessage message{(int32_t)strtol(args.c_str(), &end, 10)};
+            if (recorder_pid == -1)
                 cout << "\nThe recorder has not started yet.";
+            else if (end == args.c_str())
+                cout << "\nNot a squelch level.";
+            else
+                send_message(mqdMap[REC_MQ_NAME], message);
         }
 
         else if (command == "frequency" or command == "freq" or command == "f")
         {
-            string message("freq " + args);
-            if (recorder_pid != -1)
-                mq_send(mqdMap[REC_MQ_NAME], message.c_str(),
-                        sizeof(message), 0);
-            else
+            RetuneMessage message{(uint64_t)freq_hz(args)};
+            if (recorder_pid == -1)
                 cout << "\nThe recorder has not started yet.";
+            else if (message.freq_hz == 0)
+                cout << "\nNot a frequency.";
+            else
+            {
+                send_message(mqdMap[REC_MQ_NAME], message);
+                std::lock_guard<std::mutex> lock(currentfreqMutex);
+                currentfreq = args;
+            }
         }
 
         else if (command == "quit" or command == "q")
@@ -366,6 +644,119 @@ void run_cli()
             exit(EXIT_SUCCESS);
         }
 
+        else if (command == "stats")
+        {
+            if (not recorder_status.is_open())
+                recorder_status.open();
+            recorder_status.print(cout);
+            transcription_scheduler.print_stats(cout);
+            speech_classifier.print_stats(cout);
+            duplicate_filter.print_stats(cout);
+            database_writer.print_stats(cout);
+            checkpointer.print_stats(cout);
+            schema_migrator.print_stats(cout);
+            retention.print_stats(cout);
+            segment_store.print_stats(cout);
+            history_server.print_stats(cout);
+            publisher.print_stats(cout);
+            outbox.print_stats(cout);
+            sinks.print_stats(cout);
+        }
+
+        else if (command == "search")
+        {
+            SearchQuery query = parse_search(args == command ? "" : args);
+            if (query.words.empty())
+                cout << "\nUsage: search <words> [since <when>] [until <when>] [freq <freq>] [limit <n>]";
+            else
+            {
+                ReaderPool::Lease db = database_readers.acquire();
+                print_hits(cout, search(*db, query));
+            }
+        }
+
+        else if (command == "activity")
+        {
+            ReaderPool::Lease db = database_readers.acquire();
+            print_activity(cout, activity(*db, parse_activity(args == command ? "" : args)));
+        }
+
+        else if (command == "history")
+        {
+            HistoryQuery query = parse_history(args == command ? "" : args);
+            string next;
+            {
+                ReaderPool::Lease db = database_readers.acquire();
+                next = history(*db, query, [](const HistoryRow &row)
+                               {
+                                   print_history_row(cout, row);
+                                   return true;
+                               });
+            }
+            if (not next.empty())
+                cout << "\nMore with: history " << (args == command ? "" : args + " ") << "after " << next;
+        }
+
+        else if (command == "audio")
+        {
+            // Copies a row's audio out, from its file or the segment store
+            std::stringstream options(args == command ? "" : args);
+            long long id = 0;
+            string out_path;
+            options >> id >> out_path;
+            string audio_path;
+            {
+                ReaderPool::Lease db = database_readers.acquire();
+                Statement select = db->prepare("SELECT coalesce(audioPath, '') FROM info WHERE id = ?1;");
+                select.bind_int64(1, id);
+                if (select.step() == SQLITE_ROW)
+                    audio_path = select.column_text(0);
+            }
+            SegmentId segment;
+            string data;
+            std::error_code err;
+            if (out_path.empty())
+                cout << "\nUsage: audio <id> <file>";
+            else if (audio_path.empty())
+                cout << "\nNo audio for row " << id;
+            else if (not SegmentId::parse(audio_path, segment))
+                copy_file(audio_path, out_path, copy_options::overwrite_existing, err);
+            else if (segment_store.get(segment, data))
+                std::ofstream(out_path, std::ios::binary) << data;
+            else
+                cout << "\nCan't read " << audio_path;
+            if (err)
+                cout << "\nCan't copy " << audio_path << ": " << err.message();
+        }
+
+        else if (command == "export")
+        {
+            // The exporter reads its own snapshot of the database, so the
+            // bus keeps recording while it runs
+            string script = config_get("EXPORTER_SCRIPT", "/home/corey/scannerbot/src/exporter.py");
+
+            // Only the exporter's own options go on the shell command line,
+            // given as "export [--format parquet|arrow] [--full]"
+            std::stringstream words(args == command ? "" : args);
+            string word, options;
+            bool valid = true;
+            while (valid and words >> word)
+            {
+                if (word == "--full")
+                    options += " --full";
+                else if (word == "--format" and words >> word and (word == "parquet" or word == "arrow"))
+                    options += " --format " + word;
+                else
+                    valid = false;
+            }
+            if (valid)
+            {
+                [[maybe_unused]] int export_ret_status = system(("python3 " + script + options).c_str());
+            }
+            else
+                cout << "\nUsage: export [--format parquet|arrow] [--full]";
+        }
+
         else if (command == "help" or command == "h")
         {
             show_help();
@@ -386,7 +777,7 @@ void mq_init()
     mq_unlink(REC_MQ_NAME);
     struct mq_attr attr;   // Message queue attributes
     attr.mq_maxmsg = 10;   // Maximum number of messages in the queue
-    attr.mq_msgsize = 256; // Maximum message size (in bytes)
+    attr.mq_msgsize = MESSAGE_MAX_SIZE; // Maximum message size (in bytes)
 
     // Connect to the bus inbox for reading messages from other modules
     mqdMap[BUS_MQ_NAME] = mq_open(BUS_MQ_NAME, O_CREAT | O_RDONLY, S_IRUSR | S_IWUSR, &attr);
@@ -409,36 +800,42 @@ void mq_init()
 
 void db_init()
 {
-    char *errmsg = 0;
-
-    // Open database
-    int resultcode = sqlite3_open("db/info.db", &db);
-    if (resultcode != SQLITE_OK)
     {
-        cout << "Can't open database: " << sqlite3_errmsg(db) << '\n';
-        sqlite3_close(db);
-    }
+        std::lock_guard<std::mutex> lock(dbMutex);
+        if (not database.open(db_path))
+            return;
 
-    // Create table
-    const char *createTableSQL =
-        "CREATE TABLE IF NOT EXISTS info(\
-            id INTEGER PRIMARY KEY AUTOINCREMENT,\
-            date TEXT, time TEXT, freq TEXT, agency TEXT,\
-            transcript TEXT, audioPath TEXT,\
-            postID TEXT, postURL TEXT);";
-
-    resultcode = sqlite3_exec(db, createTableSQL, callback, 0, &errmsg);
-    if (resultcode != SQLITE_OK)
-    {
-        std::cerr << "SQL error: " << errmsg << std::endl;
-        sqlite3_free(errmsg);
+        schema_init(database);
+        search_init(database);
+        rollup_init(database);
     }
+    database_readers.open(db_path, config_get_int("DB_READERS", 4));
+    checkpointer.start(db_path, database);
+    database_writer.start(&database, &dbMutex);
+    outbox.init(&database_writer, &database_readers);
+    schema_migrator.start(&database_writer, &database_readers);
+    bool store_open = segment_store.open(config_get("SEGMENT_STORE_DIR", "/home/corey/scannerbot/audio/packs"));
+    retention.start(&database_writer, &database_readers, store_open ? &segment_store : nullptr);
+    history_server.start(&database_readers);
 }
 
 int main()
 {
     signal(SIGINT, interruptHandler); // Handler for keyboard interrupt
 
+    config_load();
+    transcription_scheduler.configure();
+    speech_classifier.configure();
+    duplicate_filter.configure();
+    database_writer.configure();
+    checkpointer.configure();
+    schema_migrator.configure();
+    retention.configure();
+    history_server.configure();
+    publisher.configure();
+    outbox.configure();
+    sinks.configure();
+
     mq_init(); // Set up inter-process communication
     db_init();
 
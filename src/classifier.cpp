@@ -0,0 +1,204 @@
+#include "classifier.h"
+#include "config.h"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using std::string;
+using std::vector;
+
+double frame_rms(const int16_t *x, size_t n)
+{
+    int64_t sum = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    // madd squares eight samples and adds neighbouring pairs into four
+    // 32-bit lanes; widen to 64 bits before they can overflow.
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i));
+        __m128i squares = _mm_madd_epi16(v, v);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(squares, _mm_setzero_si128()));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(squares, _mm_setzero_si128()));
+    }
+    int64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < n; i++)
+        sum += int32_t(x[i]) * x[i];
+    return n == 0 ? 0 : std::sqrt(double(sum) / n);
+}
+
+size_t zero_crossings(const int16_t *x, size_t n)
+{
+    size_t crossings = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    // Signs differ where the xor of neighbours is negative; the arithmetic
+    // shift turns that into -1 per crossing. Lanes are 16 bits, so empty
+    // them before they can wrap.
+    while (i + 9 <= n)
+    {
+        __m128i acc = _mm_setzero_si128();
+        for (size_t block = 0; block < 0xffff and i + 9 <= n; block++, i += 8)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i + 1));
+            acc = _mm_sub_epi16(acc, _mm_srai_epi16(_mm_xor_si128(a, b), 15));
+        }
+        uint16_t lanes[8];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+        for (uint16_t lane : lanes)
+            crossings += lane;
+    }
+#endif
+    for (; i + 1 < n; i++)
+        crossings += (x[i] ^ x[i + 1]) < 0;
+    return crossings;
+}
+
+double spectral_flatness(const int16_t *x, size_t n)
+{
+    // Frames are always SpeechClassifier::FRAME long, so the window and
+    // twiddles are computed once.
+    const size_t N = SpeechClassifier::FRAME;
+    static const vector<double> window = []
+    {
+        vector<double> w;
+        for (size_t i = 0; i < N; i++)
+            w.push_back(0.5 - 0.5 * std::cos(2 * M_PI * i / (N - 1)));
+        return w;
+    }();
+    static const vector<std::complex<double>> twiddles = []
+    {
+        vector<std::complex<double>> t;
+        for (size_t i = 0; i < N / 2; i++)
+            t.push_back(std::polar(1.0, -2 * M_PI * i / N));
+        return t;
+    }();
+    if (n != N)
+        return 1.0;
+
+    // Bit-reversed load, then iterative radix-2 FFT
+    std::complex<double> bins[N];
+    for (size_t i = 0, j = 0; i < N; i++)
+    {
+        bins[j] = x[i] * window[i];
+        for (size_t bit = N >> 1; (j ^= bit) < bit; bit >>= 1)
+            ;
+    }
+    for (size_t len = 2; len <= N; len <<= 1)
+        for (size_t start = 0; start < N; start += len)
+            for (size_t k = 0; k < len / 2; k++)
+            {
+                auto t = twiddles[k * (N / len)] * bins[start + k + len / 2];
+                bins[start + k + len / 2] = bins[start + k] - t;
+                bins[start + k] += t;
+            }
+
+    double log_sum = 0, sum = 0;
+    for (size_t k = 1; k <= N / 2; k++)
+    {
+        double power = std::norm(bins[k]) + 1e-3;
+        log_sum += std::log(power);
+        sum += power;
+    }
+    double bins_used = N / 2;
+    return std::exp(log_sum / bins_used) / (sum / bins_used);
+}
+
+void SpeechClassifier::configure()
+{
+    min_energy = config_get_double("CLASSIFIER_MIN_RMS", min_energy);
+    min_flatness = config_get_double("CLASSIFIER_MIN_FLATNESS", min_flatness);
+    max_flatness = config_get_double("CLASSIFIER_MAX_FLATNESS", max_flatness);
+    min_zcr = config_get_double("CLASSIFIER_MIN_ZCR", min_zcr);
+    max_zcr = config_get_double("CLASSIFIER_MAX_ZCR", max_zcr);
+    min_voiced_fraction = config_get_double("CLASSIFIER_MIN_VOICED_FRACTION", min_voiced_fraction);
+    min_energy_modulation = config_get_double("CLASSIFIER_MIN_ENERGY_MODULATION", min_energy_modulation);
+}
+
+bool SpeechClassifier::decode(const string &audio_path, vector<int16_t> &pcm)
+{
+    string command = "sox -V1 \"" + audio_path + "\" -t raw -r " +
+                     std::to_string(SAMPLE_RATE) + " -e signed -b 16 -c 1 -";
+    FILE *sox = popen(command.c_str(), "r");
+    if (sox == nullptr)
+    {
+        perror("Unable to run sox");
+        return false;
+    }
+
+    pcm.clear();
+    int16_t buf[4096];
+    size_t got;
+    while ((got = fread(buf, sizeof(int16_t), 4096, sox)) > 0)
+        pcm.insert(pcm.end(), buf, buf + got);
+
+    return pclose(sox) == 0;
+}
+
+SegmentFeatures SpeechClassifier::features(const vector<int16_t> &pcm)
+{
+    SegmentFeatures f;
+    f.samples = pcm.size();
+
+    double energy_sum = 0, energy_sq_sum = 0;
+    size_t voiced = 0;
+    for (size_t start = 0; start + FRAME <= pcm.size(); start += FRAME)
+    {
+        const int16_t *frame = pcm.data() + start;
+        double rms = frame_rms(frame, FRAME);
+        double zcr = double(zero_crossings(frame, FRAME)) / FRAME;
+        double flatness = spectral_flatness(frame, FRAME);
+
+        f.frames++;
+        energy_sum += rms;
+        energy_sq_sum += rms * rms;
+        f.mean_flatness += flatness;
+        f.mean_zcr += zcr;
+        if (rms >= min_energy and flatness >= min_flatness and flatness <= max_flatness and
+            zcr >= min_zcr and zcr <= max_zcr)
+            voiced++;
+    }
+
+    if (f.frames == 0)
+        return f;
+
+    double mean_energy = energy_sum / f.frames;
+    double variance = std::max(0.0, energy_sq_sum / f.frames - mean_energy * mean_energy);
+    f.energy_modulation = mean_energy > 0 ? std::sqrt(variance) / mean_energy : 0;
+    f.voiced_fraction = double(voiced) / f.frames;
+    f.mean_flatness /= f.frames;
+    f.mean_zcr /= f.frames;
+    return f;
+}
+
+bool SpeechClassifier::is_speech(const SegmentFeatures &f)
+{
+    return f.voiced_fraction >= min_voiced_fraction and
+           f.energy_modulation >= min_energy_modulation;
+}
+
+void SpeechClassifier::record(bool speech)
+{
+    classified++;
+    if (not speech)
+        skipped++;
+}
+
+void SpeechClassifier::print_stats(std::ostream &out)
+{
+    unsigned long total = classified;
+    out << "\nSpeech classifier: " << skipped << " of " << total
+        << " segments archived without transcription";
+    if (total > 0)
+        out << " (" << 100.0 * skipped / total << "% of inference avoided)";
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Per-segment summary of the frame features
+struct SegmentFeatures
+{
+    size_t samples = 0;
+    size_t frames = 0;
+    // Fraction of frames that look like voiced speech
+    double voiced_fraction = 0;
+    // Coefficient of variation of frame energy; speech is bursty, tones and
+    // carrier are steady
+    double energy_modulation = 0;
+    double mean_flatness = 0;
+    double mean_zcr = 0;
+};
+
+/*
+ * Cheap speech/non-speech check run before a segment is sent to Whisper.
+ *
+ * The segment is decoded to 8 kHz PCM and split into 32 ms frames. Each
+ * frame gets an energy, a zero-crossing rate and a spectral flatness. Tones
+ * have near-zero flatness and steady energy, data bursts and open carrier
+ * have high flatness or zero-crossing rates, and speech sits in between
+ * with strongly modulated energy.
+ */
+class SpeechClassifier
+{
+public:
+    static const unsigned SAMPLE_RATE = 8000;
+    static const size_t FRAME = 256;
+
+    // Reads thresholds from the config
+    void configure();
+    // Decodes the audio file with sox; returns false if that fails
+    bool decode(const std::string &audio_path, std::vector<int16_t> &pcm);
+    SegmentFeatures features(const std::vector<int16_t> &pcm);
+    bool is_speech(const SegmentFeatures &features);
+    // Counts the decision toward the inference-avoided figure
+    void record(bool speech);
+    void print_stats(std::ostream &out);
+
+private:
+    double min_energy = 300;
+    double min_flatness = 0.001;
+    double max_flatness = 0.35;
+    double min_zcr = 0.02;
+    double max_zcr = 0.35;
+    double min_voiced_fraction = 0.2;
+    double min_energy_modulation = 0.3;
+
+    std::atomic<unsigned long> classified = 0;
+    std::atomic<unsigned long> skipped = 0;
+};
+
+// Root mean square and number of sign changes, vectorized where possible
+double frame_rms(const int16_t *x, size_t n);
+size_t zero_crossings(const int16_t *x, size_t n);
+// Geometric over arithmetic mean of the Hann-windowed power spectrum
+double spectral_flatness(const int16_t *x, size_t n);
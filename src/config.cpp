@@ -0,0 +1,86 @@
+#include "config.h"
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+
+using std::string;
+
+// Values from the last config_load(), keyed by setting name
+static std::unordered_map<string, string> settings;
+// Use this mutex to lock settings
+static std::mutex settingsMutex;
+
+static string trim(const string &s)
+{
+    size_t first = s.find_first_not_of(" \t\r");
+    if (first == string::npos)
+        return "";
+    size_t last = s.find_last_not_of(" \t\r");
+    return s.substr(first, last - first + 1);
+}
+
+void config_load(const char *path)
+{
+    std::ifstream file(path);
+    if (not file)
+    {
+        std::cerr << "\nCan't open config file " << path << ", using defaults.";
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(settingsMutex);
+    string line;
+    while (getline(file, line))
+    {
+        // Drop comments
+        line = line.substr(0, line.find('#'));
+        size_t equals = line.find('=');
+        if (equals == string::npos)
+            continue;
+
+        string key = trim(line.substr(0, equals));
+        string value = trim(line.substr(equals + 1));
+        // Strip optional quotes
+        if (value.size() >= 2 and (value.front() == '"' or value.front() == '\'') and
+            value.back() == value.front())
+            value = value.substr(1, value.size() - 2);
+
+        settings[key] = value;
+    }
+}
+
+string config_get(const string &key, const string &fallback)
+{
+    std::lock_guard<std::mutex> lock(settingsMutex);
+    auto setting = settings.find(key);
+    if (setting == settings.end() or setting->second.empty())
+        return fallback;
+    return setting->second;
+}
+
+long config_get_int(const string &key, long fallback)
+{
+    try
+    {
+        return std::stol(config_get(key, std::to_string(fallback)));
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "\nBad value for " << key << " in config.";
+        return fallback;
+    }
+}
+
+double config_get_double(const string &key, double fallback)
+{
+    try
+    {
+        return std::stod(config_get(key, std::to_string(fallback)));
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "\nBad value for " << key << " in config.";
+        return fallback;
+    }
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+
+// Settings shared with the Python helpers, stored as KEY=VALUE lines
+const char *const CONFIG_PATH = "/home/corey/scannerbot/config/scannerbot.env";
+
+void config_load(const char *path = CONFIG_PATH);
+std::string config_get(const std::string &key, const std::string &fallback = "");
+long config_get_int(const std::string &key, long fallback);
+double config_get_double(const std::string &key, double fallback);
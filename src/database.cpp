@@ -0,0 +1,254 @@
+#include "database.h"
+#include "config.h"
+#include <algorithm>
+#include <iostream>
+
+using std::string;
+
+Statement::~Statement()
+{
+    reset();
+}
+
+void Statement::reset()
+{
+    if (stmt)
+    {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+}
+
+Statement &Statement::bind_text(int index, const string &value)
+{
+    sqlite3_bind_text(stmt, index, value.c_str(), value.size(), SQLITE_TRANSIENT);
+    return *this;
+}
+
+Statement &Statement::bind_int64(int index, sqlite3_int64 value)
+{
+    sqlite3_bind_int64(stmt, index, value);
+    return *this;
+}
+
+Statement &Statement::bind_null(int index)
+{
+    sqlite3_bind_null(stmt, index);
+    return *this;
+}
+
+int Statement::step()
+{
+    if (not stmt)
+        return SQLITE_MISUSE;
+    int resultcode = sqlite3_step(stmt);
+    if (resultcode != SQLITE_ROW and resultcode != SQLITE_DONE)
+        std::cerr << "SQL error: " << sqlite3_errmsg(sqlite3_db_handle(stmt)) << std::endl;
+    return resultcode;
+}
+
+bool Statement::run()
+{
+    int resultcode;
+    while ((resultcode = step()) == SQLITE_ROW)
+        ;
+    return resultcode == SQLITE_DONE;
+}
+
+bool Statement::column_null(int column)
+{
+    return sqlite3_column_type(stmt, column) == SQLITE_NULL;
+}
+
+sqlite3_int64 Statement::column_int64(int column)
+{
+    return sqlite3_column_int64(stmt, column);
+}
+
+string Statement::column_text(int column)
+{
+    const unsigned char *text = sqlite3_column_text(stmt, column);
+    return text ? string((const char *)text, sqlite3_column_bytes(stmt, column)) : string();
+}
+
+bool Database::open(const char *path, bool read_only)
+{
+    // Another SQLite than the vendored one was linked, without our options.
+    // Said once, not for every connection.
+    static const bool version_checked = []
+    {
+        if (sqlite3_libversion_number() != SQLITE_VERSION_NUMBER)
+            std::cerr << "SQLite " << sqlite3_libversion() << " linked, built against "
+                      << SQLITE_VERSION << std::endl;
+        return true;
+    }();
+    (void)version_checked;
+
+    int flags = read_only ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    if (sqlite3_open_v2(path, &db, flags, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "Can't open database: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_close(db);
+        db = nullptr;
+        return false;
+    }
+
+    // WAL is a property of the file, so only the writer needs to ask.
+    // NORMAL syncs at checkpoints rather than every commit, which in WAL
+    // mode can lose the last commits on power loss but never corrupts.
+    sqlite3_busy_timeout(db, 5000);
+    string tuning = "PRAGMA synchronous = " + config_get("DB_SYNCHRONOUS", "NORMAL") + ";"
+                    "PRAGMA cache_size = -" + std::to_string(config_get_int("DB_CACHE_KB", 8192)) + ";"
+                    "PRAGMA mmap_size = " + std::to_string(config_get_int("DB_MMAP_BYTES", 268435456)) + ";";
+    if (not read_only)
+        tuning = "PRAGMA journal_mode = WAL;" + tuning;
+    return exec(tuning.c_str());
+}
+
+void Database::close()
+{
+    for (auto &[sql, stmt] : statements)
+        sqlite3_finalize(stmt);
+    statements.clear();
+    sqlite3_close(db);
+    db = nullptr;
+}
+
+bool Database::exec(const char *sql)
+{
+    char *errmsg = 0;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &errmsg) != SQLITE_OK)
+    {
+        std::cerr << "SQL error: " << errmsg << std::endl;
+        sqlite3_free(errmsg);
+        return false;
+    }
+    return true;
+}
+
+Statement Database::prepare(const char *sql)
+{
+    auto found = statements.find(sql);
+    if (found != statements.end())
+        return Statement(found->second);
+
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "SQL error: " << sqlite3_errmsg(db) << std::endl;
+        return Statement(nullptr);
+    }
+    statements.emplace(sql, stmt);
+    return Statement(stmt);
+}
+
+ReaderPool::Lease::~Lease()
+{
+    if (not db)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(pool->poolMutex);
+        pool->idle.push_back(db);
+    }
+    pool->poolReady.notify_one();
+}
+
+bool ReaderPool::open(const char *path, size_t readers)
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+    for (size_t i = 0; i < readers; i++)
+    {
+        auto db = std::make_unique<Database>();
+        if (not db->open(path, true))
+            return false;
+        idle.push_back(db.get());
+        connections.push_back(std::move(db));
+    }
+    return true;
+}
+
+void ReaderPool::close()
+{
+    // Every lease must have been returned
+    std::lock_guard<std::mutex> lock(poolMutex);
+    for (auto &db : connections)
+        db->close();
+    connections.clear();
+    idle.clear();
+}
+
+ReaderPool::Lease ReaderPool::acquire()
+{
+    std::unique_lock<std::mutex> lock(poolMutex);
+    poolReady.wait(lock, [this] { return not idle.empty(); });
+    Database *db = idle.back();
+    idle.pop_back();
+    return Lease(this, db);
+}
+
+void Checkpointer::configure()
+{
+    interval = std::chrono::seconds(config_get_int("DB_CHECKPOINT_SECONDS", 30));
+    max_frames = config_get_int("DB_CHECKPOINT_MAX_FRAMES", 10000);
+}
+
+void Checkpointer::start(const char *path, Database &writer_db)
+{
+    // Already running, or SQLite's own checkpoints were asked for
+    if (checkpointer.joinable() or interval.count() <= 0)
+        return;
+    if (not db.open(path))
+        return;
+
+    writer_db.exec("PRAGMA wal_autocheckpoint = 0;");
+    do_stop = false;
+    checkpointer = std::thread(&Checkpointer::run_checkpoints, this);
+}
+
+void Checkpointer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(checkpointMutex);
+        do_stop = true;
+    }
+    checkpointWake.notify_all();
+    if (checkpointer.joinable())
+    {
+        checkpointer.join();
+        db.close();
+    }
+}
+
+void Checkpointer::run_checkpoints()
+{
+    std::unique_lock<std::mutex> lock(checkpointMutex);
+    while (not checkpointWake.wait_for(lock, interval, [this] { return do_stop; }))
+    {
+        lock.unlock();
+        int log = 0, checkpointed = 0;
+        int resultcode = sqlite3_wal_checkpoint_v2(db.handle(), nullptr, SQLITE_CHECKPOINT_PASSIVE,
+                                                   &log, &checkpointed);
+        bool truncated = false;
+        if (resultcode == SQLITE_OK and log - checkpointed > max_frames)
+        {
+            resultcode = sqlite3_wal_checkpoint_v2(db.handle(), nullptr, SQLITE_CHECKPOINT_TRUNCATE,
+                                                   &log, &checkpointed);
+            truncated = resultcode == SQLITE_OK;
+        }
+        if (resultcode != SQLITE_OK and resultcode != SQLITE_BUSY)
+            std::cerr << "Checkpoint failed: " << sqlite3_errmsg(db.handle()) << std::endl;
+        lock.lock();
+
+        checkpoints++;
+        truncations += truncated;
+        wal_frames = std::max(log, 0);
+        wal_checkpointed = std::max(checkpointed, 0);
+    }
+}
+
+void Checkpointer::print_stats(std::ostream &out)
+{
+    std::lock_guard<std::mutex> lock(checkpointMutex);
+    out << "\nCheckpointer: " << checkpoints << " checkpoints (" << truncations << " truncating), "
+        << "last found " << wal_frames << " frames in the WAL, " << wal_checkpointed << " copied back";
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "sqlite3.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * A prepared statement borrowed from Database's cache. It is reset and its
+ * bindings cleared when it goes out of scope, ready for the next caller.
+ * Only one Statement for a given SQL string should be alive at a time.
+ */
+class Statement
+{
+public:
+    explicit Statement(sqlite3_stmt *stmt) : stmt(stmt) {}
+    Statement(Statement &&other) : stmt(other.stmt) { other.stmt = nullptr; }
+    Statement(const Statement &) = delete;
+    Statement &operator=(const Statement &) = delete;
+    ~Statement();
+
+    Statement &bind_text(int index, const std::string &value);
+    Statement &bind_int64(int index, sqlite3_int64 value);
+    Statement &bind_null(int index);
+
+    // SQLITE_ROW while there are rows, then SQLITE_DONE or an error code
+    int step();
+    // Steps past any rows; true if the statement ran to completion
+    bool run();
+    // Rewinds the statement and clears its bindings for another run
+    void reset();
+
+    bool column_null(int column);
+    sqlite3_int64 column_int64(int column);
+    std::string column_text(int column);
+
+private:
+    sqlite3_stmt *stmt;
+};
+
+/*
+ * A connection and its statement cache. Statements are compiled once
+ * with sqlite3_prepare_v3 and kept for the life of the connection, so a
+ * row written or read costs a bind and a step instead of a parse. A
+ * connection is used by one thread at a time: the writer's under dbMutex,
+ * readers' by leasing them from a ReaderPool.
+ *
+ * Connections are opened in WAL mode and tuned with DB_SYNCHRONOUS,
+ * DB_CACHE_KB and DB_MMAP_BYTES.
+ */
+class Database
+{
+public:
+    bool open(const char *path, bool read_only = false);
+    // Finalizes the cached statements and closes the connection
+    void close();
+    // For schema changes and transaction control; takes no parameters
+    bool exec(const char *sql);
+    // Returns the cached statement for sql, compiling it on first use
+    Statement prepare(const char *sql);
+
+    sqlite3 *handle() { return db; }
+
+private:
+    sqlite3 *db = nullptr;
+    std::unordered_map<std::string, sqlite3_stmt *> statements;
+};
+
+/*
+ * Read-only connections for queries. In WAL mode readers see the last
+ * commit and never wait on the writer, nor hold it up.
+ */
+class ReaderPool
+{
+public:
+    // A connection borrowed from the pool, returned when it goes out of scope
+    class Lease
+    {
+    public:
+        Lease(ReaderPool *pool, Database *db) : pool(pool), db(db) {}
+        Lease(Lease &&other) : pool(other.pool), db(other.db) { other.db = nullptr; }
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+        ~Lease();
+
+        Database &operator*() { return *db; }
+        Database *operator->() { return db; }
+
+    private:
+        ReaderPool *pool;
+        Database *db;
+    };
+
+    bool open(const char *path, size_t readers);
+    void close();
+    // Waits for a free connection if they are all leased
+    Lease acquire();
+
+private:
+    std::vector<std::unique_ptr<Database>> connections;
+    std::vector<Database *> idle;
+    std::mutex poolMutex;
+    std::condition_variable poolReady;
+};
+
+/*
+ * Checkpoints the WAL into the database file on its own connection every
+ * DB_CHECKPOINT_SECONDS, so the writer never pays for it inline. Passive
+ * checkpoints never block anyone; if readers keep one from finishing and
+ * the WAL passes DB_CHECKPOINT_MAX_FRAMES, a truncating checkpoint waits
+ * them out and resets it.
+ */
+class Checkpointer
+{
+public:
+    void configure();
+    // Turns off automatic checkpoints on the writer's connection db
+    void start(const char *path, Database &db);
+    void stop();
+    void print_stats(std::ostream &out);
+
+private:
+    void run_checkpoints();
+
+    std::chrono::seconds interval{30};
+    long max_frames = 10000;
+
+    Database db;
+    std::thread checkpointer;
+    std::mutex checkpointMutex;
+    std::condition_variable checkpointWake;
+    bool do_stop = false;
+
+    unsigned long checkpoints = 0;
+    unsigned long truncations = 0;
+    long wal_frames = 0;
+    long wal_checkpointed = 0;
+};
@@ -0,0 +1,206 @@
+#include "db_writer.h"
+#include "config.h"
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+using namespace std::chrono;
+
+void DatabaseWriter::configure()
+{
+    batch_rows = std::max(1L, config_get_int("DB_BATCH_ROWS", 500));
+    batch_millis = milliseconds(config_get_int("DB_BATCH_MILLIS", 20));
+}
+
+void DatabaseWriter::push(Request *request)
+{
+    request->next.store(nullptr, std::memory_order_relaxed);
+    Request *previous = head.exchange(request, std::memory_order_acq_rel);
+    previous->next.store(request, std::memory_order_release);
+}
+
+DatabaseWriter::Request *DatabaseWriter::pop()
+{
+    Request *first = tail;
+    Request *next = first->next.load(std::memory_order_acquire);
+    if (first == &stub)
+    {
+        if (not next)
+            return nullptr;
+        tail = first = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next)
+    {
+        tail = next;
+        return first;
+    }
+    // first looks like the last request, but a producer may be halfway
+    // through pushing after it. Put the stub behind it so it can be taken.
+    if (first != head.load(std::memory_order_acquire))
+        return nullptr;
+    push(&stub);
+    next = first->next.load(std::memory_order_acquire);
+    if (next)
+    {
+        tail = next;
+        return first;
+    }
+    return nullptr;
+}
+
+void DatabaseWriter::start(Database *database, std::mutex *databaseMutex)
+{
+    // Already running
+    if (writer.joinable())
+        return;
+
+    db = database;
+    dbMutex = databaseMutex;
+    do_stop = false;
+    running = true;
+    writer = std::thread(&DatabaseWriter::run_writer, this);
+}
+
+void DatabaseWriter::stop()
+{
+    // From here on submit() writes inline. Wait out any submit that saw
+    // running before this, so its push is in the queue the writer drains.
+    running = false;
+    while (submitting.load() > 0)
+        std::this_thread::yield();
+
+    do_stop = true;
+    pushes.fetch_add(1);
+    pushes.notify_one();
+    if (writer.joinable())
+        writer.join();
+}
+
+std::future<bool> DatabaseWriter::submit(Write write)
+{
+    Request *request = new Request;
+    request->write = std::move(write);
+    std::future<bool> done = request->done.get_future();
+
+    submitting++;
+    if (not running)
+    {
+        submitting--;
+        // Before start and after stop the caller writes for itself, unless
+        // the database has been closed too
+        if (not db)
+        {
+            request->done.set_value(false);
+            delete request;
+            return done;
+        }
+        std::vector<Request *> batch;
+        std::lock_guard<std::mutex> lock(*dbMutex);
+        if (not db->handle())
+        {
+            request->done.set_value(false);
+            delete request;
+            return done;
+        }
+        db->exec("BEGIN IMMEDIATE;");
+        apply(request, batch);
+        bool committed = db->exec("COMMIT;");
+        if (not committed)
+            db->exec("ROLLBACK;");
+        for (Request *applied : batch)
+        {
+            applied->done.set_value(committed);
+            delete applied;
+        }
+        return done;
+    }
+
+    push(request);
+    submitting--;
+    pushes.fetch_add(1, std::memory_order_release);
+    pushes.notify_one();
+    return done;
+}
+
+void DatabaseWriter::run_writer()
+{
+    while (true)
+    {
+        unsigned seen = pushes.load(std::memory_order_acquire);
+        Request *first = pop();
+        if (first)
+        {
+            commit_batch(first);
+            continue;
+        }
+        // Only stop once the queue has been drained
+        if (do_stop)
+            break;
+        pushes.wait(seen, std::memory_order_acquire);
+    }
+}
+
+void DatabaseWriter::apply(Request *request, std::vector<Request *> &batch)
+{
+    db->exec("SAVEPOINT write_request;");
+    bool ok = request->write(*db);
+    if (not ok)
+    {
+        db->exec("ROLLBACK TO write_request;");
+        request->done.set_value(false);
+        delete request;
+    }
+    db->exec("RELEASE write_request;");
+    if (ok)
+        batch.push_back(request);
+}
+
+void DatabaseWriter::commit_batch(Request *first)
+{
+    std::vector<Request *> batch;
+    size_t taken = 1;
+    auto start = steady_clock::now();
+    bool committed;
+    {
+        std::lock_guard<std::mutex> lock(*dbMutex);
+        db->exec("BEGIN IMMEDIATE;");
+        apply(first, batch);
+        // Keep taking whatever has queued up meanwhile
+        Request *request;
+        while (taken < batch_rows and steady_clock::now() - start < batch_millis and (request = pop()))
+        {
+            apply(request, batch);
+            taken++;
+        }
+        committed = db->exec("COMMIT;");
+        if (not committed)
+            db->exec("ROLLBACK;");
+    }
+    long micros = duration_cast<microseconds>(steady_clock::now() - start).count();
+
+    for (Request *request : batch)
+    {
+        request->done.set_value(committed);
+        delete request;
+    }
+
+    std::lock_guard<std::mutex> lock(statsMutex);
+    commits++;
+    rows += committed ? batch.size() : 0;
+    failed += taken - (committed ? batch.size() : 0);
+    largest_batch = std::max(largest_batch, taken);
+    commit_micros += micros;
+    slowest_commit_micros = std::max(slowest_commit_micros, micros);
+}
+
+void DatabaseWriter::print_stats(std::ostream &out)
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    out << "\nDatabase writer: " << rows << " writes in " << commits << " commits";
+    if (commits > 0)
+        out << " (" << double(rows + failed) / commits << " per commit, largest " << largest_batch
+            << "), commit latency mean " << commit_micros / commits << " us, max "
+            << slowest_commit_micros << " us";
+    out << ", " << failed << " failed";
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "database.h"
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+/*
+ * The one thread that changes the database. Writes are queued from any
+ * thread and applied in group commits: the writer takes whatever has
+ * queued up, up to DB_BATCH_ROWS writes or DB_BATCH_MILLIS of work, and
+ * commits it as a single transaction, so a backlog pays for one journal
+ * sync per batch instead of one per row. A lone write still commits
+ * straight away.
+ *
+ * Each write runs in its own savepoint, so one that fails is undone
+ * without taking the rest of its batch with it. The future returned by
+ * submit() is ready once the batch has committed.
+ */
+class DatabaseWriter
+{
+public:
+    // Runs with the database held under dbMutex. Return false to undo it.
+    using Write = std::function<bool(Database &)>;
+
+    void configure();
+    void start(Database *db, std::mutex *dbMutex);
+    // Finishes everything already queued
+    void stop();
+    // True once the write has committed; false if it was undone or the
+    // commit failed.
+    std::future<bool> submit(Write write);
+    void print_stats(std::ostream &out);
+
+private:
+    struct Request
+    {
+        Write write;
+        std::promise<bool> done;
+        std::atomic<Request *> next = nullptr;
+    };
+
+    // Intrusive multi-producer, single-consumer queue: producers swap
+    // themselves in at head, the writer alone walks from tail.
+    void push(Request *request);
+    Request *pop();
+
+    void run_writer();
+    // Applies and commits one batch, starting from first
+    void commit_batch(Request *first);
+    void apply(Request *request, std::vector<Request *> &batch);
+
+    Database *db = nullptr;
+    std::mutex *dbMutex = nullptr;
+    size_t batch_rows = 500;
+    std::chrono::milliseconds batch_millis{20};
+
+    Request stub;
+    std::atomic<Request *> head = &stub;
+    Request *tail = &stub;
+    // Bumped after every push so the writer can sleep on it
+    std::atomic<unsigned> pushes = 0;
+
+    std::thread writer;
+    std::atomic<bool> running = false;
+    std::atomic<bool> do_stop = false;
+    // submit() calls between checking running and pushing, which stop()
+    // waits for
+    std::atomic<unsigned> submitting = 0;
+
+    std::mutex statsMutex;
+    unsigned long commits = 0;
+    unsigned long rows = 0;
+    unsigned long failed = 0;
+    size_t largest_batch = 0;
+    long commit_micros = 0;
+    long slowest_commit_micros = 0;
+};
@@ -0,0 +1,147 @@
+#include "dedupe.h"
+#include "config.h"
+#include <algorithm>
+#include <bit>
+#include <cctype>
+
+using std::string;
+using namespace std::chrono;
+
+// FNV-1a followed by a finalizer, so short words spread over all 64 bits
+static uint64_t hash_token(const string &token)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : token)
+        h = (h ^ c) * 0x100000001b3ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t simhash(const string &text, size_t *words)
+{
+    std::vector<string> tokens;
+    string word;
+    for (unsigned char c : text + ' ')
+    {
+        if (isalnum(c))
+            word += tolower(c);
+        else if (not word.empty())
+        {
+            tokens.push_back(word);
+            word.clear();
+        }
+    }
+    if (words)
+        *words = tokens.size();
+
+    int weights[64] = {};
+    auto add = [&weights](uint64_t h)
+    {
+        for (int bit = 0; bit < 64; bit++)
+            weights[bit] += (h >> bit) & 1 ? 1 : -1;
+    };
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        add(hash_token(tokens[i]));
+        if (i + 1 < tokens.size())
+            add(hash_token(tokens[i] + ' ' + tokens[i + 1]));
+    }
+
+    uint64_t hash = 0;
+    for (int bit = 0; bit < 64; bit++)
+        if (weights[bit] > 0)
+            hash |= 1ULL << bit;
+    return hash;
+}
+
+void DuplicateFilter::configure()
+{
+    enabled = config_get("DEDUPE_MODE", "suppress") == "suppress";
+    max_distance = std::clamp<long>(config_get_int("DEDUPE_MAX_DISTANCE", 3), 0, 15);
+    min_words = config_get_int("DEDUPE_MIN_WORDS", 3);
+    window = minutes(config_get_int("DEDUPE_WINDOW_MINUTES", 10));
+}
+
+uint64_t DuplicateFilter::band_key(uint64_t hash, size_t band)
+{
+    size_t bands = max_distance + 1;
+    size_t width = 64 / bands;
+    // The last band takes the leftover bits
+    size_t bits = band + 1 == bands ? 64 - width * band : width;
+    uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+    uint64_t value = (hash >> (width * band)) & mask;
+    // Band number in the top byte keeps bands apart in one map
+    return hash_token(std::to_string(value)) ^ (uint64_t(band) << 56);
+}
+
+void DuplicateFilter::expire(Channel &channel, steady_clock::time_point now)
+{
+    while (not channel.entries.empty() and now - channel.entries.front().seen > window)
+    {
+        uint64_t expired = channel.first++;
+        uint64_t hash = channel.entries.front().hash;
+        channel.entries.pop_front();
+
+        for (size_t band = 0; band <= max_distance; band++)
+        {
+            auto found = channel.bands.find(band_key(hash, band));
+            if (found == channel.bands.end())
+                continue;
+            auto &numbers = found->second;
+            // Entries are added in order, so expired ones lead the list
+            numbers.erase(numbers.begin(), std::upper_bound(numbers.begin(), numbers.end(), expired));
+            if (numbers.empty())
+                channel.bands.erase(found);
+        }
+    }
+}
+
+bool DuplicateFilter::is_duplicate(const string &channel_name, const string &text)
+{
+    if (not enabled)
+        return false;
+
+    size_t words;
+    uint64_t hash = simhash(text, &words);
+    // Too little text for the hash to mean much
+    if (words < min_words)
+        return false;
+
+    std::lock_guard<std::mutex> lock(filterMutex);
+    checked++;
+    auto now = steady_clock::now();
+    Channel &channel = channels[channel_name];
+    expire(channel, now);
+
+    for (size_t band = 0; band <= max_distance; band++)
+    {
+        auto found = channel.bands.find(band_key(hash, band));
+        if (found == channel.bands.end())
+            continue;
+        for (uint64_t number : found->second)
+        {
+            const Entry &entry = channel.entries[number - channel.first];
+            if (size_t(std::popcount(entry.hash ^ hash)) <= max_distance)
+            {
+                suppressed++;
+                return true;
+            }
+        }
+    }
+
+    uint64_t number = channel.first + channel.entries.size();
+    channel.entries.push_back({hash, now});
+    for (size_t band = 0; band <= max_distance; band++)
+        channel.bands[band_key(hash, band)].push_back(number);
+    return false;
+}
+
+void DuplicateFilter::print_stats(std::ostream &out)
+{
+    std::lock_guard<std::mutex> lock(filterMutex);
+    out << "\nDuplicate filter: " << suppressed << " of " << checked << " transcripts suppressed";
+    if (checked > 0)
+        out << " (" << 100.0 * suppressed / checked << "%)";
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 64-bit SimHash of the words and word pairs in text, ignoring case and
+// punctuation. Near-identical texts differ in only a few bits.
+uint64_t simhash(const std::string &text, size_t *words = nullptr);
+
+/*
+ * Remembers recent transcripts per channel and spots near-duplicates:
+ * anything within DEDUPE_MAX_DISTANCE bits of a transcript seen in the
+ * last DEDUPE_WINDOW_MINUTES.
+ *
+ * Hashes are split into max_distance + 1 bands. Two hashes within that
+ * distance must agree exactly on at least one band, so a lookup only
+ * checks the few entries sharing a band value rather than the whole
+ * window.
+ */
+class DuplicateFilter
+{
+public:
+    void configure();
+    // Returns true if text repeats a recent transcript on channel;
+    // otherwise remembers it and returns false.
+    bool is_duplicate(const std::string &channel, const std::string &text);
+    void print_stats(std::ostream &out);
+
+private:
+    struct Entry
+    {
+        uint64_t hash;
+        std::chrono::steady_clock::time_point seen;
+    };
+    struct Channel
+    {
+        // Oldest first; entry i lives at entries[i - first]
+        std::deque<Entry> entries;
+        uint64_t first = 0;
+        // (band number, band bits) to entry numbers, oldest first
+        std::unordered_map<uint64_t, std::vector<uint64_t>> bands;
+    };
+
+    uint64_t band_key(uint64_t hash, size_t band);
+    void expire(Channel &channel, std::chrono::steady_clock::time_point now);
+
+    bool enabled = true;
+    size_t max_distance = 3;
+    size_t min_words = 3;
+    std::chrono::minutes window{10};
+    std::unordered_map<std::string, Channel> channels;
+    std::mutex filterMutex;
+
+    unsigned long checked = 0;
+    unsigned long suppressed = 0;
+};
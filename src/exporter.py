@@ -0,0 +1,177 @@
+# Exporter
+#
+# Copies new rows of the info table into columnar files for analytics
+# jobs, so nobody has to copy or scan info.db itself. Each run reads one
+# snapshot of the database and writes the rows added since the previous
+# run to a new part file in EXPORT_DIR, as Parquet or as an Arrow IPC
+# stream. Channel and agency are dictionary encoded.
+#
+# Rows are exported once, by id, and only after EXPORT_SETTLE_MINUTES so
+# their transcripts and posts have usually arrived.
+#
+# Usage: python3 exporter.py [--format parquet|arrow] [--full]
+import json
+import os
+import sqlite3
+import sys
+import time
+from contextlib import closing
+import pyarrow as pa
+import pyarrow.ipc
+import pyarrow.parquet as pq
+from dotenv import dotenv_values
+
+config = dotenv_values("/home/corey/scannerbot/config/scannerbot.env")
+
+DICTIONARY = pa.dictionary(pa.int32(), pa.string())
+SCHEMA = pa.schema([
+    ("id", pa.int64()),
+    ("start", pa.timestamp("us", tz="UTC")),
+    ("end", pa.timestamp("us", tz="UTC")),
+    ("duration_ms", pa.int64()),
+    ("freq", DICTIONARY),
+    ("freq_hz", pa.int64()),
+    ("agency", DICTIONARY),
+    ("transcript", pa.string()),
+    ("audio_path", pa.string()),
+    ("post_id", pa.string()),
+    ("post_url", pa.string()),
+])
+
+SELECT = """
+    SELECT id, start_us, end_us, duration_ms, freq, freq_hz, agency,
+           transcript, audioPath, postID, postURL
+      FROM info WHERE id > ? AND id <= ? ORDER BY id"""
+
+
+class Dictionary:
+    """
+    One dictionary for a whole export, so each batch only adds the values
+    it introduces and the IPC stream carries deltas instead of a new
+    dictionary per batch.
+    """
+    def __init__(self):
+        self.values = []
+        self.indices = {}
+
+    def encode(self, column):
+        indices = []
+        for value in column:
+            if value is None:
+                indices.append(None)
+                continue
+            if value not in self.indices:
+                self.indices[value] = len(self.values)
+                self.values.append(value)
+            indices.append(self.indices[value])
+        return pa.DictionaryArray.from_arrays(pa.array(indices, pa.int32()),
+                                              pa.array(self.values, pa.string()))
+
+
+def load_state(path):
+    try:
+        with open(path) as file:
+            return json.load(file)
+    except (OSError, ValueError):
+        return {"last_id": 0}
+
+
+def save_state(path, state):
+    with open(path + ".tmp", 'w') as file:
+        json.dump(state, file)
+        file.flush()
+        os.fsync(file.fileno())
+    os.replace(path + ".tmp", path)
+
+
+def settled_id(db, settle_minutes):
+    """
+    The highest id old enough to export. Only the newest rows are read,
+    through info_start; rows the schema migration hasn't reached yet have
+    no start_us and count as settled.
+    """
+    cutoff_us = int((time.time() - settle_minutes * 60) * 1000000)
+    first_recent = db.execute("SELECT min(id) FROM info WHERE start_us >= ?", (cutoff_us,)).fetchone()[0]
+    if first_recent is not None:
+        return first_recent - 1
+    return db.execute("SELECT coalesce(max(id), 0) FROM info").fetchone()[0]
+
+
+def open_writer(path, format):
+    if format == "arrow":
+        options = pa.ipc.IpcWriteOptions(emit_dictionary_deltas=True)
+        return pa.ipc.new_stream(path, SCHEMA, options=options)
+    return pq.ParquetWriter(path, SCHEMA, compression="zstd")
+
+
+def export(db_path, out_dir, format, batch_rows, settle_minutes, full=False):
+    """
+    Writes one part file of the rows since the last export and returns its
+    path, or None if there was nothing new.
+    """
+    os.makedirs(out_dir, exist_ok=True)
+    state_path = os.path.join(out_dir, "export_state.json")
+    state = {"last_id": 0} if full else load_state(state_path)
+
+    # Read only, and in one transaction, so the export sees a single
+    # snapshot and never blocks the bus's writer in WAL mode. Closed on the
+    # way out however the export ends, so a failed one doesn't hold the
+    # snapshot and keep the WAL from being checkpointed.
+    with closing(sqlite3.connect("file:" + db_path + "?mode=ro", uri=True, isolation_level=None)) as db:
+        db.execute("BEGIN")
+        first = state["last_id"]
+        last = settled_id(db, settle_minutes)
+        if last <= first:
+            return None
+
+        # Named by id range, so a run that dies before saving its state
+        # just writes the same file again next time
+        extension = ".arrows" if format == "arrow" else ".parquet"
+        path = os.path.join(out_dir, "info-%d-%d%s" % (first + 1, last, extension))
+        freqs, agencies = Dictionary(), Dictionary()
+        rows = 0
+        cursor = db.execute(SELECT, (first, last))
+        with open_writer(path + ".tmp", format) as writer:
+            while batch := cursor.fetchmany(batch_rows):
+                columns = list(zip(*batch))
+                writer.write_batch(pa.record_batch([
+                    pa.array(columns[0], pa.int64()),
+                    pa.array(columns[1], SCHEMA.field("start").type),
+                    pa.array(columns[2], SCHEMA.field("end").type),
+                    pa.array(columns[3], pa.int64()),
+                    freqs.encode(columns[4]),
+                    pa.array(columns[5], pa.int64()),
+                    agencies.encode(columns[6]),
+                    pa.array(columns[7], pa.string()),
+                    pa.array(columns[8], pa.string()),
+                    pa.array(columns[9], pa.string()),
+                    pa.array(columns[10], pa.string()),
+                ], schema=SCHEMA))
+                rows += len(batch)
+
+    os.replace(path + ".tmp", path)
+    save_state(state_path, {"last_id": last, "exported_at": int(time.time())})
+    print("Exported %d rows to %s" % (rows, path))
+    return path
+
+
+def main():
+    format = config.get("EXPORT_FORMAT", "parquet")
+    if "--format" in sys.argv[1:-1]:
+        format = sys.argv[sys.argv.index("--format") + 1]
+    if format not in ("parquet", "arrow"):
+        print("Format must be parquet or arrow", file=sys.stderr)
+        sys.exit(1)
+
+    path = export(config.get("EXPORT_DB_PATH", "/home/corey/scannerbot/db/info.db"),
+                  config.get("EXPORT_DIR", "/home/corey/scannerbot/exports/"),
+                  format,
+                  int(config.get("EXPORT_BATCH_ROWS", 10000)),
+                  float(config.get("EXPORT_SETTLE_MINUTES", 60)),
+                  full="--full" in sys.argv[1:])
+    if path is None:
+        print("Nothing new to export")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,121 @@
+# Exporter test
+#
+# Exports a small fixture database in both formats and reads the files
+# back, so a change to the exporter can be checked without a live bus.
+#
+#     python3 exporter_test.py
+import os
+import sqlite3
+import tempfile
+import time
+import unittest
+from unittest import mock
+import pyarrow as pa
+import pyarrow.ipc
+import pyarrow.parquet as pq
+import exporter
+
+HOUR_US = 3600 * 1000000
+
+# id, freq, agency, transcript; agency is left out on some rows and every
+# freq comes back in a later batch
+ROWS = [
+    (1, "160.71M", "SEPTA", "unit one en route"),
+    (2, "460.05M", None, "medic two on scene"),
+    (3, "160.71M", "SEPTA", "clear"),
+    (4, "155.43M", "Fire", None),
+    (5, "460.05M", None, "engine five respond"),
+]
+
+
+def make_db(path):
+    db = sqlite3.connect(path)
+    db.execute("PRAGMA journal_mode = WAL")
+    db.execute("""CREATE TABLE info(
+                      id INTEGER PRIMARY KEY AUTOINCREMENT,
+                      date TEXT, time TEXT, freq TEXT, agency TEXT,
+                      transcript TEXT, audioPath TEXT,
+                      postID TEXT, postURL TEXT,
+                      start_us INTEGER, end_us INTEGER, freq_hz INTEGER, duration_ms INTEGER,
+                      segment TEXT)""")
+    db.execute("CREATE INDEX info_start ON info(start_us, freq_hz, duration_ms)")
+    start = int(time.time() * 1000000) - 2 * HOUR_US
+    for id, freq, agency, transcript in ROWS:
+        db.execute("INSERT INTO info (id, freq, agency, transcript, audioPath, start_us, end_us,"
+                   " freq_hz, duration_ms, segment) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+                   (id, freq, agency, transcript, "/audio/%d.wav" % id, start + id * 1000000,
+                    start + id * 1000000 + 1500, int(float(freq[:-1]) * 1000000), 1500, str(id)))
+    db.commit()
+    return db
+
+
+def read_back(path, format):
+    if format == "arrow":
+        with pa.ipc.open_stream(path) as reader:
+            return reader.read_all()
+    return pq.read_table(path)
+
+
+class ExporterTest(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.TemporaryDirectory()
+        self.db_path = os.path.join(self.dir.name, "info.db")
+        self.db = make_db(self.db_path)
+
+    def tearDown(self):
+        self.db.close()
+        self.dir.cleanup()
+
+    def check_export(self, format):
+        out_dir = os.path.join(self.dir.name, format)
+        # Two rows a batch, so the dictionaries grow across batches
+        path = exporter.export(self.db_path, out_dir, format, 2, 60)
+        self.assertEqual(os.path.basename(path), "info-1-5" + (".arrows" if format == "arrow" else ".parquet"))
+
+        table = read_back(path, format)
+        self.assertEqual(table.schema, exporter.SCHEMA)
+        self.assertEqual(table.column("id").to_pylist(), [row[0] for row in ROWS])
+        self.assertEqual(table.column("freq").to_pylist(), [row[1] for row in ROWS])
+        self.assertEqual(table.column("agency").to_pylist(), [row[2] for row in ROWS])
+        self.assertEqual(table.column("transcript").to_pylist(), [row[3] for row in ROWS])
+        self.assertEqual(table.column("duration_ms").to_pylist(), [1500] * len(ROWS))
+
+        # Nothing new until more rows settle, then only those
+        self.assertIsNone(exporter.export(self.db_path, out_dir, format, 2, 60))
+        self.db.execute("INSERT INTO info (id, freq, start_us) VALUES (6, '160.71M', ?)",
+                        (int(time.time() * 1000000) - 2 * HOUR_US,))
+        self.db.execute("INSERT INTO info (id, freq, start_us) VALUES (7, '160.71M', ?)",
+                        (int(time.time() * 1000000),))
+        self.db.commit()
+        path = exporter.export(self.db_path, out_dir, format, 2, 60)
+        self.assertEqual(read_back(path, format).column("id").to_pylist(), [6])
+
+        # --full starts over from the first row
+        path = exporter.export(self.db_path, out_dir, format, 2, 60, full=True)
+        self.assertEqual(read_back(path, format).column("id").to_pylist(), [1, 2, 3, 4, 5, 6])
+
+    def test_parquet(self):
+        self.check_export("parquet")
+
+    def test_arrow(self):
+        self.check_export("arrow")
+
+    def test_closes_database_on_failure(self):
+        connections = []
+        connect = sqlite3.connect
+
+        def recording_connect(*args, **kwargs):
+            connections.append(connect(*args, **kwargs))
+            return connections[-1]
+
+        with mock.patch.object(exporter.sqlite3, "connect", recording_connect), \
+                mock.patch.object(exporter, "open_writer", side_effect=OSError("disk full")):
+            with self.assertRaises(OSError):
+                exporter.export(self.db_path, os.path.join(self.dir.name, "failed"), "parquet", 2, 60)
+        self.assertEqual(len(connections), 1)
+        with self.assertRaises(sqlite3.ProgrammingError):
+            connections[0].execute("SELECT 1")
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,258 @@
+#include "history.h"
+#include "config.h"
+#include "json.h"
+#include "schema.h"
+#include "search.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using std::string;
+
+HistoryQuery parse_history(const string &args, long max_limit)
+{
+    HistoryQuery query;
+    std::stringstream stream(args);
+    string word;
+    while (stream >> word)
+    {
+        if (word == "freq")
+            stream >> query.freq;
+        else if (word == "agency")
+            stream >> query.agency;
+        else if (word == "since")
+            stream >> query.since;
+        else if (word == "until")
+            stream >> query.until;
+        else if (word == "after")
+            stream >> query.after;
+        else if (word == "oldest")
+            query.oldest_first = true;
+        else if (word == "limit")
+            stream >> query.limit;
+        else
+            query.words.push_back(word);
+    }
+    query.limit = std::max(1L, std::min(query.limit, max_limit));
+    return query;
+}
+
+string history(Database &db, const HistoryQuery &query, const std::function<bool(const HistoryRow &)> &emit)
+{
+    // Only the filters asked for go into the SQL, so each combination gets
+    // its own cached statement and plan, and a channel filter can use
+    // info_freq_start. Unused parameter numbers are harmless. Words join
+    // the full-text index after info, so rows are walked in page order from
+    // the cursor and each is looked up by rowid until the page is full,
+    // instead of gathering every match first.
+    long long cursor_start = 0, cursor_id = 0;
+    bool has_cursor = sscanf(query.after.c_str(), "%lld.%lld", &cursor_start, &cursor_id) == 2;
+    const char *direction = query.oldest_first ? "" : " DESC";
+    string sql =
+        "SELECT id, start_us, coalesce(duration_ms, 0), coalesce(freq, ''), coalesce(agency, ''),"
+        "       coalesce(info.transcript, ''), coalesce(audioPath, ''), coalesce(postURL, '')"
+        "  FROM info";
+    if (not query.words.empty())
+        sql += " CROSS JOIN transcripts_fts ON transcripts_fts.rowid = info.id";
+    sql += " WHERE start_us IS NOT NULL";
+    if (has_cursor)
+        sql += query.oldest_first ? " AND (start_us, id) > (?1, ?2)" : " AND (start_us, id) < (?1, ?2)";
+    if (not query.freq.empty())
+        sql += " AND freq_hz = ?3";
+    if (not query.agency.empty())
+        sql += " AND agency = ?4";
+    if (not query.words.empty())
+        sql += " AND transcripts_fts MATCH ?5";
+    if (not query.since.empty())
+        sql += " AND start_us >= strftime('%s', ?6, 'utc') * 1000000";
+    if (not query.until.empty())
+        sql += " AND start_us < " + until_end_sql(7);
+    sql += string(" ORDER BY start_us") + direction + ", id" + direction + " LIMIT ?8;";
+
+    // One row past the page says whether there is another
+    Statement select = db.prepare(sql.c_str());
+    select.bind_int64(1, cursor_start)
+        .bind_int64(2, cursor_id)
+        .bind_int64(3, freq_hz(query.freq))
+        .bind_text(4, query.agency)
+        .bind_text(5, match_expression(query.words))
+        .bind_text(6, query.since)
+        .bind_text(7, query.until)
+        .bind_int64(8, query.limit + 1);
+    HistoryRow row;
+    for (long rows = 0; select.step() == SQLITE_ROW; rows++)
+    {
+        if (rows == query.limit)
+            return std::to_string(row.start_us) + "." + std::to_string(row.id);
+        row = {select.column_int64(0), select.column_int64(1), select.column_int64(2),
+               select.column_text(3), select.column_text(4), select.column_text(5),
+               select.column_text(6), select.column_text(7)};
+        if (not emit(row))
+            return "";
+    }
+    return "";
+}
+
+string history_json(const HistoryRow &row)
+{
+    return "{\"id\": " + std::to_string(row.id) +
+           ", \"start_us\": " + std::to_string(row.start_us) +
+           ", \"duration_ms\": " + std::to_string(row.duration_ms) +
+           ", \"freq\": " + json_string(row.freq) +
+           ", \"agency\": " + json_string(row.agency) +
+           ", \"transcript\": " + json_string(row.transcript) +
+           ", \"audio\": " + json_string(row.audio_path) +
+           ", \"post_url\": " + json_string(row.post_url) + "}";
+}
+
+void print_history_row(std::ostream &out, const HistoryRow &row)
+{
+    time_t start = row.start_us / 1000000;
+    char when[32];
+    strftime(when, sizeof(when), "%d-%m-%Y %H:%M:%S", localtime(&start));
+    out << "\n" << when << "  " << row.freq << "  " << row.duration_ms / 1000 << "s  "
+        << (row.agency.empty() ? "" : row.agency + "  ") << row.transcript;
+}
+
+void HistoryServer::configure()
+{
+    socket_path = config_get("HISTORY_SOCKET_PATH", "/tmp/scannerbot_history.sock");
+    max_limit = config_get_int("HISTORY_MAX_LIMIT", 1000);
+    batch_rows = std::max(1L, config_get_int("HISTORY_BATCH_ROWS", 100));
+    timeout_seconds = config_get_int("HISTORY_TIMEOUT_SECONDS", 5);
+}
+
+void HistoryServer::start(ReaderPool *readerPool)
+{
+    // Already running
+    if (server.joinable())
+        return;
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(socket_path.c_str());
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1 or bind(listener, (sockaddr *)&addr, sizeof(addr)) == -1 or
+        listen(listener, 16) == -1)
+    {
+        perror("history socket listen");
+        if (listener != -1)
+            close(listener);
+        listener = -1;
+        return;
+    }
+
+    readers = readerPool;
+    do_stop = false;
+    server = std::thread(&HistoryServer::run, this);
+}
+
+void HistoryServer::stop()
+{
+    do_stop = true;
+    if (server.joinable())
+        server.join();
+    if (listener != -1)
+    {
+        close(listener);
+        unlink(socket_path.c_str());
+    }
+    listener = -1;
+}
+
+void HistoryServer::run()
+{
+    while (not do_stop)
+    {
+        // Wakes now and then to notice stop()
+        pollfd ready = {listener, POLLIN, 0};
+        if (poll(&ready, 1, 500) <= 0)
+            continue;
+        int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1)
+            continue;
+        timeval timeout = {timeout_seconds, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve(client);
+        close(client);
+    }
+}
+
+void HistoryServer::serve(int client)
+{
+    string out;
+    auto flush = [&]
+    {
+        for (size_t done = 0; done < out.size();)
+        {
+            ssize_t n = send(client, out.data() + done, out.size() - done, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            done += n;
+        }
+        out.clear();
+        return true;
+    };
+
+    string line;
+    char buffer[4096];
+    while (not do_stop)
+    {
+        size_t newline;
+        while ((newline = line.find('\n')) == string::npos)
+        {
+            ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+            if (n <= 0 or line.size() > 65536)
+                return;
+            line.append(buffer, n);
+        }
+        HistoryQuery query = parse_history(line.substr(0, newline), max_limit);
+        line.erase(0, newline + 1);
+        requests++;
+
+        // The page is read in keyset batches, each from a fresh lease that
+        // is given back before the batch is sent, so a slow client holds
+        // neither a reader nor a snapshot, and a page of any length takes
+        // the same memory
+        HistoryQuery batch = query;
+        long left = query.limit;
+        string next;
+        do
+        {
+            batch.limit = std::min(left, batch_rows);
+            {
+                ReaderPool::Lease db = readers->acquire();
+                next = history(*db, batch, [&](const HistoryRow &row)
+                               {
+                                   out += history_json(row) + '\n';
+                                   left--;
+                                   rows_sent++;
+                                   return true;
+                               });
+            }
+            batch.after = next;
+            if (left == 0 or next.empty())
+                out += "{\"next\": " + (next.empty() ? string("null") : json_string(next)) + "}\n";
+            if (not flush())
+            {
+                dropped++;
+                return;
+            }
+        } while (left > 0 and not next.empty());
+    }
+}
+
+void HistoryServer::print_stats(std::ostream &out)
+{
+    out << "\nHistory: " << requests << " requests, " << rows_sent << " rows sent, "
+        << dropped << " clients dropped";
+}
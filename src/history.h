@@ -0,0 +1,82 @@
+#pragma once
+
+#include "database.h"
+#include <atomic>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A page of history from the CLI or the history socket
+struct HistoryQuery
+{
+    // Transcript words, matched as in search; empty for any
+    std::vector<std::string> words;
+    std::string freq, agency;
+    // Inclusive local-time bounds as YYYY-MM-DD or YYYY-MM-DDTHH:MM[:SS];
+    // empty for none
+    std::string since, until;
+    // The cursor a previous page ended on; empty for the first page
+    std::string after;
+    bool oldest_first = false;
+    long limit = 20;
+};
+
+struct HistoryRow
+{
+    sqlite3_int64 id;
+    long long start_us, duration_ms;
+    std::string freq, agency, transcript, audio_path, post_url;
+};
+
+// Parses "[words...] [freq <freq>] [agency <agency>] [since <when>]
+// [until <when>] [after <cursor>] [oldest] [limit <n>]", limit at most
+// max_limit
+HistoryQuery parse_history(const std::string &args, long max_limit = 1000);
+
+// Hands each row of the page to emit as it is read, so only one row is
+// held at a time; stops early if emit returns false. Pages are keyset on
+// (start_us, id), so any page costs the same as the first. Returns the
+// cursor for the next page, or "" after the last one. Rows the schema
+// migration hasn't reached yet have no start_us and aren't listed.
+std::string history(Database &db, const HistoryQuery &query,
+                    const std::function<bool(const HistoryRow &)> &emit);
+
+std::string history_json(const HistoryRow &row);
+void print_history_row(std::ostream &out, const HistoryRow &row);
+
+/*
+ * Serves history over the Unix socket HISTORY_SOCKET_PATH. Each request
+ * is one line in the CLI's history syntax; the reply is one JSON object
+ * per row, written as the rows are read, then {"next": cursor} with null
+ * after the last page. Rows are read HISTORY_BATCH_ROWS at a time, each
+ * batch from its own reader lease, which is released before the batch is
+ * sent. Clients are served one at a time, and one that stops reading for
+ * HISTORY_TIMEOUT_SECONDS is dropped.
+ */
+class HistoryServer
+{
+public:
+    void configure();
+    void start(ReaderPool *readers);
+    void stop();
+    void print_stats(std::ostream &out);
+
+private:
+    void run();
+    void serve(int client);
+
+    std::string socket_path;
+    long max_limit = 1000;
+    long batch_rows = 100;
+    int timeout_seconds = 5;
+    ReaderPool *readers = nullptr;
+    int listener = -1;
+    std::thread server;
+    std::atomic<bool> do_stop = false;
+
+    std::atomic<unsigned long> requests = 0;
+    std::atomic<unsigned long> rows_sent = 0;
+    std::atomic<unsigned long> dropped = 0;
+};
@@ -0,0 +1,139 @@
+#include "json.h"
+#include <cctype>
+#include <cstdio>
+
+using std::string;
+
+string json_string(const string &s)
+{
+    string out = "\"";
+    for (unsigned char c : s)
+    {
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (c < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else
+                out += c;
+        }
+    }
+    return out + '"';
+}
+
+// Reads four hex digits at pos; bad input reads as U+FFFD
+static unsigned hex4(const string &s, size_t pos)
+{
+    unsigned code = 0;
+    for (size_t i = pos; i < pos + 4; i++)
+    {
+        if (i >= s.size() or not isxdigit((unsigned char)s[i]))
+            return 0xfffd;
+        code = code * 16 + (isdigit((unsigned char)s[i]) ? s[i] - '0' : (tolower(s[i]) - 'a' + 10));
+    }
+    return code;
+}
+
+static void append_utf8(string &out, unsigned code)
+{
+    if (code < 0x80)
+        out += char(code);
+    else if (code < 0x800)
+    {
+        out += char(0xc0 | (code >> 6));
+        out += char(0x80 | (code & 0x3f));
+    }
+    else if (code < 0x10000)
+    {
+        out += char(0xe0 | (code >> 12));
+        out += char(0x80 | ((code >> 6) & 0x3f));
+        out += char(0x80 | (code & 0x3f));
+    }
+    else
+    {
+        out += char(0xf0 | (code >> 18));
+        out += char(0x80 | ((code >> 12) & 0x3f));
+        out += char(0x80 | ((code >> 6) & 0x3f));
+        out += char(0x80 | (code & 0x3f));
+    }
+}
+
+string json_field(const string &json, const string &key, const string &fallback)
+{
+    size_t pos = json.find('"' + key + '"');
+    if (pos == string::npos)
+        return fallback;
+    pos = json.find(':', pos + key.size() + 2);
+    if (pos == string::npos)
+        return fallback;
+    pos = json.find_first_not_of(" \t\r\n", pos + 1);
+    if (pos == string::npos)
+        return fallback;
+
+    if (json[pos] != '"')
+    {
+        size_t end = json.find_first_of(",}] \t\r\n", pos);
+        return json.substr(pos, end == string::npos ? string::npos : end - pos);
+    }
+
+    string value;
+    for (pos++; pos < json.size() and json[pos] != '"'; pos++)
+    {
+        if (json[pos] != '\\' or pos + 1 >= json.size())
+        {
+            value += json[pos];
+            continue;
+        }
+        switch (json[++pos])
+        {
+        case 'n':
+            value += '\n';
+            break;
+        case 'r':
+            value += '\r';
+            break;
+        case 't':
+            value += '\t';
+            break;
+        case 'u':
+        {
+            unsigned code = hex4(json, pos + 1);
+            pos += 4;
+            // Surrogate pair
+            if (code >= 0xd800 and code < 0xdc00 and json.compare(pos + 1, 2, "\\u") == 0)
+            {
+                unsigned low = hex4(json, pos + 3);
+                if (low >= 0xdc00 and low < 0xe000)
+                {
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    pos += 6;
+                }
+            }
+            append_utf8(value, code);
+            break;
+        }
+        default:
+            value += json[pos];
+        }
+    }
+    return value;
+}
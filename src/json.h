@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string>
+
+// Quotes and escapes s as a JSON string
+std::string json_string(const std::string &s);
+
+// Finds "key" at any depth in a flat JSON reply and returns its value:
+// strings unescaped, anything else as the raw token. Returns fallback if
+// the key is missing. Only meant for the small replies our own helpers
+// write, not general JSON.
+std::string json_field(const std::string &json, const std::string &key,
+                       const std::string &fallback = "");
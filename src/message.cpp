@@ -0,0 +1,41 @@
+#include "message.h"
+
+MessageType message_type(const char *buffer, size_t size)
+{
+    if (size < sizeof(MessageHeader))
+        return MessageType::invalid;
+    MessageHeader header;
+    memcpy(&header, buffer, sizeof(header));
+    if (header.version != MESSAGE_VERSION or header.length != size - sizeof(header) or
+        header.type < MessageType::start or header.type > MessageType::segment_closed)
+        return MessageType::invalid;
+    return header.type;
+}
+
+size_t encode_segment_closed(const SegmentClosedMessage &message, std::string_view path,
+                             char *buffer, size_t size)
+{
+    size_t length = sizeof(message) + path.size();
+    if (size < sizeof(MessageHeader) + length or length > UINT16_MAX)
+        return 0;
+    SegmentClosedMessage sized = message;
+    sized.path_length = path.size();
+    MessageHeader header = {MESSAGE_VERSION, MessageType::segment_closed, (uint16_t)length};
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), &sized, sizeof(sized));
+    memcpy(buffer + sizeof(header) + sizeof(sized), path.data(), path.size());
+    return sizeof(header) + length;
+}
+
+bool decode_segment_closed(const char *buffer, size_t size, SegmentClosedMessage &message,
+                           std::string_view &path)
+{
+    if (message_type(buffer, size) != MessageType::segment_closed or
+        size < sizeof(MessageHeader) + sizeof(message))
+        return false;
+    memcpy(&message, buffer + sizeof(MessageHeader), sizeof(message));
+    if (message.path_length != size - sizeof(MessageHeader) - sizeof(message))
+        return false;
+    path = std::string_view(buffer + sizeof(MessageHeader) + sizeof(message), message.path_length);
+    return true;
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mqueue.h>
+#include <string_view>
+#include <type_traits>
+
+/*
+ * Messages between the bus and the recorder over their POSIX message
+ * queues. Each is a 4-byte header (version, type, payload length) and a
+ * fixed-size payload struct, except segment_closed, which is followed by
+ * its path. The payload is the struct's own bytes: both processes run on
+ * the same machine from the same build, and the structs have no padding,
+ * so nothing uninitialised goes out. A message from another version, of
+ * an unknown type or of the wrong length is rejected whole.
+ *
+ * Encoding and decoding never allocate; a message is built in, and read
+ * from, a MESSAGE_MAX_SIZE buffer on the stack.
+ */
+
+// Bump whenever a payload changes
+constexpr uint8_t MESSAGE_VERSION = 1;
+// The largest message, header included; also the queues' mq_msgsize
+constexpr size_t MESSAGE_MAX_SIZE = 256;
+// For a gain or squelch the recorder should leave at its default
+constexpr int32_t MESSAGE_UNSET = INT32_MIN;
+
+enum class MessageType : uint8_t
+{
+    invalid = 0,
+    // Bus to recorder
+    start,
+    retune,
+    gain,
+    squelch,
+    quit,
+    // Recorder to bus
+    status,
+    segment_closed,
+};
+
+struct MessageHeader
+{
+    uint8_t version;
+    MessageType type;
+    // Bytes after the header
+    uint16_t length;
+};
+
+// Starts, or restarts, the radio; 0 and MESSAGE_UNSET keep the defaults
+// in recorder.sh
+struct StartMessage
+{
+    static constexpr MessageType type = MessageType::start;
+    uint64_t freq_hz = 0;
+    int32_t gain_tenths_db = MESSAGE_UNSET;
+    int32_t squelch = MESSAGE_UNSET;
+    uint32_t sample_rate = 0;
+    uint32_t resample_rate = 0;
+};
+
+struct RetuneMessage
+{
+    static constexpr MessageType type = MessageType::retune;
+    uint64_t freq_hz = 0;
+};
+
+struct GainMessage
+{
+    static constexpr MessageType type = MessageType::gain;
+    int32_t gain_tenths_db = MESSAGE_UNSET;
+};
+
+struct SquelchMessage
+{
+    static constexpr MessageType type = MessageType::squelch;
+    int32_t squelch = MESSAGE_UNSET;
+};
+
+struct QuitMessage
+{
+    static constexpr MessageType type = MessageType::quit;
+};
+
+enum class RecorderState : uint32_t
+{
+    shell_started = 1,
+    shell_stopped,
+    quitting,
+};
+
+// What the recorder just did and how the radio is set
+struct StatusMessage
+{
+    static constexpr MessageType type = MessageType::status;
+    uint64_t freq_hz = 0;
+    int32_t shell_pid = -1;
+    RecorderState state = RecorderState::shell_stopped;
+    int32_t gain_tenths_db = MESSAGE_UNSET;
+    int32_t squelch = MESSAGE_UNSET;
+};
+
+// An audio file the recorder has finished writing; its path follows
+struct SegmentClosedMessage
+{
+    static constexpr MessageType type = MessageType::segment_closed;
+    int64_t start_us = 0;
+    uint32_t duration_ms = 0;
+    uint32_t path_length = 0;
+};
+
+// The type of the message in buffer, or invalid if its header is
+// malformed or from another version
+MessageType message_type(const char *buffer, size_t size);
+
+// Encodes message into buffer; the bytes to send, or 0 if it won't fit
+template <class T>
+size_t encode_message(const T &message, char *buffer, size_t size)
+{
+    static_assert(std::is_empty_v<T> or std::has_unique_object_representations_v<T>,
+                  "message payloads must have no padding");
+    constexpr size_t length = std::is_empty_v<T> ? 0 : sizeof(T);
+    if (size < sizeof(MessageHeader) + length)
+        return 0;
+    MessageHeader header = {MESSAGE_VERSION, T::type, length};
+    memcpy(buffer, &header, sizeof(header));
+    if constexpr (length > 0)
+        memcpy(buffer + sizeof(header), &message, length);
+    return sizeof(header) + length;
+}
+
+// Reads a message of type T out of buffer; false if it holds anything else
+template <class T>
+bool decode_message(const char *buffer, size_t size, T &message)
+{
+    constexpr size_t length = std::is_empty_v<T> ? 0 : sizeof(T);
+    if (message_type(buffer, size) != T::type or size != sizeof(MessageHeader) + length)
+        return false;
+    if constexpr (length > 0)
+        memcpy(&message, buffer + sizeof(MessageHeader), length);
+    return true;
+}
+
+size_t encode_segment_closed(const SegmentClosedMessage &message, std::string_view path,
+                             char *buffer, size_t size);
+// path points into buffer, so it is only good as long as buffer is
+bool decode_segment_closed(const char *buffer, size_t size, SegmentClosedMessage &message,
+                           std::string_view &path);
+
+// Encodes and sends message; false if it won't fit or mq_send fails
+template <class T>
+bool send_message(mqd_t queue, const T &message)
+{
+    char buffer[MESSAGE_MAX_SIZE];
+    size_t size = encode_message(message, buffer, sizeof(buffer));
+    return size > 0 and mq_send(queue, buffer, size, 0) == 0;
+}
@@ -0,0 +1,106 @@
+# Mock API
+#
+# Local stand-in for the Twitter v2 API, for testing the publish service
+# offline. Point PUBLISH_API_BASE_URL at it, e.g. http://127.0.0.1:8089
+#
+# It also accepts the webhook sink's batches on /webhook and logs how many
+# records each one held.
+#
+#     python3 mock_api.py [port] [posts per window] [window seconds]
+#
+# Like the real API it reports x-rate-limit-* headers and answers 429 once
+# the window's posts are used up.
+import itertools
+import threading
+import json
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+post_ids = itertools.count(1000)
+
+
+class RateWindow:
+    def __init__(self, limit, seconds):
+        self.limit = limit
+        self.seconds = seconds
+        self.reset = 0
+        self.remaining = limit
+        self.lock = threading.Lock()
+
+    def take(self):
+        """Returns (allowed, remaining, reset)."""
+        with self.lock:
+            now = time.time()
+            if now >= self.reset:
+                self.reset = int(now) + self.seconds
+                self.remaining = self.limit
+            if self.remaining == 0:
+                return False, 0, self.reset
+            self.remaining -= 1
+            return True, self.remaining, self.reset
+
+
+window = RateWindow(300, 3 * 60 * 60)
+
+
+class Handler(BaseHTTPRequestHandler):
+    # Keep-alive, so the publish service can reuse its connection
+    protocol_version = "HTTP/1.1"
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        if self.path == "/webhook":
+            try:
+                records = json.loads(body)
+            except ValueError:
+                self.respond(400, {"title": "Invalid Request"})
+                return
+            print("{:.3f} webhook batch of {}".format(time.time(), len(records)), file=sys.stderr)
+            self.respond(200, {"received": len(records)})
+            return
+        if self.path != "/2/tweets":
+            self.respond(404, {"title": "Not Found"})
+            return
+        try:
+            text = json.loads(body)["text"]
+        except (ValueError, KeyError):
+            self.respond(400, {"title": "Invalid Request"})
+            return
+        allowed, remaining, reset = window.take()
+        limits = {"x-rate-limit-limit": window.limit,
+                  "x-rate-limit-remaining": remaining,
+                  "x-rate-limit-reset": reset}
+        if not allowed:
+            self.respond(429, {"title": "Too Many Requests"}, limits)
+            return
+        self.respond(201, {"data": {"id": str(next(post_ids)), "text": text}}, limits)
+
+    def respond(self, status, payload, headers={}):
+        data = json.dumps(payload).encode()
+        self.send_response(status)
+        for header, value in headers.items():
+            self.send_header(header, str(value))
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def log_message(self, format, *args):
+        print("{:.3f} {}".format(time.time(), format % args), file=sys.stderr)
+
+
+def main():
+    global window
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 8089
+    if len(sys.argv) > 3:
+        window = RateWindow(int(sys.argv[2]), int(sys.argv[3]))
+    server = ThreadingHTTPServer(("127.0.0.1", port), Handler)
+    print("Mock API on http://127.0.0.1:{}".format(port), file=sys.stderr)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == "__main__":
+    main()
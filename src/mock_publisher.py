@@ -0,0 +1,47 @@
+# Mock publisher
+#
+# Drop-in stand-in for publisher.py that never touches Twitter. Posts are
+# appended to MOCK_PUBLISH_LOG instead. Select it with PUBLISHER_SCRIPT in
+# the config.
+import sys
+import time
+from mock_stage import MockFailure, config, simulate
+from publish_service import serve
+
+
+def post(key, message, reply_to=None):
+    rng = simulate("PUBLISHER", key)
+    post_id = rng.getrandbits(63)
+    with open(config.get("MOCK_PUBLISH_LOG", "/tmp/scannerbot_mock_posts.log"), 'a') as log:
+        log.write("{:.3f}\t{}\t{}\t{}\n".format(time.time(), post_id, reply_to or "",
+                                              message.replace("\n", " ")))
+    return {"post_id": post_id}
+
+
+def main():
+    try:
+        if (len(sys.argv) < 2):
+            print("No file name given.")
+            exit()
+
+        if sys.argv[1] == "--serve":
+            socket_path = config.get("PUBLISHER_SOCKET", "/tmp/scannerbot_publisher.sock")
+            if len(sys.argv) > 2:
+                socket_path = sys.argv[2]
+            # Seeded by the job ID, so a retried job gets the same post ID
+            # and failure however many posts came before it
+            serve(socket_path, lambda text, reply_to, job_id: post(job_id or text, text, reply_to),
+                  config.get("MOCK_PUBLISH_JOURNAL"))
+            return
+
+        with open(sys.argv[1], 'r') as f:
+            message = f.read()
+        print(post(sys.argv[1], message)["post_id"])
+    except MockFailure as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
+    except KeyboardInterrupt:
+        exit()
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,51 @@
+# Mock stage
+#
+# Shared behaviour for the mock transcriber and publisher: seeded random
+# latency, failures and output sizes, so the bus can be load tested
+# offline and every run behaves the same for the same inputs.
+import random
+import time
+import zlib
+from dotenv import dotenv_values
+
+config = dotenv_values("/home/corey/scannerbot/config/scannerbot.env")
+
+WORDS = ("unit", "copy", "en route", "on scene", "clear", "respond", "code",
+         "northbound", "southbound", "station", "medic", "engine", "trolley",
+         "blue line", "orange line", "delay", "switch", "platform", "ten four")
+
+
+class MockFailure(Exception):
+    pass
+
+
+def setting(stage, name, fallback):
+    return float(config.get("MOCK_" + stage + "_" + name, fallback))
+
+
+def rng_for(stage, key):
+    """One generator per input, so results don't depend on arrival order."""
+    seed = int(config.get("MOCK_SEED", 1))
+    return random.Random(seed * 1000003 + zlib.crc32((stage + key).encode()))
+
+
+def simulate(stage, key):
+    """
+    Sleeps for a log-normally distributed time around the stage's median
+    latency, then raises MockFailure at the configured rate. Returns the
+    generator for producing output.
+    """
+    rng = rng_for(stage, key)
+    median = setting(stage, "LATENCY_MS", 500) / 1000
+    sigma = setting(stage, "LATENCY_SIGMA", 0.5)
+    time.sleep(median * rng.lognormvariate(0, sigma))
+
+    if rng.random() < setting(stage, "FAILURE_RATE", 0.0):
+        raise MockFailure("Mock {} failure for {}".format(stage.lower(), key))
+    return rng
+
+
+def words(rng, stage):
+    low = int(setting(stage, "MIN_WORDS", 3))
+    high = int(setting(stage, "MAX_WORDS", 30))
+    return " ".join(rng.choice(WORDS) for _ in range(rng.randint(low, max(low, high))))
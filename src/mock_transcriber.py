@@ -0,0 +1,33 @@
+# Mock transcriber
+#
+# Drop-in stand-in for transcriber.py that never loads Whisper. Select it
+# with TRANSCRIBER_SCRIPT in the config.
+import os
+import sys
+from mock_stage import MockFailure, simulate, words
+
+
+# Same naming as transcriber.write_file, without importing Whisper
+def write_file(audioPath, transcription):
+    name = os.path.basename(audioPath).split('.')[0]
+    with open("/home/corey/scannerbot/transcripts/" + name + ".txt", 'w') as file:
+        file.write(transcription)
+
+
+def main():
+    try:
+        if (len(sys.argv) < 2):
+            print("Missing filename.\nUsage:\n\tmock_transcriber.py filename [model]")
+            sys.exit()
+
+        audioFilePath = sys.argv[1]
+        rng = simulate("TRANSCRIBER", audioFilePath)
+        write_file(audioFilePath, words(rng, "TRANSCRIBER"))
+    except MockFailure as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
+    except KeyboardInterrupt:
+        exit()
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,283 @@
+#include "outbox.h"
+#include "config.h"
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <vector>
+
+using std::string;
+using namespace std::chrono;
+
+void Outbox::configure()
+{
+    posting = ("," + config_get("SINKS", "twitter") + ",").find(",twitter,") != string::npos;
+    retry_base_seconds = config_get_int("OUTBOX_RETRY_BASE_SECONDS", 30);
+    retry_max_seconds = config_get_int("OUTBOX_RETRY_MAX_SECONDS", 3600);
+    max_attempts = config_get_int("OUTBOX_MAX_ATTEMPTS", 10);
+}
+
+void Outbox::init(DatabaseWriter *databaseWriter, ReaderPool *readerPool)
+{
+    writer = databaseWriter;
+    readers = readerPool;
+
+    writer->submit(
+        [](Database &db)
+        {
+            if (not db.exec("CREATE TABLE IF NOT EXISTS outbox(\
+                    id INTEGER PRIMARY KEY AUTOINCREMENT,\
+                    info_id INTEGER REFERENCES info(id),\
+                    idempotency_key TEXT NOT NULL UNIQUE,\
+                    channel TEXT, text TEXT NOT NULL,\
+                    status TEXT NOT NULL DEFAULT 'pending',\
+                    attempts INTEGER NOT NULL DEFAULT 0,\
+                    next_attempt INTEGER NOT NULL DEFAULT 0,\
+                    last_error TEXT, post_id TEXT, post_url TEXT,\
+                    digest TEXT, digest_index INTEGER);"))
+                return false;
+
+            // Outboxes from before digests were journaled
+            bool has_digest;
+            {
+                Statement column = db.prepare("SELECT 1 FROM pragma_table_info('outbox') WHERE name = 'digest';");
+                has_digest = column.step() == SQLITE_ROW;
+            }
+            if (not has_digest and not db.exec("ALTER TABLE outbox ADD COLUMN digest TEXT;\
+                    ALTER TABLE outbox ADD COLUMN digest_index INTEGER;"))
+                return false;
+            return db.exec("CREATE INDEX IF NOT EXISTS outbox_due ON outbox(status, next_attempt);\
+                  CREATE INDEX IF NOT EXISTS outbox_digest ON outbox(digest, digest_index);");
+        }).wait();
+}
+
+std::future<bool> Outbox::add_transcript(const string &segment, const string &text,
+                                         const string &channel, bool post)
+{
+    bool queue = posting and post;
+    return writer->submit(
+        [this, segment, text, channel, queue](Database &db)
+        {
+            // The info row was written when the audio file turned up;
+            // info_segment makes this one index lookup
+            Statement update = db.prepare(
+                "UPDATE info SET transcript = ?1, freq = coalesce(freq, ?2) "
+                "WHERE segment = ?3 RETURNING id;");
+            update.bind_text(1, text).bind_text(2, channel).bind_text(3, segment);
+            sqlite3_int64 info_id = 0;
+            int resultcode;
+            while ((resultcode = update.step()) == SQLITE_ROW)
+                info_id = update.column_int64(0);
+            if (resultcode != SQLITE_DONE or not queue)
+                return resultcode == SQLITE_DONE;
+
+            // A key already present means this transcript was queued before a
+            // restart; keep the original row and its state.
+            Statement insert = db.prepare(
+                "INSERT OR IGNORE INTO outbox (info_id, idempotency_key, channel, text) "
+                "VALUES (nullif(?1, 0), ?2, ?3, ?4);");
+            insert.bind_int64(1, info_id).bind_text(2, "seg:" + segment).bind_text(3, channel).bind_text(4, text);
+            if (not insert.run())
+                return false;
+
+            // The worker can't read the row until this batch commits and
+            // lets go of the database.
+            outboxReady.notify_one();
+            return true;
+        });
+}
+
+void Outbox::start(PublisherClient &client)
+{
+    if (not posting)
+        return;
+
+    // Already running
+    if (worker.joinable())
+        return;
+
+    publisher = &client;
+    publisher->set_result_handler(
+        [this](const PublishJob &job, bool ok, const string &post_id, const string &error)
+        { on_result(job, ok, post_id, error); });
+    publisher->set_digest_handler(
+        [this](const string &digest, const std::vector<string> &members)
+        { return on_digest(digest, members); });
+
+    do_stop = false;
+    worker = std::thread(&Outbox::run_worker, this);
+}
+
+void Outbox::stop()
+{
+    do_stop = true;
+    outboxReady.notify_all();
+    if (worker.joinable())
+        worker.join();
+
+    // Anything still with the publisher stays pending and is picked up
+    // again after the next start.
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    in_flight.clear();
+}
+
+void Outbox::run_worker()
+{
+    while (not do_stop)
+    {
+        struct Due
+        {
+            string key, channel, text;
+        };
+        std::vector<Due> due;
+        // Digests recorded on an earlier attempt, all of whose members go
+        // out again together, in their recorded order
+        std::map<string, std::vector<Due>> digests;
+
+        {
+            ReaderPool::Lease db = readers->acquire();
+            Statement select = db->prepare(
+                "SELECT idempotency_key, coalesce(channel, ''), text, coalesce(digest, '') FROM outbox "
+                "WHERE status = 'pending' AND next_attempt <= ?1 "
+                "ORDER BY id LIMIT 100;");
+            select.bind_int64(1, time(nullptr));
+            Statement members = db->prepare(
+                "SELECT idempotency_key, coalesce(channel, ''), text FROM outbox "
+                "WHERE digest = ?1 AND status = 'pending' ORDER BY digest_index;");
+
+            std::lock_guard<std::mutex> lock(outboxMutex);
+            while (select.step() == SQLITE_ROW)
+            {
+                string key = select.column_text(0);
+                string digest = select.column_text(3);
+                if (in_flight.count(key))
+                    continue;
+                if (not digest.empty())
+                    digests[digest];
+                else if (in_flight.insert(key).second)
+                    due.push_back({key, select.column_text(1), select.column_text(2)});
+            }
+            for (auto &[digest, rows] : digests)
+            {
+                members.bind_text(1, digest);
+                while (members.step() == SQLITE_ROW)
+                {
+                    string key = members.column_text(0);
+                    in_flight.insert(key);
+                    rows.push_back({key, members.column_text(1), members.column_text(2)});
+                }
+                members.reset();
+            }
+        }
+
+        // Never call into the publisher holding our locks; it reports
+        // dropped jobs back from inside submit().
+        for (auto &row : due)
+            publisher->submit(row.key, row.text, row.channel);
+        for (auto &[digest, rows] : digests)
+        {
+            std::vector<string> ids, texts;
+            for (auto &row : rows)
+            {
+                ids.push_back(row.key);
+                texts.push_back(row.text);
+            }
+            publisher->submit_digest(digest, ids, texts, rows.front().channel);
+        }
+
+        std::unique_lock<std::mutex> lock(outboxMutex);
+        outboxReady.wait_for(lock, 1s);
+    }
+}
+
+bool Outbox::on_digest(const string &digest, const std::vector<string> &members)
+{
+    // Stored before the first post goes out, so a crash or a failed part
+    // can't leave members to be recomposed into a digest of another ID
+    return writer->submit(
+                     [&digest, &members](Database &db)
+                     {
+                         Statement update = db.prepare(
+                             "UPDATE outbox SET digest = ?1, digest_index = ?2 WHERE idempotency_key = ?3;");
+                         for (size_t index = 0; index < members.size(); index++)
+                         {
+                             update.bind_text(1, digest).bind_int64(2, index).bind_text(3, members[index]);
+                             if (not update.run())
+                                 return false;
+                             update.reset();
+                         }
+                         return true;
+                     })
+        .get();
+}
+
+void Outbox::on_result(const PublishJob &job, bool ok, const string &post_id,
+                       const string &error)
+{
+    string url = config_get("PUBLISH_POST_URL_PREFIX", "https://twitter.com/i/web/status/") + post_id;
+
+    // Wait for the outcome to be stored, or the worker could pick the
+    // rows up again as soon as they leave in_flight.
+    writer->submit(
+        [this, &job, ok, &post_id, &error, &url](Database &db)
+        {
+            // Backoff doubles per attempt, then the row is given up on
+            Statement update = db.prepare(
+                ok ? "UPDATE outbox SET status = 'sent', attempts = attempts + 1, "
+                     "post_id = ?1, post_url = ?2, last_error = NULL "
+                     "WHERE idempotency_key = ?3 RETURNING info_id;"
+                   : "UPDATE outbox SET attempts = attempts + 1, last_error = ?1, "
+                     "status = iif(attempts + 1 >= ?4, 'failed', 'pending'), "
+                     "next_attempt = ?5 + min(?6, ?7 << min(attempts, 30)) "
+                     "WHERE idempotency_key = ?3 RETURNING status;");
+            Statement info = db.prepare("UPDATE info SET postID = ?1, postURL = ?2 WHERE id = ?3;");
+
+            for (auto &key : job.members)
+            {
+                update.bind_text(1, ok ? post_id : error).bind_text(3, key);
+                if (ok)
+                    update.bind_text(2, url);
+                else
+                    update.bind_int64(4, max_attempts)
+                        .bind_int64(5, time(nullptr))
+                        .bind_int64(6, retry_max_seconds)
+                        .bind_int64(7, retry_base_seconds);
+
+                int resultcode;
+                while ((resultcode = update.step()) == SQLITE_ROW)
+                {
+                    if (ok and not update.column_null(0))
+                    {
+                        info.bind_text(1, post_id).bind_text(2, url).bind_int64(3, update.column_int64(0));
+                        if (not info.run())
+                            return false;
+                        info.reset();
+                    }
+                    else if (not ok)
+                    {
+                        string status = update.column_text(0);
+                        std::lock_guard<std::mutex> lock(outboxMutex);
+                        (status == "failed" ? given_up : retried)++;
+                    }
+                }
+                if (resultcode != SQLITE_DONE)
+                    return false;
+                update.reset();
+            }
+            return true;
+        }).wait();
+
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    for (auto &key : job.members)
+        in_flight.erase(key);
+    if (ok)
+        sent += job.members.size();
+}
+
+void Outbox::print_stats(std::ostream &out)
+{
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    out << "\nOutbox: " << sent << " sent, " << retried << " retries scheduled, "
+        << given_up << " given up, " << in_flight.size() << " in flight";
+}
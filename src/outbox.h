@@ -0,0 +1,71 @@
+#pragma once
+
+#include "database.h"
+#include "db_writer.h"
+#include "publisher.h"
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+/*
+ * Durable queue of posts, kept in the outbox table next to info.
+ *
+ * A transcript is written to its info row and its outbox row in one
+ * transaction, so a crash can't lose it between the two. A worker hands
+ * due rows to the publisher and records the outcome: the post ID and URL
+ * on success, or a retry time with exponential backoff on failure. Each
+ * row's idempotency key ("seg:" plus the segment's file stem) is sent as
+ * the job ID, and the publish service answers a key it has already posted
+ * with the original post instead of posting again. A digest's ID and
+ * members are stored on its rows before it is posted, and a retry posts
+ * the same digest again, so its parts carry the same keys.
+ */
+class Outbox
+{
+public:
+    // Posting is on when SINKS includes "twitter"
+    void configure();
+    // Creates the outbox table. Changes go through writer and reads
+    // through readers.
+    void init(DatabaseWriter *writer, ReaderPool *readers);
+    // Stores the transcript on the segment's info row and, if posting is
+    // on and post is set, queues it for posting. The future is false if
+    // the write failed.
+    std::future<bool> add_transcript(const std::string &segment, const std::string &text,
+                                     const std::string &channel, bool post = true);
+    void start(PublisherClient &publisher);
+    void stop();
+    void print_stats(std::ostream &out);
+
+private:
+    void run_worker();
+    void on_result(const PublishJob &job, bool ok, const std::string &post_id,
+                   const std::string &error);
+    bool on_digest(const std::string &digest, const std::vector<std::string> &members);
+
+    DatabaseWriter *writer = nullptr;
+    ReaderPool *readers = nullptr;
+    PublisherClient *publisher = nullptr;
+
+    bool posting = true;
+    long retry_base_seconds = 30;
+    long retry_max_seconds = 3600;
+    long max_attempts = 10;
+
+    // Keys handed to the publisher and not yet reported back
+    std::unordered_set<std::string> in_flight;
+    std::mutex outboxMutex;
+    std::condition_variable outboxReady;
+    std::thread worker;
+    std::atomic<bool> do_stop = false;
+
+    unsigned long sent = 0;
+    unsigned long retried = 0;
+    unsigned long given_up = 0;
+};
@@ -0,0 +1,109 @@
+# Publish service
+#
+# Keeps a publisher running between posts. The bus connects over a Unix
+# socket and writes one JSON job per line:
+#     {"id": "...", "text": "..."}
+# A job may carry "reply_to": post_id to continue a digest thread. The bus
+# reads one JSON reply per line:
+#     {"id": "...", "ok": true, "post_id": "...", "latency_ms": 123.4,
+#      "rate_limit_remaining": 299, "rate_limit_reset": 1680000000}
+# The rate limit fields are passed through from the API's response headers
+# when it sends them, so the bus can pace itself.
+#
+# Job IDs are idempotency keys. Every successful post is appended to a
+# journal, and a job whose ID is already there is answered with the
+# original post ID instead of being posted again, so the bus can safely
+# retry after a crash.
+import json
+import os
+import socketserver
+import sys
+import time
+
+
+class RateLimited(Exception):
+    """Raised by post functions when the API refuses with HTTP 429."""
+    def __init__(self, reset):
+        super().__init__("Rate limited until {}".format(reset))
+        self.reset = reset
+
+
+def rate_limit_fields(headers):
+    fields = {}
+    for header, field in (("x-rate-limit-limit", "rate_limit_limit"),
+                          ("x-rate-limit-remaining", "rate_limit_remaining"),
+                          ("x-rate-limit-reset", "rate_limit_reset")):
+        if header in headers:
+            fields[field] = int(headers[header])
+    return fields
+
+
+class Journal:
+    def __init__(self, path):
+        self.path = path
+        self.posted = {}
+        if path and os.path.exists(path):
+            with open(path) as file:
+                for line in file:
+                    try:
+                        entry = json.loads(line)
+                        self.posted[entry["id"]] = entry["post_id"]
+                    except (ValueError, KeyError):
+                        pass  # Torn last line from a crash
+
+    def record(self, job_id, post_id):
+        self.posted[job_id] = post_id
+        if not self.path:
+            return
+        with open(self.path, 'a') as file:
+            file.write(json.dumps({"id": job_id, "post_id": post_id}) + "\n")
+            file.flush()
+            os.fsync(file.fileno())
+
+
+def serve(socket_path, post, journal_path=None):
+    """
+    Answers jobs with post(text, reply_to, job_id), which returns a dict
+    holding the new post's "post_id" and any rate limit fields, or raises.
+    job_id is the job's idempotency key, the same on every retry. The
+    connection stays open for as many jobs as the bus sends.
+    """
+    journal = Journal(journal_path)
+
+    class Handler(socketserver.StreamRequestHandler):
+        def handle(self):
+            for line in self.rfile:
+                reply = {}
+                start = time.monotonic()
+                try:
+                    job = json.loads(line)
+                    reply["id"] = job.get("id")
+                    if reply["id"] in journal.posted:
+                        reply["post_id"] = journal.posted[reply["id"]]
+                        reply["duplicate"] = True
+                    else:
+                        reply.update(post(job["text"], job.get("reply_to"), reply["id"]))
+                        reply["post_id"] = str(reply["post_id"])
+                        if reply["id"]:
+                            journal.record(reply["id"], reply["post_id"])
+                    reply["ok"] = True
+                except RateLimited as e:
+                    reply["ok"] = False
+                    reply["rate_limited"] = True
+                    reply["rate_limit_reset"] = e.reset
+                    reply["error"] = str(e)
+                except Exception as e:
+                    reply["ok"] = False
+                    reply["error"] = str(e)
+                reply["latency_ms"] = round((time.monotonic() - start) * 1000, 1)
+                self.wfile.write((json.dumps(reply) + "\n").encode())
+                self.wfile.flush()
+
+    if os.path.exists(socket_path):
+        os.unlink(socket_path)
+    with socketserver.UnixStreamServer(socket_path, Handler) as server:
+        print("Publisher listening on " + socket_path, file=sys.stderr)
+        try:
+            server.serve_forever()
+        except KeyboardInterrupt:
+            pass
@@ -0,0 +1,606 @@
+#include "publisher.h"
+#include "config.h"
+#include "json.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <ctime>
+#include <cstring>
+#include <iostream>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using std::string;
+using namespace std::chrono;
+
+extern char **environ;
+
+void TokenBucket::configure(double limit, double window_seconds, double burst)
+{
+    per_second = limit / std::max(window_seconds, 1.0);
+    capacity = std::max(burst, 1.0);
+    tokens = capacity;
+    last_refill = steady_clock::now();
+    blocked_until = last_refill;
+}
+
+void TokenBucket::refill(steady_clock::time_point now)
+{
+    if (now < blocked_until)
+        return;
+    // Nothing accrues while the API has us blocked
+    auto since = std::max(last_refill, blocked_until);
+    tokens = std::min(capacity, tokens + duration<double>(now - since).count() * per_second);
+    last_refill = now;
+}
+
+steady_clock::duration TokenBucket::wait_time()
+{
+    auto now = steady_clock::now();
+    refill(now);
+    if (now < blocked_until)
+        return blocked_until - now;
+    if (tokens >= 1)
+        return steady_clock::duration::zero();
+    return duration_cast<steady_clock::duration>(duration<double>((1 - tokens) / per_second));
+}
+
+void TokenBucket::take()
+{
+    tokens -= 1;
+}
+
+void TokenBucket::observe(long remaining, long reset)
+{
+    tokens = std::min(tokens, double(remaining));
+    if (remaining > 0)
+        return;
+
+    // Convert the API's wall clock reset to our steady clock
+    auto until_reset = system_clock::from_time_t(reset) - system_clock::now();
+    auto now = steady_clock::now();
+    blocked_until = std::max(blocked_until, now + duration_cast<steady_clock::duration>(until_reset));
+    last_refill = blocked_until;
+}
+
+// Characters as the platform counts them, roughly: UTF-8 code points
+static size_t char_count(const string &s)
+{
+    size_t count = 0;
+    for (unsigned char c : s)
+        count += (c & 0xc0) != 0x80;
+    return count;
+}
+
+// Byte offset of the end of the first max_chars characters
+static size_t char_offset(const string &s, size_t max_chars)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < s.size(); i++)
+        if ((s[i] & 0xc0) != 0x80 and count++ == max_chars)
+            return i;
+    return s.size();
+}
+
+std::vector<string> pack_posts(const string &header, const std::vector<string> &texts,
+                               size_t max_chars)
+{
+    std::vector<string> posts;
+    string post;
+    size_t room = max_chars > char_count(header) + 1 ? max_chars - char_count(header) : 1;
+
+    for (string text : texts)
+    {
+        // Collapse the transcriber's line breaks and padding
+        std::replace(text.begin(), text.end(), '\n', ' ');
+        text.erase(0, text.find_first_not_of(' '));
+        text.erase(text.find_last_not_of(' ') + 1);
+        if (text.empty())
+            continue;
+
+        while (not text.empty())
+        {
+            size_t used = char_count(post);
+            size_t needed = char_count(text) + (post.empty() ? 0 : 1);
+            if (used + needed <= room)
+            {
+                post += (post.empty() ? "" : "\n") + text;
+                break;
+            }
+            if (not post.empty())
+            {
+                posts.push_back(header + post);
+                post.clear();
+                continue;
+            }
+
+            // Too long for a post of its own; cut at the last space that fits
+            size_t cut = char_offset(text, room);
+            size_t space = text.rfind(' ', cut);
+            if (space != string::npos and space > 0)
+                cut = space;
+            posts.push_back(header + text.substr(0, cut));
+            text.erase(0, text.find_first_not_of(' ', cut) == string::npos
+                              ? text.size()
+                              : text.find_first_not_of(' ', cut));
+        }
+    }
+    if (not post.empty())
+        posts.push_back(header + post);
+    return posts;
+}
+
+void PublisherClient::configure()
+{
+    script = config_get("PUBLISHER_SCRIPT", "/home/corey/scannerbot/src/publisher.py");
+    socket_path = config_get("PUBLISHER_SOCKET", "/tmp/scannerbot_publisher.sock");
+    timeout_seconds = config_get_int("PUBLISH_TIMEOUT_SECONDS", 45);
+    max_queue = config_get_int("PUBLISH_QUEUE_MAX", 1000);
+    bucket.configure(config_get_double("PUBLISH_RATE_LIMIT", 300),
+                     config_get_double("PUBLISH_RATE_WINDOW_SECONDS", 3 * 60 * 60),
+                     config_get_double("PUBLISH_BURST", 10));
+
+    string mode = config_get("PUBLISH_DIGEST_MODE", "off");
+    digest_mode = mode == "batch"    ? DigestMode::batch
+                  : mode == "thread" ? DigestMode::thread
+                                     : DigestMode::off;
+    digest_window = std::chrono::seconds(config_get_int("PUBLISH_DIGEST_WINDOW_SECONDS", 60));
+    max_chars = config_get_int("PUBLISH_MAX_CHARS", 280);
+}
+
+void PublisherClient::set_result_handler(ResultHandler handler)
+{
+    result_handler = handler;
+}
+
+void PublisherClient::set_digest_handler(DigestHandler handler)
+{
+    digest_handler = handler;
+}
+
+void PublisherClient::report(const PublishJob &job, bool ok, const string &post_id,
+                             const string &error)
+{
+    if (result_handler)
+        result_handler(job, ok, post_id, error);
+}
+
+void PublisherClient::start()
+{
+    // Already running
+    if (worker.joinable())
+        return;
+
+    char *service_args[] = {(char *)"python3", (char *)script.c_str(), (char *)"--serve",
+                            (char *)socket_path.c_str(), nullptr};
+    int spawn_err = posix_spawnp(&service_pid, "python3", nullptr, nullptr,
+                                 service_args, environ);
+    if (spawn_err != 0)
+    {
+        std::cerr << "\nError starting publish service: " << strerror(spawn_err);
+        service_pid = -1;
+    }
+
+    do_stop = false;
+    worker = std::thread(&PublisherClient::run_worker, this);
+}
+
+void PublisherClient::stop()
+{
+    do_stop = true;
+    queueReady.notify_all();
+    if (worker.joinable())
+        worker.join();
+
+    disconnect();
+    if (service_pid != -1)
+    {
+        kill(service_pid, SIGTERM);
+        waitpid(service_pid, nullptr, 0);
+        service_pid = -1;
+    }
+}
+
+void PublisherClient::run_deferred(std::unique_lock<std::mutex> &lock)
+{
+    // Posting a recorded digest can drop older jobs, so go until nothing
+    // new turns up
+    while (not closed_digests.empty() or not failed_jobs.empty())
+    {
+        auto closed = std::move(closed_digests);
+        auto failures = std::move(failed_jobs);
+        closed_digests.clear();
+        failed_jobs.clear();
+        lock.unlock();
+
+        for (auto &[job, error] : failures)
+            report(job, false, "", error);
+
+        std::vector<ClosedDigest> recorded;
+        for (auto &digest : closed)
+        {
+            if (not digest_handler or digest_handler(digest.id, digest.digest.ids))
+            {
+                recorded.push_back(std::move(digest));
+                continue;
+            }
+            PublishJob job;
+            job.id = digest.id;
+            job.members = digest.digest.ids;
+            report(job, false, "", "unable to record digest");
+            std::lock_guard<std::mutex> statsLock(statsMutex);
+            failed++;
+        }
+
+        lock.lock();
+        for (auto &digest : recorded)
+            post_digest(digest.id, digest.digest.ids, digest.digest.texts, digest.channel);
+    }
+}
+
+void PublisherClient::submit(const string &id, const string &text, const string &channel)
+{
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        if (digest_mode == DigestMode::off)
+        {
+            PublishJob job;
+            job.id = id;
+            job.text = text;
+            job.members = {id};
+            enqueue(job);
+        }
+        else
+        {
+            Digest &digest = digests[channel];
+            if (digest.texts.empty())
+                digest.opened = steady_clock::now();
+            digest.ids.push_back(id);
+            digest.texts.push_back(text);
+            digest.chars += char_count(text) + 1;
+
+            // A batch that fills a post goes out without waiting
+            if (digest_mode == DigestMode::batch and digest.chars >= max_chars)
+                flush_digest(channel);
+        }
+        run_deferred(lock);
+    }
+    queueReady.notify_one();
+}
+
+void PublisherClient::submit_digest(const string &digest, const std::vector<string> &ids,
+                                    const std::vector<string> &texts, const string &channel)
+{
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        post_digest(digest, ids, texts, channel);
+        run_deferred(lock);
+    }
+    queueReady.notify_one();
+}
+
+void PublisherClient::enqueue(PublishJob job)
+{
+    if (queue.size() >= std::max<size_t>(max_queue, 1))
+    {
+        std::cerr << "\nPublish queue full, dropping " << queue.front().id;
+        PublishJob oldest = queue.front();
+        queue.pop_front();
+        drop_digest(oldest);
+        failed_jobs.push_back({oldest, "dropped from full queue"});
+        std::lock_guard<std::mutex> statsLock(statsMutex);
+        dropped++;
+    }
+    queue.push_back(job);
+    std::lock_guard<std::mutex> statsLock(statsMutex);
+    enqueued++;
+}
+
+void PublisherClient::flush_digest(const string &channel)
+{
+    Digest digest = std::move(digests[channel]);
+    digests.erase(channel);
+
+    // e.g. "seg:04-12-2023-10:01:02+3", a digest that starts with that
+    // segment and holds three more
+    string id = digest.ids.front();
+    if (digest.ids.size() > 1)
+        id += "+" + std::to_string(digest.ids.size() - 1);
+    closed_digests.push_back({id, std::move(digest), channel});
+}
+
+void PublisherClient::post_digest(const string &digest, const std::vector<string> &ids,
+                                  const std::vector<string> &texts, const string &channel)
+{
+    string header = channel.empty() ? "" : channel + ": ";
+    auto posts = pack_posts(header, texts, max_chars);
+
+    for (size_t part = 0; part < posts.size(); part++)
+    {
+        PublishJob job;
+        // e.g. "seg:04-12-2023-10:01:02+3#2" for the digest's second post
+        job.id = digest;
+        if (posts.size() > 1)
+            job.id += "#" + std::to_string(part + 1);
+        job.text = posts[part];
+        job.members = ids;
+        job.digest = digest;
+        job.part = part;
+        job.parts = posts.size();
+        if (digest_mode == DigestMode::thread and posts.size() > 1)
+            job.thread = digest;
+        enqueue(job);
+    }
+
+    std::lock_guard<std::mutex> statsLock(statsMutex);
+    digested_transcripts += texts.size();
+    digest_posts += posts.size();
+}
+
+void PublisherClient::drop_digest(const PublishJob &job)
+{
+    thread_tails.erase(job.thread);
+    if (job.digest.empty())
+        return;
+    queue.erase(std::remove_if(queue.begin(), queue.end(),
+                               [&](const PublishJob &queued) { return queued.digest == job.digest; }),
+                queue.end());
+}
+
+steady_clock::time_point PublisherClient::flush_due_digests()
+{
+    auto now = steady_clock::now();
+    auto next_due = steady_clock::time_point::max();
+    std::vector<string> due;
+    for (auto &[channel, digest] : digests)
+    {
+        if (now - digest.opened >= digest_window)
+            due.push_back(channel);
+        else
+            next_due = std::min(next_due, digest.opened + digest_window);
+    }
+    for (auto &channel : due)
+        flush_digest(channel);
+    return next_due;
+}
+
+bool PublisherClient::connect_service()
+{
+    if (sock != -1)
+        return true;
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    // The service takes a few seconds to import its libraries
+    for (int attempt = 0; attempt < 100 and not do_stop; attempt++)
+    {
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock == -1)
+        {
+            perror("publish service socket");
+            return false;
+        }
+        // Don't let a hung service hold the worker, and stop() with it
+        timeval timeout{std::max(timeout_seconds, 1), 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == 0)
+            return true;
+
+        close(sock);
+        sock = -1;
+        std::this_thread::sleep_for(100ms);
+    }
+
+    std::cerr << "\nCan't connect to publish service at " << socket_path;
+    return false;
+}
+
+void PublisherClient::disconnect()
+{
+    if (sock != -1)
+        close(sock);
+    sock = -1;
+    received.clear();
+}
+
+// Why a send or recv on the service socket failed
+static string socket_error(ssize_t n)
+{
+    if (n == 0)
+        return "publish service closed the connection";
+    if (errno == EAGAIN or errno == EWOULDBLOCK)
+        return "publish service timed out";
+    return string("lost connection to publish service: ") + strerror(errno);
+}
+
+bool PublisherClient::publish(const PublishJob &job, string &reply, string &error)
+{
+    string request = "{\"id\": " + json_string(job.id) +
+                     ", \"text\": " + json_string(job.text);
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (job.part > 0 and thread_tails.count(job.thread) > 0)
+            request += ", \"reply_to\": " + json_string(thread_tails[job.thread]);
+    }
+    request += "}\n";
+    for (size_t sent = 0; sent < request.size();)
+    {
+        ssize_t n = send(sock, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            error = socket_error(n);
+            return false;
+        }
+        sent += n;
+    }
+
+    size_t newline;
+    while ((newline = received.find('\n')) == string::npos)
+    {
+        char buf[4096];
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+        if (n <= 0)
+        {
+            error = socket_error(n);
+            return false;
+        }
+        received.append(buf, n);
+    }
+    reply = received.substr(0, newline);
+    received.erase(0, newline + 1);
+    return true;
+}
+
+bool PublisherClient::next_job(PublishJob &job)
+{
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while (not do_stop)
+    {
+        auto next_due = flush_due_digests();
+        run_deferred(lock);
+        if (queue.empty())
+        {
+            if (next_due == steady_clock::time_point::max())
+                queueReady.wait(lock);
+            else
+                queueReady.wait_until(lock, next_due);
+            continue;
+        }
+
+        auto wait = bucket.wait_time();
+        if (wait == steady_clock::duration::zero())
+        {
+            bucket.take();
+            job = queue.front();
+            queue.pop_front();
+            return true;
+        }
+
+        if (not queue.front().delayed)
+        {
+            queue.front().delayed = true;
+            std::lock_guard<std::mutex> statsLock(statsMutex);
+            delayed++;
+        }
+        // Woken early by stop() or new jobs; either way check again
+        queueReady.wait_until(lock, std::min(next_due, steady_clock::now() + wait));
+    }
+    return false;
+}
+
+void PublisherClient::run_worker()
+{
+    PublishJob job;
+    while (next_job(job))
+    {
+        if (not connect_service())
+        {
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                drop_digest(job);
+            }
+            report(job, false, "", "publish service unavailable");
+            std::lock_guard<std::mutex> lock(statsMutex);
+            failed++;
+            continue;
+        }
+
+        auto start = steady_clock::now();
+        string reply, error;
+        if (not publish(job, reply, error))
+        {
+            // A late reply would be taken for the next job's, so start over
+            // on a fresh connection
+            std::cerr << "\nPublishing " << job.id << " failed: " << error;
+            disconnect();
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                drop_digest(job);
+            }
+            report(job, false, "", error);
+            std::lock_guard<std::mutex> lock(statsMutex);
+            failed++;
+            continue;
+        }
+        long millis = duration_cast<milliseconds>(steady_clock::now() - start).count();
+
+        string remaining = json_field(reply, "rate_limit_remaining");
+        string reset = json_field(reply, "rate_limit_reset");
+        bool was_rate_limited = json_field(reply, "rate_limited") == "true";
+        if (was_rate_limited or not remaining.empty())
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            long reset_time = reset.empty() ? time(nullptr) + 60 : atol(reset.c_str());
+            bucket.observe(was_rate_limited ? 0 : atol(remaining.c_str()), reset_time);
+            // Try again once the window resets
+            if (was_rate_limited)
+                queue.push_front(job);
+        }
+
+        if (was_rate_limited)
+        {
+            std::lock_guard<std::mutex> lock(statsMutex);
+            rate_limited++;
+            std::cerr << "\nRate limited, holding posts until " << reset;
+            continue;
+        }
+
+        string post_id = json_field(reply, "post_id");
+        if (json_field(reply, "ok") == "true")
+        {
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                if (job.part + 1 == job.parts)
+                    thread_tails.erase(job.thread);
+                else
+                    thread_tails[job.thread] = post_id;
+            }
+            if (job.part + 1 == job.parts)
+                report(job, true, post_id, "");
+
+            std::lock_guard<std::mutex> lock(statsMutex);
+            published++;
+            latencies.add(millis, config_get_int("PUBLISH_LATENCY_TARGET_MS", 2000));
+            service_millis_total += strtod(json_field(reply, "latency_ms", "0").c_str(), nullptr);
+            std::cout << "\nPosted " << job.id << " as " << post_id << " in " << millis << " ms";
+        }
+        else
+        {
+            error = json_field(reply, "error");
+            std::cerr << "\nPublishing " << job.id << " failed: " << error;
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                drop_digest(job);
+            }
+            report(job, false, "", error);
+            std::lock_guard<std::mutex> lock(statsMutex);
+            failed++;
+        }
+    }
+}
+
+void PublisherClient::print_stats(std::ostream &out)
+{
+    // Same lock order as submit()
+    std::lock_guard<std::mutex> queueLock(queueMutex);
+    size_t queued = queue.size();
+    std::lock_guard<std::mutex> lock(statsMutex);
+
+    out << "\nPublisher: " << published << " posted, " << failed << " failed, "
+        << queued << " queued of " << enqueued << " submitted, " << delayed
+        << " delayed by rate limit, " << dropped << " dropped, " << rate_limited
+        << " refused with 429";
+    if (published > 0)
+        out << ", mean service time " << service_millis_total / published << " ms";
+    if (digest_posts > 0)
+        out << "\n  digests: " << digested_transcripts << " transcripts in "
+            << digest_posts << " posts, " << digests.size() << " open";
+    latencies.print(out);
+}
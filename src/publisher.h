@@ -0,0 +1,199 @@
+#pragma once
+
+#include "scheduler.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// A post waiting to go out
+struct PublishJob
+{
+    // Also the idempotency key the publish service dedupes on
+    std::string id;
+    std::string text;
+    // IDs of the transcripts this post carries; more than one for digests
+    std::vector<std::string> members;
+    // ID of the digest this post is part of; empty outside digest modes
+    std::string digest;
+    // Already counted as delayed by the rate limiter
+    bool delayed = false;
+    // Posts of one digest thread share a thread ID; every part after the
+    // first replies to the one before it.
+    std::string thread;
+    size_t part = 0;
+    size_t parts = 1;
+};
+
+// Transcripts from one channel collected for a single digest
+struct Digest
+{
+    std::chrono::steady_clock::time_point opened;
+    std::vector<std::string> ids;
+    std::vector<std::string> texts;
+    size_t chars = 0;
+};
+
+enum class DigestMode
+{
+    off,
+    batch,
+    thread
+};
+
+// Packs texts, each prefixed with header, into as few posts of at most
+// max_chars characters as possible. Texts too long for one post are split
+// between words.
+std::vector<std::string> pack_posts(const std::string &header,
+                                    const std::vector<std::string> &texts,
+                                    size_t max_chars);
+
+/*
+ * Paces posts to the platform's rate limit. Tokens refill continuously at
+ * limit/window and cap at burst. The API's own view, from x-rate-limit-*
+ * headers or a 429, overrides ours when it is stricter.
+ */
+class TokenBucket
+{
+public:
+    void configure(double limit, double window_seconds, double burst);
+    // Time until a token is available; zero if one is available now
+    std::chrono::steady_clock::duration wait_time();
+    void take();
+    // Tells the bucket how many posts the API says are left before reset,
+    // given as Unix time
+    void observe(long remaining, long reset);
+
+private:
+    void refill(std::chrono::steady_clock::time_point now);
+
+    double tokens = 0;
+    double capacity = 1;
+    double per_second = 1;
+    std::chrono::steady_clock::time_point last_refill;
+    std::chrono::steady_clock::time_point blocked_until;
+};
+
+/*
+ * Client for the long-lived publish service (publisher.py --serve).
+ *
+ * The bus spawns the service once and keeps a Unix socket open to it, so
+ * tweepy, the keys and the HTTPS connection are loaded once instead of per
+ * transcript. Jobs are queued and sent from a worker thread at the pace
+ * the token bucket allows; submit() never waits, and drops the oldest job
+ * once PUBLISH_QUEUE_MAX are waiting.
+ */
+class PublisherClient
+{
+public:
+    // Told how each post ended: ok with the new post's ID, or not with an
+    // error. Called once per post; a multi-part digest reports its members
+    // once, when the last part is out or when the first part fails, and
+    // posts none of its parts after a failed one.
+    using ResultHandler = std::function<void(const PublishJob &job, bool ok,
+                                             const std::string &post_id,
+                                             const std::string &error)>;
+    // Records a digest's ID and its members, in order, before any of it is
+    // posted, so a retry can post the same digest again under the same ID
+    // instead of composing a new one. A digest it returns false for isn't
+    // posted, and its members are reported failed.
+    using DigestHandler = std::function<bool(const std::string &digest,
+                                             const std::vector<std::string> &members)>;
+
+    void configure();
+    void set_result_handler(ResultHandler handler);
+    void set_digest_handler(DigestHandler handler);
+    // Spawns the service and the worker thread
+    void start();
+    void stop();
+    // With a digest mode set, transcripts from the same channel are held
+    // for PUBLISH_DIGEST_WINDOW_SECONDS and posted together.
+    void submit(const std::string &id, const std::string &text,
+                const std::string &channel = "");
+    // Posts a digest recorded on an earlier attempt again, as it was, and
+    // without waiting for the window. ids and texts are in recorded order.
+    void submit_digest(const std::string &digest, const std::vector<std::string> &ids,
+                       const std::vector<std::string> &texts, const std::string &channel);
+    void print_stats(std::ostream &out);
+
+private:
+    void run_worker();
+    bool connect_service();
+    void disconnect();
+    // Sends one job and waits for its reply line. On failure, error says
+    // whether the service hung up or stopped answering.
+    bool publish(const PublishJob &job, std::string &reply, std::string &error);
+    // Blocks until the queue has a job and the bucket a token, or stop
+    bool next_job(PublishJob &job);
+    void report(const PublishJob &job, bool ok, const std::string &post_id,
+                const std::string &error);
+    // Makes the handler calls deferred while lock was held. It is released
+    // around the calls, since the handlers wait on the database writer.
+    void run_deferred(std::unique_lock<std::mutex> &lock);
+    // These expect queueMutex to be held
+    void enqueue(PublishJob job);
+    // Closes the channel's digest; it is recorded and posted by run_deferred()
+    void flush_digest(const std::string &channel);
+    void post_digest(const std::string &digest, const std::vector<std::string> &ids,
+                     const std::vector<std::string> &texts, const std::string &channel);
+    // Takes the parts of job's digest still queued off the queue
+    void drop_digest(const PublishJob &job);
+    // Flushes due digests; returns when the next one falls due
+    std::chrono::steady_clock::time_point flush_due_digests();
+
+    std::string script;
+    std::string socket_path;
+    int timeout_seconds = 45;
+    ResultHandler result_handler;
+    DigestHandler digest_handler;
+    pid_t service_pid = -1;
+    int sock = -1;
+    // Bytes received after the last complete reply line
+    std::string received;
+
+    std::deque<PublishJob> queue;
+    size_t max_queue = 1000;
+    TokenBucket bucket;
+    DigestMode digest_mode = DigestMode::off;
+    std::chrono::seconds digest_window{60};
+    size_t max_chars = 280;
+    std::unordered_map<std::string, Digest> digests;
+    // A digest closed under queueMutex, waiting for digest_handler
+    struct ClosedDigest
+    {
+        std::string id;
+        Digest digest;
+        std::string channel;
+    };
+    // Handler calls waiting for run_deferred(); under queueMutex
+    std::vector<ClosedDigest> closed_digests;
+    std::vector<std::pair<PublishJob, std::string>> failed_jobs;
+    // Last post ID of each digest thread still being posted; under
+    // queueMutex, since a full queue drops digests from submit()
+    std::unordered_map<std::string, std::string> thread_tails;
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    std::thread worker;
+    std::atomic<bool> do_stop = false;
+
+    // Round trip per post as seen by the bus, and the service's own timing
+    LatencyHistogram latencies;
+    double service_millis_total = 0;
+    unsigned long published = 0;
+    unsigned long failed = 0;
+    unsigned long enqueued = 0;
+    unsigned long delayed = 0;
+    unsigned long dropped = 0;
+    unsigned long rate_limited = 0;
+    unsigned long digested_transcripts = 0;
+    unsigned long digest_posts = 0;
+    std::mutex statsMutex;
+};
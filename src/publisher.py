@@ -2,22 +2,32 @@
 #
 # Posts specified files/information onto twitter account @sdscannerbot
 #
+# Run with --serve to keep one publisher (and its HTTPS connection) alive
+# between posts; see publish_service.py.
 from os import environ
 from subprocess import call
 import sys
-from dotenv import load_dotenv
+import time
+from dotenv import dotenv_values, load_dotenv
 import tweepy
 import requests
+from requests_oauthlib import OAuth1
+from publish_service import RateLimited, rate_limit_fields, serve
 
 
 load_dotenv("/home/corey/scannerbot/secret/testscannerbotkeys.env")
-client = tweepy.Client(wait_on_rate_limit=True,
-                       bearer_token=environ["BEARER_TOKEN"],
-                       consumer_key=environ["API_KEY"],
-                       consumer_secret=environ["API_SECRET"],
-                       access_token=environ["ACCESS_TOKEN"],
-                       access_token_secret=environ["ACCESS_TOKEN_SECRET"],
-                       return_type=requests.Response)
+config = dotenv_values("/home/corey/scannerbot/config/scannerbot.env")
+
+
+def make_client():
+    # Pacing is left to the bus, see PUBLISH_RATE_LIMIT
+    return tweepy.Client(wait_on_rate_limit=False,
+                         bearer_token=environ["BEARER_TOKEN"],
+                         consumer_key=environ["API_KEY"],
+                         consumer_secret=environ["API_SECRET"],
+                         access_token=environ["ACCESS_TOKEN"],
+                         access_token_secret=environ["ACCESS_TOKEN_SECRET"],
+                         return_type=requests.Response)
 
 def read_file(filename):
     with open(filename, 'r') as f:
@@ -26,20 +36,56 @@ def read_file(filename):
 
 
 def tweet(message: str):
-        response = client.create_tweet(text=message)
+        response = make_client().create_tweet(text=message)
         print(response.headers)
-        
+
+
+class Session:
+    """
+    One long-lived HTTP session for the publish service. Connections are
+    pooled by requests, so after the first post each one reuses the open
+    TLS connection instead of doing a new handshake.
+    """
+    def __init__(self):
+        self.url = config.get("PUBLISH_API_BASE_URL", "https://api.twitter.com") + "/2/tweets"
+        self.session = requests.Session()
+        self.session.auth = OAuth1(environ.get("API_KEY", ""),
+                                   environ.get("API_SECRET", ""),
+                                   environ.get("ACCESS_TOKEN", ""),
+                                   environ.get("ACCESS_TOKEN_SECRET", ""))
+
+    def post(self, text, reply_to=None):
+        payload = {"text": text}
+        if reply_to:
+            payload["reply"] = {"in_reply_to_tweet_id": reply_to}
+        response = self.session.post(self.url, json=payload, timeout=30)
+        fields = rate_limit_fields(response.headers)
+        if response.status_code == 429:
+            raise RateLimited(fields.get("rate_limit_reset", int(time.time()) + 60))
+        response.raise_for_status()
+        fields["post_id"] = response.json()["data"]["id"]
+        return fields
+
 
 def main():
     try:
         if (len(sys.argv) < 2):
             print("No file name given.")
             exit()
-        
+
+        if sys.argv[1] == "--serve":
+            socket_path = config.get("PUBLISHER_SOCKET", "/tmp/scannerbot_publisher.sock")
+            if len(sys.argv) > 2:
+                socket_path = sys.argv[2]
+            session = Session()
+            serve(socket_path, lambda text, reply_to, job_id: session.post(text, reply_to),
+                  config.get("PUBLISH_JOURNAL"))
+            return
+
         message = read_file(sys.argv[1])
         tweet(message)
     except KeyboardInterrupt:
         exit()
 
 if __name__ == "__main__":
-    main()
\ No newline at end of file
+    main()
@@ -1,32 +1,34 @@
-#include <atomic>
+#include "message.h"
+#include "status_block.h"
+#include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <cstring>
 #include <fcntl.h>
 #include <iostream>
 #include <mqueue.h>
-#include <mutex>
 #include <signal.h>
 #include <spawn.h>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
-#include <thread>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
+using std::cerr;
 using std::cout;
-using std::mutex;
 using std::string;
-using std::thread;
 using std::unordered_map;
 using std::vector;
 
 // Signals that the user has requested to quit the program
-std::atomic<bool> do_shutdown = false;
-
-// A map relating function names to the threads running them
-unordered_map<string, thread *> threadMap;
-// Use this mutex to lock the threadMap
-mutex threadMapMutex;
+bool do_shutdown = false;
 
 // The name of the recorder posix message queue
 const char *REC_MQ_NAME = "/sb_rec_inbox";
@@ -39,23 +41,57 @@ unordered_map<string, string> radioOptions;
 
 // The process ID of the running recorder shell, if any. Set to -1 if not
 pid_t rec_shell_pid = -1;
+// The bus, which started the recorder
+pid_t bus_pid = -1;
+
+// Live telemetry for the bus and monitoring tools
+StatusBlock status_block;
+
+// The recorder is one thread waiting in epoll on all of these; -1 for
+// any not open
+int epoll_fd = -1;
+// SIGINT, SIGTERM and SIGCHLD
+int signal_fd = -1;
+// Becomes readable when the recorder shell exits
+int shell_fd = -1;
+// The raw audio recorder.sh tees to its fd 3
+int pcm_fd = -1;
+// Audio files being closed
+int notify_fd = -1;
+// Housekeeping every HOUSEKEEPING_SECONDS
+int timer_fd = -1;
+
+// recorder.sh's defaults, for the settings the bus leaves out
+const uint64_t DEFAULT_FREQ_HZ = 160710000;
+const uint32_t DEFAULT_AUDIO_RATE = 4000;
+// Where sox writes the audio files
+const char *AUDIO_DIR = "/home/corey/scannerbot/audio";
+const int HOUSEKEEPING_SECONDS = 5;
+
+// Raw 16-bit mono PCM; a read can end partway through a sample
+char pcm[8192];
+size_t pcm_held = 0;
+// Whether the noise floor has a first level to start from
+bool measured = false;
+// A read that finds the pipe full means rtl_fm was kept waiting
+int pcm_pipe_size = 0;
+// Statuses the bus inbox had no room for
+unsigned long statuses_dropped = 0;
 
 void mq_init();
-void mq_watcher();
+void events_init();
 void cleanup();
+void watch(int fd);
+void close_watched(int &fd);
 void kill_rec_shell();
-void interruptHandler(int signum);
-
-void interruptHandler(int signum)
-{
-    cout << '\n'
-         << getpid() << " received interrupt signal (" << signum << ").\n";
-    do_shutdown = true;
-
-    cleanup();
-
-    exit(signum);
-}
+void start_rec_shell();
+void shell_exited();
+void send_status(RecorderState state);
+void read_messages();
+void read_signals();
+void read_audio();
+void read_segments();
+void housekeeping();
 
 void cleanup()
 {
@@ -65,10 +101,31 @@ void cleanup()
     for (auto &[queue_name, mqd] : mqdMap)
         mq_close(mqd);
 
-    // Clean up threads
-    for (auto &[function, thread] : threadMap)
-        if (thread->joinable())
-            thread->join();
+    close_watched(notify_fd);
+    close_watched(timer_fd);
+    close_watched(signal_fd);
+    if (epoll_fd != -1)
+        close(epoll_fd);
+    epoll_fd = -1;
+    status_block.close();
+}
+
+void watch(int fd)
+{
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+        perror("epoll_ctl");
+}
+
+void close_watched(int &fd)
+{
+    if (fd == -1)
+        return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    fd = -1;
 }
 
 void kill_rec_shell()
@@ -76,33 +133,51 @@ void kill_rec_shell()
     if (rec_shell_pid == -1)
         return;
 
-    // Kill entire recorder process group
-    if (kill(rec_shell_pid, SIGTERM) == -1)
+    // Kill entire recorder process group. ESRCH means the whole group has
+    // already exited, and the shell still has to be reaped.
+    bool exited = kill(-rec_shell_pid, SIGTERM) == -1;
+    if (exited and errno != ESRCH)
     {
         perror("Unable to kill recorder shell script");
         return;
     }
+    waitpid(rec_shell_pid, nullptr, 0);
 
-    cout << "\nRecorder shell script [PID " << rec_shell_pid << "] killed.";
+    cout << "\nRecorder shell script [PID " << rec_shell_pid << "] "
+         << (exited ? "had already exited." : "killed.");
 
+    shell_exited();
+}
+
+void shell_exited()
+{
+    if (rec_shell_pid == -1)
+        return;
     rec_shell_pid = -1;
-    
-    string message = "rec shell killed";
-    mq_send(mqdMap[BUS_MQ_NAME], message.c_str(), message.length()+1, 0);
+    close_watched(shell_fd);
+    close_watched(pcm_fd);
+    pcm_held = 0;
+    measured = false;
+
+    send_status(RecorderState::shell_stopped);
 }
 
 void mq_init()
 {
-    // Connect to the bus inbox for sending messages to the bus
-    mqdMap[BUS_MQ_NAME] = mq_open(BUS_MQ_NAME, O_WRONLY);
+    // Connect to the bus inbox for sending messages to the bus. The bus
+    // reads it every few seconds; should it fall behind, statuses are
+    // dropped rather than waited on.
+    mqdMap[BUS_MQ_NAME] = mq_open(BUS_MQ_NAME, O_WRONLY | O_NONBLOCK);
     if (mqdMap[BUS_MQ_NAME] == -1)
     {
         perror("bus inbox mq_open");
         exit(EXIT_FAILURE);
     }
 
-    // Connect to the recorder inbox for reading messages from the bus
-    mqdMap[REC_MQ_NAME] = mq_open(REC_MQ_NAME, O_RDONLY);
+    // Connect to the recorder inbox for reading messages from the bus.
+    // Message queues are file descriptors on Linux, so epoll says when
+    // there is something to read.
+    mqdMap[REC_MQ_NAME] = mq_open(REC_MQ_NAME, O_RDONLY | O_NONBLOCK);
     if (mqdMap[REC_MQ_NAME] == -1)
     {
         perror("recorder inbox mq_open");
@@ -110,74 +185,237 @@ void mq_init()
     }
 }
 
-void mq_watcher()
+void events_init()
 {
-    while (not do_shutdown)
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
     {
-        // Get next command from the command line interface
-        char message[256] = {""};
-        // mq_receive blocks until there's something in the queue
-        mq_receive(mqdMap[REC_MQ_NAME], message, sizeof(message), nullptr);
-        if (message[0] == '\0')
-            continue; // Empty message.
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    watch(mqdMap[REC_MQ_NAME]);
+
+    // Signals arrive as reads instead of interrupting whatever is running.
+    // They are blocked before anything else starts, and unblocked again in
+    // the recorder shell.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+    signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signal_fd == -1)
+    {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+    watch(signal_fd);
+
+    // Counts the files sox closes, as it starts the next
+    notify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (notify_fd != -1 and inotify_add_watch(notify_fd, AUDIO_DIR, IN_CLOSE_WRITE) != -1)
+        watch(notify_fd);
+    else
+        perror("audio directory inotify");
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    itimerspec every = {{HOUSEKEEPING_SECONDS, 0}, {HOUSEKEEPING_SECONDS, 0}};
+    if (timer_fd != -1 and timerfd_settime(timer_fd, 0, &every, nullptr) != -1)
+        watch(timer_fd);
+    else
+        perror("housekeeping timerfd");
+}
 
-        // Parse message into command and radio options map
-        char *command, *option, *arg;
-        command = strtok(message, " ");
+// rtl_fm's option letter and value for each setting the bus has sent
+static void set_option(const string &option, long long value, bool set)
+{
+    if (set)
+        radioOptions[option] = std::to_string(value);
+}
+
+static void set_gain(int32_t gain_tenths_db)
+{
+    if (gain_tenths_db == MESSAGE_UNSET)
+        return;
+    char gain[16];
+    snprintf(gain, sizeof(gain), "%.1f", gain_tenths_db / 10.0);
+    radioOptions["g"] = gain;
+}
+
+void send_status(RecorderState state)
+{
+    StatusMessage status;
+    status.state = state;
+    status.shell_pid = rec_shell_pid;
+    if (radioOptions.count("f"))
+        status.freq_hz = std::stoull(radioOptions["f"]);
+    if (radioOptions.count("g"))
+        status.gain_tenths_db = std::lround(std::stod(radioOptions["g"]) * 10);
+    if (radioOptions.count("l"))
+        status.squelch = std::stoi(radioOptions["l"]);
+    if (not send_message(mqdMap[BUS_MQ_NAME], status))
+    {
+        if (errno == EAGAIN)
+            cerr << "\nBus inbox full, " << ++statuses_dropped << " statuses dropped";
+        else
+            perror("Unable to send status to bus");
+    }
 
-        if (strcmp(command, "start") == 0)
+    status_block.update([&](RecorderStatus &block)
+                        {
+                            block.freq_hz = status.freq_hz ? status.freq_hz : DEFAULT_FREQ_HZ;
+                            block.gain_tenths_db = status.gain_tenths_db;
+                            block.squelch = status.squelch;
+                            block.shell_pid = status.shell_pid;
+                            block.sample_rate = radioOptions.count("r") ? std::stoul(radioOptions["r"])
+                                                                        : DEFAULT_AUDIO_RATE;
+                        });
+}
+
+void read_audio()
+{
+    int queued = 0;
+    ioctl(pcm_fd, FIONREAD, &queued);
+    ssize_t n = read(pcm_fd, pcm + pcm_held, sizeof(pcm) - pcm_held);
+    if (n == -1 and errno == EAGAIN)
+        return;
+    if (n <= 0)
+    {
+        // Everything in the shell's pipeline has exited; the shell itself
+        // is noticed through shell_fd
+        close_watched(pcm_fd);
+        return;
+    }
+    size_t count = (pcm_held + n) / 2;
+    double sum = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        int16_t sample;
+        memcpy(&sample, pcm + 2 * i, sizeof(sample));
+        sum += (double)sample * sample;
+    }
+    pcm_held = (pcm_held + n) % 2;
+    memmove(pcm, pcm + 2 * count, pcm_held);
+    if (count == 0)
+        return;
+
+    float level = 10 * log10(sum / count / (32768.0 * 32768.0) + 1e-12);
+    long long now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::system_clock::now().time_since_epoch()).count();
+    status_block.update([&](RecorderStatus &status)
+                        {
+                            // The floor follows quiet stretches down at once
+                            // and creeps back up at 0.05 dB a read
+                            status.noise_floor_dbfs = measured ? std::min(level, status.noise_floor_dbfs + 0.05f)
+                                                               : level;
+                            status.signal_dbfs = level;
+                            status.samples += count;
+                            status.overruns += pcm_pipe_size > 0 and queued >= pcm_pipe_size;
+                            status.updated_us = now_us;
+                        });
+    measured = true;
+}
+
+void read_segments()
+{
+    alignas(inotify_event) char events[4096];
+    ssize_t n = read(notify_fd, events, sizeof(events));
+    uint64_t closed = 0;
+    for (ssize_t at = 0; at < n;)
+    {
+        auto *event = (inotify_event *)(events + at);
+        size_t length = strlen(event->name);
+        closed += length > 4 and strcmp(event->name + length - 4, ".mp3") == 0;
+        at += sizeof(inotify_event) + event->len;
+    }
+    if (closed)
+        status_block.update([&](RecorderStatus &status) { status.segments += closed; });
+}
+
+void read_signals()
+{
+    signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+        if (info.ssi_signo == SIGCHLD)
         {
-            string valid_options = "fgsrl";
-            while ((option = strtok(nullptr, " ")) != nullptr)
-            {
-                arg = strtok(nullptr, " ");
-                if (valid_options.find(option) != string::npos)
-                    radioOptions[option] = arg;
-            }
+            // Reap whatever has exited. Without a pidfd, this is also how
+            // the shell's exit is noticed.
+            pid_t pid;
+            while ((pid = waitpid(-1, nullptr, WNOHANG)) > 0)
+                if (pid == rec_shell_pid and shell_fd == -1)
+                    shell_exited();
+            continue;
         }
+        cout << '\n'
+             << getpid() << " received interrupt signal (" << info.ssi_signo << ").\n";
+        do_shutdown = true;
+    }
+}
+
+void housekeeping()
+{
+    uint64_t expirations;
+    [[maybe_unused]] ssize_t n = read(timer_fd, &expirations, sizeof(expirations));
+
+    // Nobody is left to send commands or take the audio
+    if (getppid() != bus_pid)
+    {
+        cout << "\nThe bus has exited; stopping the recorder.";
+        do_shutdown = true;
+    }
+}
 
-        else if (strcmp(command, "freq") == 0)
+void read_messages()
+{
+    char message[MESSAGE_MAX_SIZE];
+    ssize_t size;
+    while (not do_shutdown and
+           (size = mq_receive(mqdMap[REC_MQ_NAME], message, sizeof(message), nullptr)) >= 0)
+    {
+        StartMessage start;
+        RetuneMessage retune;
+        GainMessage gain;
+        SquelchMessage squelch;
+        QuitMessage quit;
+
+        if (decode_message(message, size, start))
         {
-            strcpy(option, "f");
-            if ((arg = strtok(nullptr, " ")) == nullptr)
-            {
-                cout << "\nMissing argument.";
-                continue;
-            }
-            radioOptions["f"] = arg;
-            cout << "\nGot message f " << arg;
+            radioOptions.clear();
+            set_option("f", start.freq_hz, start.freq_hz > 0);
+            set_gain(start.gain_tenths_db);
+            set_option("l", start.squelch, start.squelch != MESSAGE_UNSET);
+            set_option("s", start.sample_rate, start.sample_rate > 0);
+            set_option("r", start.resample_rate, start.resample_rate > 0);
         }
 
-        else if (strcmp(command, "gain") == 0)
+        else if (decode_message(message, size, retune) and retune.freq_hz > 0)
         {
-            strcpy(option, "g");
-            if ((arg = strtok(nullptr, " ")) == nullptr)
-            {
-                cout << "\nMissing argument.";
-                continue;
-            }
-            radioOptions["g"] = arg;
-            cout << "\nGot message g " << arg;
+            set_option("f", retune.freq_hz, true);
+            cout << "\nGot message f " << radioOptions["f"];
         }
 
-        else if (strcmp(command, "squelch") == 0)
+        else if (decode_message(message, size, gain) and gain.gain_tenths_db != MESSAGE_UNSET)
         {
-            strcpy(option, "l");
-            if ((arg = strtok(nullptr, " ")) == nullptr)
-            {
-                cout << "\nMissing argument.";
-                continue;
-            }
-            radioOptions["l"] = arg;
-            cout << "\nGot message l " << arg;
+            set_gain(gain.gain_tenths_db);
+            cout << "\nGot message g " << radioOptions["g"];
+        }
+
+        else if (decode_message(message, size, squelch) and squelch.squelch != MESSAGE_UNSET)
+        {
+            set_option("l", squelch.squelch, true);
+            cout << "\nGot message l " << radioOptions["l"];
         }
 
-        else if (strcmp(command, "quit") == 0)
+        else if (decode_message(message, size, quit))
         {
             cout << "\n\n*recorder got quit command\n\n";
             do_shutdown = true;
-            cleanup();
-            exit(EXIT_SUCCESS);
+            // The bus waits for this before it stops the recorder
+            kill_rec_shell();
+            send_status(RecorderState::quitting);
+            return;
         }
 
         else
@@ -186,51 +424,115 @@ void mq_watcher()
             continue;
         }
 
-        // Place options/args into char* array for passing to spawn
-        char **radio_args = new char *[radioOptions.size() + 1];
-        radio_args[0] = new char[0]; // arg 0 is skipped by getopts in the bash script
-        for (int i = 1; auto &[opt, arg] : radioOptions)
-        {
-            radio_args[i] = new char[16];
-            string opt_arg = '-' + opt + ' ' + arg;
-            strcpy(radio_args[i], opt_arg.c_str());
-            i++;
-        }
-
         // Terminate existing recorder shell
         kill_rec_shell();
-
-        // Start new rtl_fm process using supplied arguments, if any
-        int spawn_err = posix_spawn(&rec_shell_pid,
-                                    "/home/corey/scannerbot/src/recorder.sh",
-                                    nullptr, nullptr, radio_args, nullptr);
-        // Error
-        if (spawn_err != 0)
-        {
-            perror("\nError starting recorder\n");
-            exit(EXIT_FAILURE);
-        }
-
-        cout << "\n\n*Rec shell has PID " << rec_shell_pid << "*\n\n";
-
-        for (size_t i = 0; i < radioOptions.size() + 1; i++) {
-            delete radio_args[i];
-        }
-        delete[] radio_args;
+        start_rec_shell();
     }
 }
 
+void start_rec_shell()
+{
+    // Options and their arguments as separate words for getopts;
+    // arg 0 is the script's name
+    const char *script = "/home/corey/scannerbot/src/recorder.sh";
+    vector<string> words = {script};
+    for (auto &[opt, arg] : radioOptions)
+    {
+        words.push_back('-' + opt);
+        words.push_back(arg);
+    }
+    vector<char *> radio_args;
+    for (auto &word : words)
+        radio_args.push_back(word.data());
+    radio_args.push_back(nullptr);
+
+    // The shell runs in its own process group, so it can be killed with
+    // rtl_fm and sox, with the signals the recorder blocks back to normal,
+    // and tees the raw audio to fd 3 for read_audio
+    int pcm_pipe[2];
+    if (pipe2(pcm_pipe, O_CLOEXEC) == -1)
+    {
+        perror("\nError starting recorder\n");
+        exit(EXIT_FAILURE);
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pcm_pipe[1], 3);
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attributes, &signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attributes, &signals);
+
+    // Start new rtl_fm process using supplied arguments, if any
+    int spawn_err = posix_spawn(&rec_shell_pid, script, &actions, &attributes, radio_args.data(), nullptr);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    close(pcm_pipe[1]);
+    // Error
+    if (spawn_err != 0)
+    {
+        perror("\nError starting recorder\n");
+        exit(EXIT_FAILURE);
+    }
+
+    cout << "\n\n*Rec shell has PID " << rec_shell_pid << "*\n\n";
 
+    // Only this end is non-blocking; tee should wait when it is full
+    pcm_fd = pcm_pipe[0];
+    fcntl(pcm_fd, F_SETFL, O_NONBLOCK);
+    pcm_pipe_size = fcntl(pcm_fd, F_GETPIPE_SZ);
+    watch(pcm_fd);
+    // Kernels before 5.3 have no pidfd_open; SIGCHLD covers for it there
+    shell_fd = syscall(SYS_pidfd_open, rec_shell_pid, 0);
+    if (shell_fd != -1)
+        watch(shell_fd);
+
+    send_status(RecorderState::shell_started);
+}
 
 int main()
 {
-    signal(SIGINT, interruptHandler); // Handler for keyboard interrupt
+    bus_pid = getppid();
 
     mq_init();
-    threadMap["mq_watcher"] = new thread(mq_watcher);
+    events_init();
+    status_block.create();
 
+    // Sleeps in epoll_wait until there is something to do
+    epoll_event events[8];
     while (not do_shutdown)
-        ;
+    {
+        int ready = epoll_wait(epoll_fd, events, 8, -1);
+        for (int i = 0; i < ready and not do_shutdown; i++)
+        {
+            // An earlier event this round may have closed this one's fd, or
+            // even reopened the number for something else, so each read is
+            // non-blocking and finding nothing is fine
+            int fd = events[i].data.fd;
+            if (fd == mqdMap[REC_MQ_NAME])
+                read_messages();
+            else if (fd == signal_fd)
+                read_signals();
+            else if (fd == pcm_fd)
+                read_audio();
+            else if (fd == shell_fd and waitpid(rec_shell_pid, nullptr, WNOHANG) != 0)
+            {
+                cout << "\nRecorder shell script [PID " << rec_shell_pid << "] exited.";
+                shell_exited();
+            }
+            else if (fd == notify_fd)
+                read_segments();
+            else if (fd == timer_fd)
+                housekeeping();
+        }
+    }
 
     cleanup();
-}
\ No newline at end of file
+}
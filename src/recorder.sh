@@ -28,6 +28,9 @@ SQUELCH="25"     # -l
 # SoX parameters
 SILENCE_THRESHOLD="1%"
 
+# Shared settings, e.g. TRANSCRIBE_STREAM
+source /home/corey/scannerbot/config/scannerbot.env
+
 while getopts ":M:f:g:l:r:s:" opt; do
    case "$opt" in
    M)
@@ -72,8 +75,23 @@ QUIET_SOX="sox -S -r $BANDWIDTH -e signed -b 16 -c 1 -V1 -t raw - \
    /home/corey/scannerbot/audio/$(timestamp).mp3 \
    silence 1 00:00:00.5 1% 1 00:00:03 1% : newfile : restart"
 
+# Streaming transcriber, fed the same raw PCM as sox
+STREAM="python3 /home/corey/scannerbot/src/transcriber.py --stream $BANDWIDTH"
+
+# The recorder passes a pipe on fd 3 to measure the signal level; run by
+# hand, the raw audio goes nowhere
+if { true >&3; } 2>/dev/null; then
+   LEVEL_OUT=/dev/fd/3
+else
+   LEVEL_OUT=/dev/null
+fi
+
 echo $RTL_FM
 
 # Starting the stream of data from the radio.
-$RTL_FM | tee >($PLAY) >($REC) >/dev/null
+if [ "$TRANSCRIBE_STREAM" = "1" ]; then
+   $RTL_FM | tee >($PLAY) >($REC) >($STREAM >/dev/null) >$LEVEL_OUT
+else
+   $RTL_FM | tee >($PLAY) >($REC) >$LEVEL_OUT
+fi
 #$RTL_FM | $QUIET_SOX > /dev/null
@@ -0,0 +1,358 @@
+#include "retention.h"
+#include "config.h"
+#include "schema.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <spawn.h>
+#include <sstream>
+#include <sys/wait.h>
+
+extern char **environ;
+
+using std::string;
+using namespace std::chrono;
+
+const long long MICROS_PER_DAY = 86400LL * 1000000;
+
+void RetentionEngine::configure()
+{
+    policies.clear();
+    std::stringstream list(config_get("RETENTION_POLICIES", ""));
+    string item;
+    while (getline(list, item, ','))
+    {
+        // channel:opus:audio:row
+        std::stringstream fields(item);
+        string channel, opus, audio, row;
+        getline(fields, channel, ':');
+        getline(fields, opus, ':');
+        getline(fields, audio, ':');
+        getline(fields, row, ':');
+        RetentionPolicy policy{atof(opus.c_str()), atof(audio.c_str()), atof(row.c_str())};
+        if (channel == "default")
+            default_policy = policy;
+        else if (freq_hz(channel) > 0)
+            policies[freq_hz(channel)] = policy;
+    }
+
+    batch_rows = config_get_int("RETENTION_BATCH_ROWS", 50);
+    vacuum_pages = config_get_int("RETENTION_VACUUM_PAGES", 256);
+    pause = milliseconds(config_get_int("RETENTION_PAUSE_MILLIS", 200));
+    interval = seconds(config_get_int("RETENTION_INTERVAL_SECONDS", 600));
+    opus_dir = config_get("RETENTION_OPUS_DIR", "/home/corey/scannerbot/audio/opus/");
+    opus_bitrate = config_get("RETENTION_OPUS_BITRATE", "16k");
+    pack_after = minutes(config_get_int("RETENTION_PACK_AFTER_MINUTES", 60));
+}
+
+void RetentionEngine::start(DatabaseWriter *databaseWriter, ReaderPool *readerPool, SegmentStore *segmentStore)
+{
+    // Already running, or nothing to do
+    if (worker.joinable())
+        return;
+    auto any = [](const RetentionPolicy &policy)
+    { return policy.opus_days > 0 or policy.audio_days > 0 or policy.row_days > 0; };
+    bool enabled = any(default_policy) or (segmentStore and pack_after.count() > 0);
+    for (auto &[freq, policy] : policies)
+        enabled = enabled or any(policy);
+    if (not enabled)
+        return;
+
+    writer = databaseWriter;
+    readers = readerPool;
+    store = segmentStore;
+    do_stop = false;
+    worker = std::thread(&RetentionEngine::run_retention, this);
+}
+
+void RetentionEngine::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(retentionMutex);
+        do_stop = true;
+    }
+    retentionWake.notify_all();
+    if (worker.joinable())
+        worker.join();
+}
+
+void RetentionEngine::run_retention()
+{
+    std::unique_lock<std::mutex> lock(retentionMutex);
+    while (not do_stop)
+    {
+        lock.unlock();
+        bool busy = run_batch();
+        if (not busy)
+        {
+            cursors.clear();
+            drop_packs();
+        }
+        lock.lock();
+        // Keep going while there is a backlog, a batch at a time
+        retentionWake.wait_for(lock, busy ? milliseconds(pause) : milliseconds(interval),
+                               [this] { return do_stop; });
+    }
+}
+
+bool RetentionEngine::run_batch()
+{
+    bool busy = false;
+    auto run_policy = [&](long long freq, const RetentionPolicy &policy)
+    {
+        // Deletions first, so nothing is recompressed only to be deleted,
+        // and packing last, so what is packed is already Opus
+        for (Stage stage : {delete_rows, delete_audio, recompress, pack})
+        {
+            std::vector<Row> rows = due(stage, freq, policy);
+            if (rows.empty())
+                continue;
+            apply(stage, rows);
+            cursors[{freq, stage}] = {rows.back().start_us, rows.back().id};
+            busy = true;
+        }
+    };
+    run_policy(0, default_policy);
+    for (auto &[freq, policy] : policies)
+        run_policy(freq, policy);
+    if (busy)
+        vacuum();
+    return busy;
+}
+
+std::vector<RetentionEngine::Row> RetentionEngine::due(Stage stage, long long freq,
+                                                       const RetentionPolicy &policy)
+{
+    std::vector<Row> rows;
+    double days = stage == delete_rows ? policy.row_days
+                  : stage == delete_audio ? policy.audio_days
+                  : stage == recompress   ? policy.opus_days
+                  : store and pack_after.count() > 0
+                      ? std::max(pack_after.count() / 1440.0, policy.opus_days)
+                      : 0;
+    if (days <= 0)
+        return rows;
+    long long cutoff = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count() -
+                       (long long)(days * MICROS_PER_DAY);
+
+    // The default policy covers every channel without one of its own
+    string channel = "freq_hz = " + std::to_string(freq);
+    if (freq == 0)
+    {
+        channel = "(freq_hz IS NULL";
+        if (not policies.empty())
+        {
+            channel += " OR freq_hz NOT IN (";
+            for (auto &[hz, unused] : policies)
+                channel += std::to_string(hz) + ",";
+            channel.back() = ')';
+        }
+        channel += ")";
+    }
+    string sql = "SELECT id, start_us, coalesce(audioPath, '') FROM info WHERE " + channel +
+                 " AND start_us < ?1 AND (start_us, id) > (?3, ?4)";
+    if (stage == delete_audio)
+        sql += " AND audioPath IS NOT NULL";
+    if (stage == recompress)
+        sql += " AND audioPath IS NOT NULL AND audioPath NOT LIKE '%.opus' AND audioPath NOT LIKE 'segment:%'";
+    // A transcript could still be matched to the file by name until it
+    // comes in; after a day it isn't coming.
+    if (stage == pack)
+        sql += " AND audioPath IS NOT NULL AND audioPath NOT LIKE 'segment:%'"
+               " AND (transcript IS NOT NULL OR start_us < ?1 - 86400000000)";
+    sql += " ORDER BY start_us, id LIMIT ?2;";
+
+    ReaderPool::Lease db = readers->acquire();
+    Statement select = db->prepare(sql.c_str());
+    auto [start_us, id] = cursors[{freq, stage}];
+    select.bind_int64(1, cutoff)
+        .bind_int64(2, batch_rows)
+        .bind_int64(3, start_us)
+        .bind_int64(4, id);
+    while (select.step() == SQLITE_ROW)
+        rows.push_back({select.column_int64(0), select.column_int64(1), select.column_text(2)});
+    return rows;
+}
+
+void RetentionEngine::apply(Stage stage, const std::vector<Row> &rows)
+{
+    if (stage == recompress or stage == pack)
+    {
+        // The slow part, done before touching the database. Audio already
+        // gone from disk is recorded as gone.
+        std::vector<std::pair<Row, string>> done;
+        for (auto &row : rows)
+        {
+            if (not std::filesystem::exists(row.audio_path))
+            {
+                done.push_back({row, ""});
+                continue;
+            }
+            string moved = stage == recompress ? to_opus(row.audio_path) : to_store(row);
+            if (moved.empty())
+                failures++;
+            else
+                done.push_back({row, moved});
+        }
+        // The rows must never point at segments a crash could lose
+        if (stage == pack and not store->sync())
+            return;
+        auto stored = writer->submit(
+            [&done](Database &db)
+            {
+                Statement update = db.prepare("UPDATE info SET audioPath = nullif(?1, '') WHERE id = ?2;");
+                for (auto &[row, opus] : done)
+                {
+                    update.bind_text(1, opus).bind_int64(2, row.id);
+                    if (not update.run())
+                        return false;
+                    update.reset();
+                }
+                return true;
+            });
+        bool ok = stored.get();
+        for (auto &[row, moved] : done)
+        {
+            if (moved.empty())
+                continue;
+            // A segment stored for nothing is found again on the next try
+            if (stage == pack)
+            {
+                std::error_code err;
+                if (ok)
+                    std::filesystem::remove(row.audio_path, err);
+                packed += ok;
+                continue;
+            }
+            remove_audio(ok ? row.audio_path : moved);
+            recompressed += ok;
+        }
+        return;
+    }
+
+    // Forget the files first; a file left behind by a crash is only
+    // wasted space, but a row pointing at nothing would be wrong.
+    auto stored = writer->submit(
+        [stage, &rows](Database &db)
+        {
+            Statement change = db.prepare(stage == delete_rows
+                                              ? "DELETE FROM info WHERE id = ?1;"
+                                              : "UPDATE info SET audioPath = NULL WHERE id = ?1;");
+            Statement outbox = db.prepare("DELETE FROM outbox WHERE info_id = ?1 AND status != 'pending';");
+            for (auto &row : rows)
+            {
+                change.bind_int64(1, row.id);
+                if (not change.run())
+                    return false;
+                change.reset();
+                if (stage == delete_rows)
+                {
+                    outbox.bind_int64(1, row.id);
+                    outbox.run();
+                    outbox.reset();
+                }
+            }
+            return true;
+        });
+    if (not stored.get())
+    {
+        failures += rows.size();
+        return;
+    }
+    // Stored segments go with their pack, see drop_packs
+    SegmentId id;
+    for (auto &row : rows)
+        if (not row.audio_path.empty() and not SegmentId::parse(row.audio_path, id))
+            remove_audio(row.audio_path);
+    (stage == delete_rows ? rows_deleted : audio_deleted) += rows.size();
+}
+
+string RetentionEngine::to_opus(const string &audio_path)
+{
+    std::error_code err;
+    std::filesystem::create_directories(opus_dir, err);
+    string opus = (std::filesystem::path(opus_dir) /
+                   std::filesystem::path(audio_path).filename().replace_extension(".opus"))
+                      .string();
+
+    char *args[] = {(char *)"ffmpeg", (char *)"-nostdin", (char *)"-loglevel", (char *)"error",
+                    (char *)"-y", (char *)"-i", (char *)audio_path.c_str(),
+                    (char *)"-ac", (char *)"1", (char *)"-c:a", (char *)"libopus",
+                    (char *)"-b:a", (char *)opus_bitrate.c_str(), (char *)opus.c_str(), nullptr};
+    pid_t pid;
+    int spawn_err = posix_spawnp(&pid, "ffmpeg", nullptr, nullptr, args, environ);
+    if (spawn_err != 0)
+    {
+        std::cerr << "\nError starting ffmpeg: " << strerror(spawn_err);
+        return "";
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (not WIFEXITED(status) or WEXITSTATUS(status) != 0)
+    {
+        std::filesystem::remove(opus, err);
+        return "";
+    }
+    return opus;
+}
+
+string RetentionEngine::to_store(const Row &row)
+{
+    SegmentId id;
+    if (not store->put_file(row.audio_path, row.start_us / 1000000, id))
+        return "";
+    return id.ref();
+}
+
+void RetentionEngine::remove_audio(const string &audio_path)
+{
+    std::error_code err;
+    auto size = std::filesystem::file_size(audio_path, err);
+    if (std::filesystem::remove(audio_path, err) and size != (decltype(size))-1)
+        bytes_freed += size;
+}
+
+double pack_keep_days(const RetentionPolicy &default_policy,
+                      const std::unordered_map<long long, RetentionPolicy> &policies)
+{
+    // Packs mix every channel, so they last as long as the longest policy;
+    // any channel that keeps its audio forever, the default included,
+    // keeps every pack.
+    auto audio_days = [](const RetentionPolicy &policy)
+    { return policy.audio_days > 0 ? policy.audio_days : policy.row_days; };
+    double keep_days = audio_days(default_policy);
+    if (keep_days <= 0)
+        return 0;
+    for (auto &[freq, policy] : policies)
+    {
+        if (audio_days(policy) <= 0)
+            return 0;
+        keep_days = std::max(keep_days, audio_days(policy));
+    }
+    return keep_days;
+}
+
+void RetentionEngine::drop_packs()
+{
+    if (not store)
+        return;
+    double keep_days = pack_keep_days(default_policy, policies);
+    if (keep_days <= 0)
+        return;
+    store->drop_before(time(nullptr) - (time_t)(keep_days * 86400));
+}
+
+void RetentionEngine::vacuum()
+{
+    string sql = "PRAGMA incremental_vacuum(" + std::to_string(vacuum_pages) + ");";
+    auto vacuumed = writer->submit([sql](Database &db) { return db.exec(sql.c_str()); });
+    vacuumed.wait();
+}
+
+void RetentionEngine::print_stats(std::ostream &out)
+{
+    out << "\nRetention: " << recompressed << " recompressed, " << packed << " packed, " << audio_deleted
+        << " audio files deleted, " << rows_deleted << " rows deleted, "
+        << bytes_freed / (1024 * 1024) << " MiB of audio freed, " << failures << " failed";
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "database.h"
+#include "db_writer.h"
+#include "segment_store.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// How long a channel's recordings are kept, by age in days; 0 for never
+struct RetentionPolicy
+{
+    // Audio older than this is recompressed to low-bitrate Opus
+    double opus_days = 0;
+    // Audio older than this is deleted; the row and its transcript stay
+    double audio_days = 0;
+    // Rows older than this are deleted altogether
+    double row_days = 0;
+};
+
+// Days of audio the segment store's packs must keep for the longest of the
+// policies; 0 if any of them, or the default, keeps audio forever
+double pack_keep_days(const RetentionPolicy &default_policy,
+                      const std::unordered_map<long long, RetentionPolicy> &policies);
+
+/*
+ * Ages recordings out according to RETENTION_POLICIES, e.g.
+ * "default:7:30:0,160.71M:14:90:365", each channel with opus:audio:row
+ * ages. Audio files older than RETENTION_PACK_AFTER_MINUTES that have
+ * their transcript, and are past the Opus age if there is one, are moved
+ * into the segment store; a pack is deleted once every channel's audio
+ * from its hour is past keeping. A background thread works oldest first, at most
+ * RETENTION_BATCH_ROWS rows per write through the writer, and pauses
+ * between batches so it never holds up live ingest. Recompression runs
+ * outside any database lock.
+ *
+ * Freed pages are handed back to the file system RETENTION_VACUUM_PAGES at
+ * a time with incremental_vacuum. That needs auto_vacuum = INCREMENTAL,
+ * which new databases get. An older one can be converted once, offline,
+ * with "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;".
+ */
+class RetentionEngine
+{
+public:
+    void configure();
+    // store may be nullptr to leave audio files where they are
+    void start(DatabaseWriter *writer, ReaderPool *readers, SegmentStore *store);
+    void stop();
+    void print_stats(std::ostream &out);
+
+private:
+    struct Row
+    {
+        sqlite3_int64 id;
+        long long start_us;
+        std::string audio_path;
+    };
+
+    enum Stage
+    {
+        delete_rows,
+        delete_audio,
+        recompress,
+        pack
+    };
+
+    void run_retention();
+    // Handles one batch for every policy; false if there was nothing to do
+    bool run_batch();
+    // The oldest rows past the stage's age, after the stage's cursor
+    std::vector<Row> due(Stage stage, long long freq_hz, const RetentionPolicy &policy);
+    void apply(Stage stage, const std::vector<Row> &rows);
+    // Writes an Opus copy of audio_path; returns its path, or "" on failure
+    std::string to_opus(const std::string &audio_path);
+    // Moves audio_path into the store; returns its ref, or "" on failure
+    std::string to_store(const Row &row);
+    // Removes the file, counting what it freed
+    void remove_audio(const std::string &audio_path);
+    // Drops the packs older than any channel keeps its audio
+    void drop_packs();
+    void vacuum();
+
+    RetentionPolicy default_policy;
+    std::unordered_map<long long, RetentionPolicy> policies;
+    long batch_rows = 50;
+    long vacuum_pages = 256;
+    std::chrono::milliseconds pause{200};
+    std::chrono::seconds interval{600};
+    std::chrono::minutes pack_after{60};
+    std::string opus_dir;
+    std::string opus_bitrate;
+
+    DatabaseWriter *writer = nullptr;
+    ReaderPool *readers = nullptr;
+    SegmentStore *store = nullptr;
+    // The (start_us, id) each channel's stage got to this round, by
+    // (freq_hz, stage), so rows that failed are retried next round rather
+    // than blocking. The id breaks ties between rows with the same start.
+    std::map<std::pair<long long, int>, std::pair<long long, long long>> cursors;
+    std::thread worker;
+    std::mutex retentionMutex;
+    std::condition_variable retentionWake;
+    bool do_stop = false;
+
+    std::atomic<unsigned long> recompressed = 0;
+    std::atomic<unsigned long> packed = 0;
+    std::atomic<unsigned long> audio_deleted = 0;
+    std::atomic<unsigned long> rows_deleted = 0;
+    std::atomic<unsigned long long> bytes_freed = 0;
+    std::atomic<unsigned long> failures = 0;
+};
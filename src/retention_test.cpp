@@ -0,0 +1,33 @@
+// Checks of the retention rules that decide what is deleted, since a
+// mistake there loses recordings. Run with `make test`.
+
+#include "retention.h"
+#include <cstdio>
+
+static int failures = 0;
+
+static void check(const char *name, double got, double expected)
+{
+    bool ok = got == expected;
+    printf("%-55s %s (got %g, expected %g)\n", name, ok ? "ok" : "FAILED", got, expected);
+    failures += not ok;
+}
+
+int main()
+{
+    RetentionPolicy forever{};
+    RetentionPolicy month{7, 30, 0};
+    RetentionPolicy year{14, 90, 365};
+    RetentionPolicy rows_only{0, 0, 60};
+
+    check("nothing configured keeps every pack", pack_keep_days(forever, {}), 0);
+    check("default limit alone", pack_keep_days(month, {}), 30);
+    check("default keep forever plus one channel with a limit",
+          pack_keep_days(forever, {{160710000, month}}), 0);
+    check("channel keeping forever overrides a default limit",
+          pack_keep_days(month, {{160710000, forever}}), 0);
+    check("longest of default and channels", pack_keep_days(month, {{160710000, year}}), 90);
+    check("row age stands in for an unset audio age", pack_keep_days(rows_only, {{160710000, month}}), 60);
+
+    return failures > 0;
+}
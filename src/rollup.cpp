@@ -0,0 +1,136 @@
+#include "rollup.h"
+#include "schema.h"
+#include "search.h"
+#include <cstdio>
+#include <sstream>
+
+using std::string;
+
+// Start of row's bucket for period in epoch microseconds. Days start at
+// local midnight so they match the dates the CLI shows.
+static string bucket(const string &period, const string &row)
+{
+    if (period == "minute")
+        return row + ".start_us - " + row + ".start_us % 60000000";
+    if (period == "hour")
+        return row + ".start_us - " + row + ".start_us % 3600000000";
+    return "CAST(strftime('%s', " + row + ".start_us / 1000000, 'unixepoch', 'localtime',"
+           " 'start of day', 'utc') AS INTEGER) * 1000000";
+}
+
+// Adds sign times row to its bucket in each period
+static string add_row(const string &row, const string &sign)
+{
+    string sql;
+    for (const char *period : {"minute", "hour", "day"})
+        sql += "INSERT INTO rollups (period, bucket_us, freq_hz, transmissions, airtime_ms)"
+               " SELECT '" + string(period) + "', " + bucket(period, row) + ", coalesce(" + row +
+               ".freq_hz, 0), " + sign + "1, " + sign + "coalesce(" + row + ".duration_ms, 0)"
+               " WHERE " + row + ".start_us IS NOT NULL"
+               " ON CONFLICT (period, bucket_us, freq_hz) DO UPDATE SET"
+               " transmissions = transmissions + excluded.transmissions,"
+               " airtime_ms = airtime_ms + excluded.airtime_ms;";
+    return sql;
+}
+
+bool rollup_init(Database &db)
+{
+    bool exists;
+    {
+        Statement table = db.prepare("SELECT 1 FROM sqlite_master WHERE name = 'rollups';");
+        exists = table.step() == SQLITE_ROW;
+    }
+    if (exists)
+        return true;
+
+    string backfill;
+    for (const char *period : {"minute", "hour", "day"})
+        backfill += "INSERT INTO rollups (period, bucket_us, freq_hz, transmissions, airtime_ms)"
+                    " SELECT '" + string(period) + "', " + bucket(period, "info") +
+                    ", coalesce(freq_hz, 0), count(*), coalesce(sum(duration_ms), 0)"
+                    " FROM info WHERE start_us IS NOT NULL GROUP BY 2, 3;";
+
+    // Channels without a known frequency roll up under freq_hz 0. Rows the
+    // schema migration fills in later are picked up by the update trigger.
+    bool ok = db.exec(("BEGIN IMMEDIATE;"
+        "CREATE TABLE rollups("
+            "period TEXT, bucket_us INTEGER, freq_hz INTEGER,"
+            "transmissions INTEGER, airtime_ms INTEGER,"
+            "PRIMARY KEY (period, bucket_us, freq_hz)) WITHOUT ROWID;"
+        "CREATE TRIGGER info_rollup_insert AFTER INSERT ON info BEGIN " +
+            add_row("new", "") +
+        " END;"
+        "CREATE TRIGGER info_rollup_update AFTER UPDATE OF start_us, freq_hz, duration_ms ON info BEGIN " +
+            add_row("old", "-") + add_row("new", "") +
+        " END;" +
+        backfill +
+        "COMMIT;").c_str());
+    if (not ok)
+        db.exec("ROLLBACK;");
+    return ok;
+}
+
+ActivityQuery parse_activity(const string &args)
+{
+    ActivityQuery query;
+    std::stringstream stream(args);
+    string word;
+    while (stream >> word)
+    {
+        if (word == "minute" or word == "hour" or word == "day")
+            query.period = word;
+        else if (word == "since")
+            stream >> query.since;
+        else if (word == "until")
+            stream >> query.until;
+        else if (word == "freq")
+            stream >> query.freq;
+        else if (word == "limit")
+            stream >> query.limit;
+    }
+    return query;
+}
+
+std::vector<ActivityBucket> activity(Database &db, const ActivityQuery &query)
+{
+    std::vector<ActivityBucket> buckets;
+
+    // Reads only the primary key range of the period; bounds are local
+    // times as for search.
+    Statement select = db.prepare((
+        "SELECT strftime(iif(?1 = 'day', '%d-%m-%Y', '%d-%m-%Y %H:%M'), bucket_us / 1000000, 'unixepoch', 'localtime'),"
+        "       freq_hz, transmissions, airtime_ms"
+        "  FROM rollups"
+        " WHERE period = ?1"
+        "   AND (?2 = '' OR bucket_us >= strftime('%s', ?2, 'utc') * 1000000)"
+        "   AND (?3 = '' OR bucket_us < " + until_end_sql(3) + ")"
+        "   AND (?4 = 0 OR freq_hz = ?4)"
+        "   AND transmissions > 0"
+        " ORDER BY bucket_us DESC LIMIT ?5;").c_str());
+    select.bind_text(1, query.period)
+        .bind_text(2, query.since)
+        .bind_text(3, query.until)
+        .bind_int64(4, freq_hz(query.freq))
+        .bind_int64(5, query.limit);
+    while (select.step() == SQLITE_ROW)
+        buckets.push_back({select.column_text(0), select.column_int64(1),
+                           select.column_int64(2), select.column_int64(3)});
+    return buckets;
+}
+
+void print_activity(std::ostream &out, const std::vector<ActivityBucket> &buckets)
+{
+    if (buckets.empty())
+        out << "\nNo activity.";
+    for (auto &bucket : buckets)
+    {
+        // Back to the way rtl_fm takes it, e.g. 160.71M
+        char freq[32] = "unknown";
+        if (bucket.freq_hz)
+            snprintf(freq, sizeof(freq), "%.7gM", bucket.freq_hz / 1e6);
+        char airtime[32];
+        snprintf(airtime, sizeof(airtime), "%.1f", bucket.airtime_ms / 1000.0);
+        out << "\n" << bucket.start << "  " << freq << "  " << bucket.transmissions
+            << " transmissions, " << airtime << " s airtime";
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "database.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A rollup query from the CLI
+struct ActivityQuery
+{
+    // minute, hour or day
+    std::string period = "hour";
+    // Inclusive local-time bounds as YYYY-MM-DD or YYYY-MM-DDTHH:MM[:SS];
+    // empty for none
+    std::string since, until;
+    std::string freq;
+    long limit = 24;
+};
+
+struct ActivityBucket
+{
+    std::string start;
+    long long freq_hz, transmissions, airtime_ms;
+};
+
+// Creates the rollups table and the triggers on info that keep it in step,
+// so every insert updates its buckets in the insert's own transaction.
+// Existing rows are rolled up the first time. Deleting rows from info
+// leaves the rollups alone, so activity outlives retention.
+bool rollup_init(Database &db);
+
+// Parses "[minute|hour|day] [since <when>] [until <when>] [freq <freq>] [limit <n>]"
+ActivityQuery parse_activity(const std::string &args);
+
+// Newest buckets first; one per channel per bucket unless freq is given
+std::vector<ActivityBucket> activity(Database &db, const ActivityQuery &query);
+void print_activity(std::ostream &out, const std::vector<ActivityBucket> &buckets);
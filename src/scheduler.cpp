@@ -0,0 +1,220 @@
+#include "scheduler.h"
+#include "config.h"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using std::string;
+using namespace std::chrono;
+
+void LatencyHistogram::add(long millis, long target_millis)
+{
+    size_t bucket = 0;
+    while (bucket < BUCKETS - 1 and (1L << bucket) <= millis)
+        bucket++;
+    counts[bucket]++;
+    total++;
+    if (millis > target_millis)
+        missed_target++;
+}
+
+void LatencyHistogram::print(std::ostream &out) const
+{
+    for (size_t bucket = 0; bucket < BUCKETS; bucket++)
+    {
+        if (counts[bucket] == 0)
+            continue;
+        out << "\n    < " << std::setw(9) << (1L << bucket) << " ms  " << counts[bucket];
+    }
+}
+
+// Splits "a:1,b:2" into {"a","1"},{"b","2"}
+static std::vector<std::pair<string, string>> parse_pairs(const string &list)
+{
+    std::vector<std::pair<string, string>> pairs;
+    std::stringstream stream(list);
+    string item;
+    while (getline(stream, item, ','))
+    {
+        size_t colon = item.find(':');
+        if (colon == string::npos)
+            continue;
+        pairs.emplace_back(item.substr(0, colon), item.substr(colon + 1));
+    }
+    return pairs;
+}
+
+void TranscriptionScheduler::configure()
+{
+    std::lock_guard<std::mutex> lock(queueMutex);
+
+    classes.clear();
+    for (auto &[name, target] : parse_pairs(config_get("PRIORITY_CLASSES", "normal:30000")))
+    {
+        try
+        {
+            classes.push_back({name, std::stol(target)});
+        }
+        catch (std::exception &e)
+        {
+            std::cerr << "\nBad latency target for priority class " << name;
+        }
+    }
+    if (classes.empty())
+        classes.push_back({"normal", 30000});
+
+    default_class = classes.size() - 1;
+    string default_name = config_get("DEFAULT_PRIORITY_CLASS");
+    channel_classes.clear();
+    for (size_t i = 0; i < classes.size(); i++)
+        if (classes[i].name == default_name)
+            default_class = i;
+
+    for (auto &[freq, class_name] : parse_pairs(config_get("CHANNEL_PRIORITIES")))
+        for (size_t i = 0; i < classes.size(); i++)
+            if (classes[i].name == class_name)
+                channel_classes[freq] = i;
+
+    starvation_factor = config_get_double("SCHEDULER_STARVATION_FACTOR", 2.0);
+
+    queues.assign(classes.size(), {});
+    pending.clear();
+    histograms.assign(classes.size(), {});
+}
+
+size_t TranscriptionScheduler::class_of(const string &freq)
+{
+    auto channel = channel_classes.find(freq);
+    return channel == channel_classes.end() ? default_class : channel->second;
+}
+
+void TranscriptionScheduler::submit(const string &audio_path, const string &freq)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (not pending.insert(audio_path).second)
+            return;
+        size_t priority_class = class_of(freq);
+        wall_time queued_at = system_clock::now();
+        wall_time deadline = queued_at + milliseconds(classes[priority_class].target_millis);
+        queues[priority_class].push_back({audio_path, freq, queued_at, deadline, priority_class});
+    }
+    queueReady.notify_one();
+}
+
+// Picks the next job. Call with queueMutex held.
+bool TranscriptionScheduler::next_job(TranscriptionJob &job)
+{
+    auto now = system_clock::now();
+    auto by_deadline = [](const TranscriptionJob &a, const TranscriptionJob &b)
+    { return a.deadline < b.deadline; };
+
+    // Starving jobs of any class go first, most overdue first
+    std::vector<TranscriptionJob> *starving_queue = nullptr;
+    std::vector<TranscriptionJob>::iterator starving;
+    for (size_t i = 0; i < queues.size(); i++)
+    {
+        auto starve_after = duration<double, std::milli>(classes[i].target_millis * starvation_factor);
+        for (auto queued = queues[i].begin(); queued != queues[i].end(); queued++)
+        {
+            if (now - queued->queued_at < starve_after)
+                continue;
+            if (starving_queue == nullptr or queued->deadline < starving->deadline)
+            {
+                starving_queue = &queues[i];
+                starving = queued;
+            }
+        }
+    }
+
+    // Only count a promotion when it actually overtakes a higher class
+    if (starving_queue != nullptr)
+    {
+        for (size_t i = 0; i < starving->priority_class; i++)
+            if (not queues[i].empty())
+            {
+                starvation_promotions++;
+                break;
+            }
+        job = *starving;
+        starving_queue->erase(starving);
+        return true;
+    }
+
+    for (auto &queue : queues)
+    {
+        if (queue.empty())
+            continue;
+        auto earliest = std::min_element(queue.begin(), queue.end(), by_deadline);
+        job = *earliest;
+        queue.erase(earliest);
+        return true;
+    }
+
+    return false;
+}
+
+void TranscriptionScheduler::run_worker()
+{
+    while (not do_stop)
+    {
+        TranscriptionJob job;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueReady.wait(lock, [this, &job]
+                            { return do_stop or next_job(job); });
+            if (do_stop)
+                return;
+        }
+
+        runner(job);
+
+        long latency = duration_cast<milliseconds>(system_clock::now() - job.queued_at).count();
+        std::lock_guard<std::mutex> lock(queueMutex);
+        pending.erase(job.audio_path);
+        histograms[job.priority_class].add(latency, classes[job.priority_class].target_millis);
+    }
+}
+
+void TranscriptionScheduler::start(size_t count, Runner job_runner)
+{
+    // Already running
+    if (not workers.empty())
+        return;
+
+    runner = job_runner;
+    do_stop = false;
+    for (size_t i = 0; i < std::max<size_t>(count, 1); i++)
+        workers.emplace_back(&TranscriptionScheduler::run_worker, this);
+}
+
+void TranscriptionScheduler::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        do_stop = true;
+    }
+    queueReady.notify_all();
+
+    for (auto &worker : workers)
+        if (worker.joinable())
+            worker.join();
+    workers.clear();
+}
+
+void TranscriptionScheduler::print_stats(std::ostream &out)
+{
+    std::lock_guard<std::mutex> lock(queueMutex);
+
+    out << "\nTranscription latency by priority class:";
+    for (size_t i = 0; i < classes.size(); i++)
+    {
+        auto &histogram = histograms[i];
+        out << "\n  " << classes[i].name << " (target " << classes[i].target_millis
+            << " ms, " << queues[i].size() << " queued, " << histogram.total
+            << " done, " << histogram.missed_target << " late)";
+        histogram.print(out);
+    }
+    out << "\n  starvation promotions: " << starvation_promotions;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using wall_time = std::chrono::system_clock::time_point;
+
+// An audio segment waiting to be transcribed
+struct TranscriptionJob
+{
+    std::string audio_path;
+    std::string freq;
+    // When the bus queued the segment, after the recorder has finished
+    // with it; latency, deadlines and starvation are measured from here
+    wall_time queued_at;
+    wall_time deadline;
+    size_t priority_class;
+};
+
+// Transcription latencies in power-of-two millisecond buckets
+struct LatencyHistogram
+{
+    static const size_t BUCKETS = 24;
+    std::array<unsigned long, BUCKETS> counts{};
+    unsigned long missed_target = 0;
+    unsigned long total = 0;
+
+    void add(long millis, long target_millis);
+    // One line per non-empty bucket
+    void print(std::ostream &out) const;
+};
+
+// A priority class from PRIORITY_CLASSES, e.g. "dispatch:5000"
+struct PriorityClass
+{
+    std::string name;
+    long target_millis;
+};
+
+/*
+ * Deadline-aware transcription queue.
+ *
+ * Each channel maps to a priority class with a latency target. Workers
+ * serve the highest class that has work, earliest deadline first. A job
+ * that has waited longer than SCHEDULER_STARVATION_FACTOR times its
+ * target jumps ahead of everything, so busy dispatch channels can delay
+ * chatter but never starve it.
+ */
+class TranscriptionScheduler
+{
+public:
+    using Runner = std::function<void(const TranscriptionJob &)>;
+
+    // Reads classes and channel assignments from the config
+    void configure();
+    // Queues audio_path, unless it is already queued or being transcribed
+    void submit(const std::string &audio_path, const std::string &freq);
+    void start(size_t workers, Runner runner);
+    // Stops the workers once their current jobs finish. Queued jobs stay
+    // queued for the next start(); if the bus exits first, it finds them
+    // again on startup by their info rows, which have no transcript yet.
+    void stop();
+    void print_stats(std::ostream &out);
+
+private:
+    void run_worker();
+    bool next_job(TranscriptionJob &job);
+    size_t class_of(const std::string &freq);
+
+    std::vector<PriorityClass> classes;
+    std::unordered_map<std::string, size_t> channel_classes;
+    size_t default_class = 0;
+    double starvation_factor = 2.0;
+
+    // One queue per class, highest priority first
+    std::vector<std::vector<TranscriptionJob>> queues;
+    std::vector<LatencyHistogram> histograms;
+    // Audio paths queued or being transcribed
+    std::unordered_set<std::string> pending;
+    unsigned long starvation_promotions = 0;
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+
+    Runner runner;
+    std::vector<std::thread> workers;
+    std::atomic<bool> do_stop = false;
+};
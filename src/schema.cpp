@@ -0,0 +1,228 @@
+#include "schema.h"
+#include "config.h"
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+
+using std::string;
+
+long long freq_hz(const string &freq)
+{
+    char *end;
+    double value = strtod(freq.c_str(), &end);
+    if (end == freq.c_str())
+        return 0;
+    switch (*end)
+    {
+    case 'G': case 'g': value *= 1e9; break;
+    case 'M': case 'm': value *= 1e6; break;
+    case 'K': case 'k': value *= 1e3; break;
+    }
+    return llround(value);
+}
+
+static void freq_hz_function(sqlite3_context *context, int, sqlite3_value **argv)
+{
+    const unsigned char *freq = sqlite3_value_text(argv[0]);
+    long long hz = freq ? freq_hz((const char *)freq) : 0;
+    if (hz > 0)
+        sqlite3_result_int64(context, hz);
+    else
+        sqlite3_result_null(context);
+}
+
+// The file name without directory or extension, which is what a
+// transcript is named after
+static void path_stem_function(sqlite3_context *context, int, sqlite3_value **argv)
+{
+    const unsigned char *path = sqlite3_value_text(argv[0]);
+    if (not path)
+    {
+        sqlite3_result_null(context);
+        return;
+    }
+    string stem = std::filesystem::path((const char *)path).stem().string();
+    sqlite3_result_text(context, stem.c_str(), stem.size(), SQLITE_TRANSIENT);
+}
+
+static int schema_version(Database &db)
+{
+    Statement version = db.prepare("PRAGMA user_version;");
+    return version.step() == SQLITE_ROW ? version.column_int64(0) : 0;
+}
+
+bool schema_init(Database &db)
+{
+    sqlite3_create_function(db.handle(), "freq_hz", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                            nullptr, freq_hz_function, nullptr, nullptr);
+    sqlite3_create_function(db.handle(), "path_stem", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                            nullptr, path_stem_function, nullptr, nullptr);
+
+    bool exists;
+    {
+        Statement table = db.prepare("SELECT 1 FROM sqlite_master WHERE name = 'info';");
+        exists = table.step() == SQLITE_ROW;
+    }
+
+    // auto_vacuum lets retention hand freed pages back with
+    // incremental_vacuum. The database is already in WAL mode by now, where
+    // the setting only sticks after a VACUUM; on a new file that is free.
+    bool ok = true;
+    if (not exists)
+        ok = db.exec("PRAGMA auto_vacuum = INCREMENTAL;\
+            CREATE TABLE info(\
+                id INTEGER PRIMARY KEY AUTOINCREMENT,\
+                date TEXT, time TEXT, freq TEXT, agency TEXT,\
+                transcript TEXT, audioPath TEXT,\
+                postID TEXT, postURL TEXT,\
+                start_us INTEGER, end_us INTEGER, freq_hz INTEGER, duration_ms INTEGER,\
+                segment TEXT);\
+            PRAGMA user_version = 2;\
+            VACUUM;");
+    else if (schema_version(db) < 1)
+    {
+        ok = db.exec("BEGIN IMMEDIATE;\
+            ALTER TABLE info ADD COLUMN start_us INTEGER;\
+            ALTER TABLE info ADD COLUMN end_us INTEGER;\
+            ALTER TABLE info ADD COLUMN freq_hz INTEGER;\
+            ALTER TABLE info ADD COLUMN duration_ms INTEGER;\
+            PRAGMA user_version = 1;\
+            COMMIT;");
+        if (not ok)
+            db.exec("ROLLBACK;");
+    }
+
+    // segment is independent of the version: retention rewrites audioPath
+    // once the audio is recompressed or packed, but a transcript and the
+    // bus's startup scan look rows up by the audio file's stem. Rows from
+    // before it get theirs from audioPath while it still names the file.
+    bool has_segment = false;
+    if (ok)
+    {
+        Statement column = db.prepare("SELECT 1 FROM pragma_table_info('info') WHERE name = 'segment';");
+        has_segment = column.step() == SQLITE_ROW;
+    }
+    if (ok and not has_segment)
+    {
+        ok = db.exec("BEGIN IMMEDIATE;\
+            ALTER TABLE info ADD COLUMN segment TEXT;\
+            UPDATE info SET segment = path_stem(audioPath)\
+                WHERE audioPath IS NOT NULL AND audioPath NOT LIKE 'segment:%';\
+            COMMIT;");
+        if (not ok)
+            db.exec("ROLLBACK;");
+    }
+
+    // Both cover the airtime queries, so those never touch the table
+    return ok and db.exec("CREATE INDEX IF NOT EXISTS info_start ON info(start_us, freq_hz, duration_ms);\
+            CREATE INDEX IF NOT EXISTS info_freq_start ON info(freq_hz, start_us, duration_ms);\
+            CREATE INDEX IF NOT EXISTS info_segment ON info(segment);");
+}
+
+bool migrate_batch(Database &db, sqlite3_int64 &after, long rows, bool &more)
+{
+    sqlite3_int64 last;
+    {
+        Statement batch = db.prepare("SELECT max(id) FROM (SELECT id FROM info WHERE id > ?1 ORDER BY id LIMIT ?2);");
+        batch.bind_int64(1, after).bind_int64(2, rows);
+        if (batch.step() != SQLITE_ROW)
+            return false;
+        more = not batch.column_null(0);
+        if (not more)
+            return true;
+        last = batch.column_int64(0);
+    }
+
+    // The text date and time are local; 'utc' converts from local time.
+    // Only the start is known for these rows.
+    Statement update = db.prepare(
+        "UPDATE info SET"
+        "   start_us = CAST(strftime('%s', substr(date, 7, 4) || '-' || substr(date, 4, 2) || '-' ||"
+        "              substr(date, 1, 2) || ' ' || time, 'utc') AS INTEGER) * 1000000,"
+        "   freq_hz = coalesce(freq_hz, freq_hz(freq))"
+        " WHERE id > ?1 AND id <= ?2 AND start_us IS NULL AND date IS NOT NULL;");
+    update.bind_int64(1, after).bind_int64(2, last);
+    if (not update.run())
+        return false;
+    after = last;
+    return true;
+}
+
+void SchemaMigrator::configure()
+{
+    batch_rows = config_get_int("MIGRATE_BATCH_ROWS", 1000);
+    pause = std::chrono::milliseconds(config_get_int("MIGRATE_PAUSE_MILLIS", 50));
+}
+
+void SchemaMigrator::start(DatabaseWriter *databaseWriter, ReaderPool *readers)
+{
+    // Already running
+    if (migrator.joinable())
+        return;
+
+    {
+        ReaderPool::Lease db = readers->acquire();
+        if (schema_version(*db) >= SCHEMA_VERSION)
+        {
+            done = true;
+            return;
+        }
+    }
+
+    writer = databaseWriter;
+    do_stop = false;
+    migrator = std::thread(&SchemaMigrator::run_migration, this);
+}
+
+void SchemaMigrator::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(migrateMutex);
+        do_stop = true;
+    }
+    migrateWake.notify_all();
+    if (migrator.joinable())
+        migrator.join();
+}
+
+void SchemaMigrator::run_migration()
+{
+    std::cout << "\nMigrating info to schema version " << SCHEMA_VERSION << " in the background";
+    sqlite3_int64 after = 0;
+    std::unique_lock<std::mutex> lock(migrateMutex);
+    while (not do_stop)
+    {
+        lock.unlock();
+        bool more = false;
+        auto batch = writer->submit(
+            [this, &after, &more](Database &db)
+            { return migrate_batch(db, after, batch_rows, more); });
+        bool ok = batch.get();
+        lock.lock();
+
+        // Picked up again from the start on the next run
+        if (not ok)
+            break;
+        if (not more)
+        {
+            auto finish = writer->submit(
+                [](Database &db)
+                { return db.exec("PRAGMA user_version = 2;"); });
+            finish.wait();
+            done = true;
+            std::cout << "\nMigration to schema version " << SCHEMA_VERSION << " finished";
+            break;
+        }
+        batches++;
+        migrated_through = after;
+        migrateWake.wait_for(lock, pause, [this] { return do_stop; });
+    }
+}
+
+void SchemaMigrator::print_stats(std::ostream &out)
+{
+    out << "\nSchema: version " << (done ? SCHEMA_VERSION : 1);
+    if (not done)
+        out << ", migrating, " << batches << " batches through row " << migrated_through;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "database.h"
+#include "db_writer.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+/*
+ * Layout of the info table, kept in PRAGMA user_version:
+ *   0  date and time as DD-MM-YYYY and HH:MM:SS text, freq as text
+ *   1  integer columns added: start_us and end_us (epoch microseconds),
+ *      freq_hz and duration_ms, with older rows still being filled in
+ *   2  every row filled in
+ * The segment column, the audio file's stem, is added to any version that
+ * lacks it.
+ */
+const int SCHEMA_VERSION = 2;
+
+// Hz from a frequency written the way rtl_fm takes it, e.g. "160.71M";
+// 0 if it can't be read
+long long freq_hz(const std::string &freq);
+
+// Creates info, or adds the version 1 columns and segment to an older one;
+// adding columns doesn't rewrite the table. Also registers freq_hz() and
+// path_stem() as SQL functions on db, for the migration.
+bool schema_init(Database &db);
+
+// Fills in up to rows rows after id after and moves after past them;
+// more is false once none are left. Returns false on an SQL error.
+bool migrate_batch(Database &db, sqlite3_int64 &after, long rows, bool &more);
+
+/*
+ * Brings version 1 rows up to version 2 in the background, one batch of
+ * MIGRATE_BATCH_ROWS rows per write through the writer, with a pause of
+ * MIGRATE_PAUSE_MILLIS between batches so live ingest is never queued
+ * behind more than one of them.
+ */
+class SchemaMigrator
+{
+public:
+    void configure();
+    void start(DatabaseWriter *writer, ReaderPool *readers);
+    void stop();
+    void print_stats(std::ostream &out);
+
+private:
+    void run_migration();
+
+    DatabaseWriter *writer = nullptr;
+    long batch_rows = 1000;
+    std::chrono::milliseconds pause{50};
+
+    std::thread migrator;
+    std::mutex migrateMutex;
+    std::condition_variable migrateWake;
+    bool do_stop = false;
+
+    std::atomic<long> batches = 0;
+    std::atomic<sqlite3_int64> migrated_through = 0;
+    std::atomic<bool> done = false;
+};
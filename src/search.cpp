@@ -0,0 +1,117 @@
+#include "search.h"
+#include "schema.h"
+#include <sstream>
+
+using std::string;
+
+bool search_init(Database &db)
+{
+    bool exists;
+    {
+        Statement table = db.prepare("SELECT 1 FROM sqlite_master WHERE name = 'transcripts_fts';");
+        exists = table.step() == SQLITE_ROW;
+    }
+
+    // External content: the index holds only tokens and reads the text
+    // itself back from info.
+    bool ok = db.exec(
+        "CREATE VIRTUAL TABLE IF NOT EXISTS transcripts_fts USING fts5(\
+            transcript, content = 'info', content_rowid = 'id');\
+        CREATE TRIGGER IF NOT EXISTS info_fts_insert AFTER INSERT ON info\
+            WHEN new.transcript IS NOT NULL BEGIN\
+            INSERT INTO transcripts_fts (rowid, transcript) VALUES (new.id, new.transcript);\
+        END;\
+        CREATE TRIGGER IF NOT EXISTS info_fts_delete AFTER DELETE ON info\
+            WHEN old.transcript IS NOT NULL BEGIN\
+            INSERT INTO transcripts_fts (transcripts_fts, rowid, transcript)\
+                VALUES ('delete', old.id, old.transcript);\
+        END;\
+        CREATE TRIGGER IF NOT EXISTS info_fts_update AFTER UPDATE OF transcript ON info BEGIN\
+            INSERT INTO transcripts_fts (transcripts_fts, rowid, transcript)\
+                SELECT 'delete', old.id, old.transcript WHERE old.transcript IS NOT NULL;\
+            INSERT INTO transcripts_fts (rowid, transcript)\
+                SELECT new.id, new.transcript WHERE new.transcript IS NOT NULL;\
+        END;");
+    if (ok and not exists)
+        ok = db.exec("INSERT INTO transcripts_fts (transcripts_fts) VALUES ('rebuild');");
+    return ok;
+}
+
+SearchQuery parse_search(const string &args)
+{
+    SearchQuery query;
+    std::stringstream stream(args);
+    string word;
+    while (stream >> word)
+    {
+        if (word == "since")
+            stream >> query.since;
+        else if (word == "until")
+            stream >> query.until;
+        else if (word == "freq")
+            stream >> query.freq;
+        else if (word == "limit")
+            stream >> query.limit;
+        else
+            query.words.push_back(word);
+    }
+    return query;
+}
+
+string match_expression(const std::vector<string> &words)
+{
+    string match;
+    for (auto &word : words)
+    {
+        bool prefix = word.size() > 1 and word.back() == '*';
+        string quoted = "\"";
+        for (char c : prefix ? word.substr(0, word.size() - 1) : word)
+            quoted += c == '"' ? string("\"\"") : string(1, c);
+        quoted += prefix ? "\"*" : "\"";
+        match += (match.empty() ? "" : " ") + quoted;
+    }
+    return match;
+}
+
+string until_end_sql(int parameter)
+{
+    string bound = "?" + std::to_string(parameter);
+    return "strftime('%s', " + bound + ", iif(instr(" + bound + ", 'T'), iif(length(" + bound +
+           ") > 16, '+1 second', '+1 minute'), '+1 day'), 'utc') * 1000000";
+}
+
+std::vector<SearchHit> search(Database &db, const SearchQuery &query)
+{
+    std::vector<SearchHit> hits;
+    if (query.words.empty())
+        return hits;
+
+    // Times are local. A bare until date runs to the end of that day.
+    Statement select = db.prepare((
+        "SELECT info.id, strftime('%d-%m-%Y', info.start_us / 1000000, 'unixepoch', 'localtime'),"
+        "       strftime('%H:%M:%S', info.start_us / 1000000, 'unixepoch', 'localtime'),"
+        "       coalesce(info.freq, ''), snippet(transcripts_fts, 0, '[', ']', '...', 12)"
+        "  FROM transcripts_fts JOIN info ON info.id = transcripts_fts.rowid"
+        " WHERE transcripts_fts MATCH ?1"
+        "   AND (?2 = '' OR info.start_us >= strftime('%s', ?2, 'utc') * 1000000)"
+        "   AND (?3 = '' OR info.start_us < " + until_end_sql(3) + ")"
+        "   AND (?4 = 0 OR info.freq_hz = ?4)"
+        " ORDER BY rank LIMIT ?5;").c_str());
+    select.bind_text(1, match_expression(query.words))
+        .bind_text(2, query.since)
+        .bind_text(3, query.until)
+        .bind_int64(4, freq_hz(query.freq))
+        .bind_int64(5, query.limit);
+    while (select.step() == SQLITE_ROW)
+        hits.push_back({select.column_int64(0), select.column_text(1), select.column_text(2),
+                        select.column_text(3), select.column_text(4)});
+    return hits;
+}
+
+void print_hits(std::ostream &out, const std::vector<SearchHit> &hits)
+{
+    if (hits.empty())
+        out << "\nNo matching transcripts.";
+    for (auto &hit : hits)
+        out << "\n" << hit.date << " " << hit.time << "  " << hit.freq << "  " << hit.snippet;
+}
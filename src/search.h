@@ -0,0 +1,44 @@
+#pragma once
+
+#include "database.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A search from the CLI: words to find, plus optional filters
+struct SearchQuery
+{
+    std::vector<std::string> words;
+    // Inclusive local-time bounds as YYYY-MM-DD or YYYY-MM-DDTHH:MM[:SS];
+    // empty for none
+    std::string since, until;
+    std::string freq;
+    long limit = 20;
+};
+
+struct SearchHit
+{
+    sqlite3_int64 id;
+    std::string date, time, freq, snippet;
+};
+
+// Creates the transcripts_fts index over info.transcript and the triggers
+// that keep it in step, indexing existing transcripts the first time.
+bool search_init(Database &db);
+
+// Parses "words... [since <when>] [until <when>] [freq <freq>] [limit <n>]".
+// A word ending in * matches as a prefix.
+SearchQuery parse_search(const std::string &args);
+
+// An FTS5 query for words: each becomes a quoted string so punctuation in
+// it can't be read as query syntax, and all of them must match
+std::string match_expression(const std::vector<std::string> &words);
+
+// SQL for the exclusive end of the until bound in ?parameter, in epoch
+// microseconds: the bound plus one of its finest unit, so a date takes in
+// the whole day and YYYY-MM-DDTHH:MM the whole minute
+std::string until_end_sql(int parameter);
+
+// Best matches first, by FTS5 rank (bm25)
+std::vector<SearchHit> search(Database &db, const SearchQuery &query);
+void print_hits(std::ostream &out, const std::vector<SearchHit> &hits);
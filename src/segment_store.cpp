@@ -0,0 +1,419 @@
+#include "segment_store.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string;
+
+const char INDEX_MAGIC[8] = {'S', 'E', 'G', 'I', 'D', 'X', '1', '\0'};
+const uint64_t INDEX_START_CAPACITY = 1024;
+const string REF_PREFIX = "segment:";
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3 x64 128, seed 0. Not cryptographic; a store that finds an
+// id already taken compares the bytes before calling it a duplicate.
+static SegmentId content_hash(const string &data)
+{
+    const uint8_t *bytes = (const uint8_t *)data.data();
+    const size_t length = data.size();
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0;
+
+    for (size_t block = 0; block < length / 16; block++)
+    {
+        uint64_t k1, k2;
+        memcpy(&k1, bytes + block * 16, 8);
+        memcpy(&k2, bytes + block * 16 + 8, 8);
+        k1 *= c1, k1 = rotl64(k1, 31), k1 *= c2, h1 ^= k1;
+        h1 = rotl64(h1, 27), h1 += h2, h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2, k2 = rotl64(k2, 33), k2 *= c1, h2 ^= k2;
+        h2 = rotl64(h2, 31), h2 += h1, h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const uint8_t *tail = bytes + length / 16 * 16;
+    size_t rest = length & 15;
+    uint64_t k1 = 0, k2 = 0;
+    for (size_t i = rest; i > 8; i--)
+        k2 ^= uint64_t(tail[i - 1]) << ((i - 9) * 8);
+    if (rest > 8)
+        k2 *= c2, k2 = rotl64(k2, 33), k2 *= c1, h2 ^= k2;
+    for (size_t i = std::min<size_t>(rest, 8); i > 0; i--)
+        k1 ^= uint64_t(tail[i - 1]) << ((i - 1) * 8);
+    if (rest > 0)
+        k1 *= c1, k1 = rotl64(k1, 31), k1 *= c2, h1 ^= k1;
+
+    h1 ^= length, h2 ^= length;
+    h1 += h2, h2 += h1;
+    h1 = fmix64(h1), h2 = fmix64(h2);
+    h1 += h2, h2 += h1;
+    return {h1, h2};
+}
+
+string SegmentId::ref() const
+{
+    char hex[33];
+    snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long)high, (unsigned long long)low);
+    return REF_PREFIX + hex;
+}
+
+bool SegmentId::parse(const string &audio_path, SegmentId &id)
+{
+    if (audio_path.size() != REF_PREFIX.size() + 32 or audio_path.compare(0, REF_PREFIX.size(), REF_PREFIX) != 0)
+        return false;
+    string hex = audio_path.substr(REF_PREFIX.size());
+    if (hex.find_first_not_of("0123456789abcdef") != string::npos)
+        return false;
+    id.high = strtoull(hex.substr(0, 16).c_str(), nullptr, 16);
+    id.low = strtoull(hex.substr(16).c_str(), nullptr, 16);
+    return true;
+}
+
+bool SegmentStore::open(const string &store_dir)
+{
+    std::unique_lock lock(storeMutex);
+    if (header)
+        return true;
+    dir = store_dir;
+    std::error_code err;
+    std::filesystem::create_directories(dir, err);
+
+    index_fd = ::open(index_path().c_str(), O_RDWR | O_CLOEXEC);
+    if (index_fd == -1)
+        return create_index("", INDEX_START_CAPACITY, index_fd, header, slots);
+
+    struct stat index_stat;
+    Header *mapped = nullptr;
+    if (fstat(index_fd, &index_stat) == 0 and (size_t)index_stat.st_size >= sizeof(Header))
+    {
+        void *map = mmap(nullptr, index_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+        if (map != MAP_FAILED)
+            mapped = (Header *)map;
+    }
+    if (not mapped or memcmp(mapped->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 or
+        sizeof(Header) + mapped->capacity * sizeof(Slot) != (size_t)index_stat.st_size)
+    {
+        std::cerr << "\nUnreadable segment index " << index_path() << std::endl;
+        if (mapped)
+            munmap(mapped, index_stat.st_size);
+        ::close(index_fd);
+        index_fd = -1;
+        return false;
+    }
+    header = mapped;
+    slots = (Slot *)(header + 1);
+    return true;
+}
+
+void SegmentStore::close()
+{
+    sync();
+    std::unique_lock lock(storeMutex);
+    unmap_index();
+    for (auto &[hour, pack] : packs)
+        ::close(pack.fd);
+    packs.clear();
+}
+
+bool SegmentStore::create_index(const string &suffix, uint64_t capacity, int &fd, Header *&new_header,
+                                Slot *&new_slots)
+{
+    size_t size = sizeof(Header) + capacity * sizeof(Slot);
+    fd = ::open((index_path() + suffix).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    void *map = MAP_FAILED;
+    if (fd != -1 and ftruncate(fd, size) == 0)
+        map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("segment index");
+        if (fd != -1)
+            ::close(fd);
+        fd = -1;
+        return false;
+    }
+    new_header = (Header *)map;
+    memcpy(new_header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    new_header->capacity = capacity;
+    new_header->count = 0;
+    new_slots = (Slot *)(new_header + 1);
+    return true;
+}
+
+void SegmentStore::unmap_index()
+{
+    if (header)
+        munmap(header, sizeof(Header) + header->capacity * sizeof(Slot));
+    if (index_fd != -1)
+        ::close(index_fd);
+    header = nullptr;
+    slots = nullptr;
+    index_fd = -1;
+}
+
+SegmentStore::Slot *SegmentStore::find(Header *in, Slot *table, const SegmentId &id)
+{
+    // The capacity is a power of two and the table never fills up
+    uint64_t mask = in->capacity - 1;
+    for (uint64_t i = id.low & mask;; i = (i + 1) & mask)
+        if (table[i].length == 0 or (table[i].high == id.high and table[i].low == id.low))
+            return &table[i];
+}
+
+// Rehashes the slots of hours from limit on into a new index of capacity
+// slots, then swaps it in with a rename so a crash leaves one or the other
+bool SegmentStore::rebuild(uint64_t capacity, uint32_t limit)
+{
+    int fd;
+    Header *new_header;
+    Slot *new_slots;
+    if (not create_index(".new", capacity, fd, new_header, new_slots))
+        return false;
+    for (uint64_t i = 0; i < header->capacity; i++)
+        if (slots[i].length and slots[i].hour >= limit)
+        {
+            *find(new_header, new_slots, {slots[i].high, slots[i].low}) = slots[i];
+            new_header->count++;
+        }
+    size_t size = sizeof(Header) + new_header->capacity * sizeof(Slot);
+    int dir_fd = -1;
+    if (msync(new_header, size, MS_SYNC) != 0 or rename((index_path() + ".new").c_str(), index_path().c_str()) != 0 or
+        (dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 or fsync(dir_fd) != 0)
+    {
+        perror("segment index");
+        if (dir_fd != -1)
+            ::close(dir_fd);
+        munmap(new_header, size);
+        ::close(fd);
+        return false;
+    }
+    ::close(dir_fd);
+    unmap_index();
+    index_fd = fd;
+    header = new_header;
+    slots = new_slots;
+    return true;
+}
+
+string SegmentStore::pack_path(uint32_t hour) const
+{
+    time_t start = time_t(hour) * 3600;
+    struct tm utc;
+    gmtime_r(&start, &utc);
+    char name[32];
+    strftime(name, sizeof(name), "%Y%m%d%H.pack", &utc);
+    return dir + "/" + name;
+}
+
+SegmentStore::Pack *SegmentStore::pack(uint32_t hour)
+{
+    auto open = packs.find(hour);
+    if (open != packs.end())
+        return &open->second;
+
+    // Anything past the last indexed segment was cut off by a crash; new
+    // segments go after it.
+    int fd = ::open(pack_path(hour).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat pack_stat;
+    if (fd == -1 or fstat(fd, &pack_stat) != 0)
+    {
+        perror("segment pack");
+        if (fd != -1)
+            ::close(fd);
+        return nullptr;
+    }
+    return &(packs[hour] = {fd, (uint64_t)pack_stat.st_size});
+}
+
+bool SegmentStore::put(const string &data, time_t start, SegmentId &id)
+{
+    id = content_hash(data);
+    std::unique_lock lock(storeMutex);
+    if (not header or data.empty())
+        return false;
+
+    uint32_t hour = start / 3600;
+    Slot *slot = find(header, slots, id);
+    bool is_new = slot->length == 0;
+    // Growing before a new slot goes in keeps the table under 70% full, so
+    // find() always meets an empty slot
+    if (is_new and (header->count + 1) * 10 > header->capacity * 7)
+    {
+        if (not rebuild(header->capacity * 2, 0))
+        {
+            failures++;
+            return false;
+        }
+        slot = find(header, slots, id);
+    }
+    if (not is_new)
+    {
+        string existing(slot->length, '\0');
+        Pack *stored_in = pack(slot->hour);
+        if (not stored_in or pread(stored_in->fd, existing.data(), existing.size(), slot->offset) != (ssize_t)existing.size() or
+            existing != data)
+        {
+            std::cerr << "\nSegment " << id.ref() << " is already taken by other audio" << std::endl;
+            failures++;
+            return false;
+        }
+        // A segment lives in the pack of its newest use, so dropping older
+        // packs never takes it from a row that still keeps its audio
+        if (hour <= slot->hour)
+        {
+            deduplicated++;
+            return true;
+        }
+    }
+
+    Pack *append_to = pack(hour);
+    size_t written = 0;
+    while (append_to and written < data.size())
+    {
+        ssize_t n = pwrite(append_to->fd, data.data() + written, data.size() - written, append_to->size + written);
+        if (n <= 0)
+            break;
+        written += n;
+    }
+    if (written < data.size())
+    {
+        perror("segment pack");
+        failures++;
+        return false;
+    }
+
+    *slot = {id.high, id.low, append_to->size, hour, (uint32_t)data.size()};
+    append_to->size += data.size();
+    header->count += is_new;
+    unsynced.insert(hour);
+    stored++;
+    bytes_stored += data.size();
+    return true;
+}
+
+bool SegmentStore::put_file(const string &path, time_t start, SegmentId &id)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (not file)
+        return false;
+    string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return not file.bad() and put(data, start, id);
+}
+
+bool SegmentStore::get(const SegmentId &id, string &data)
+{
+    reads++;
+    auto read_slot = [&](const Slot &slot, int fd)
+    {
+        data.resize(slot.length);
+        if (pread(fd, data.data(), slot.length, slot.offset) == (ssize_t)slot.length and
+            content_hash(data) == id)
+            return true;
+        failures++;
+        return false;
+    };
+
+    {
+        std::shared_lock lock(storeMutex);
+        if (not header)
+            return false;
+        Slot slot = *find(header, slots, id);
+        if (slot.length == 0)
+            return false;
+        auto open = packs.find(slot.hour);
+        if (open != packs.end())
+            return read_slot(slot, open->second.fd);
+    }
+
+    // The first read from this pack since opening the store
+    std::unique_lock lock(storeMutex);
+    if (not header)
+        return false;
+    Slot slot = *find(header, slots, id);
+    Pack *stored_in = slot.length ? pack(slot.hour) : nullptr;
+    return stored_in and read_slot(slot, stored_in->fd);
+}
+
+bool SegmentStore::sync()
+{
+    std::unique_lock lock(storeMutex);
+    if (not header)
+        return false;
+    bool ok = true;
+    for (uint32_t hour : unsynced)
+        ok = fdatasync(packs[hour].fd) == 0 and ok;
+    unsynced.clear();
+    return msync(header, sizeof(Header) + header->capacity * sizeof(Slot), MS_SYNC) == 0 and ok;
+}
+
+void SegmentStore::drop_before(time_t before)
+{
+    std::unique_lock lock(storeMutex);
+    if (not header)
+        return;
+    uint32_t limit = before / 3600;
+
+    // Out of the index first, then off the disk. The rest are rehashed into
+    // a new index, so probes never cross a hole left by a dropped segment
+    // and a crash midway leaves the old index whole.
+    uint64_t dropped = 0;
+    for (uint64_t i = 0; i < header->capacity; i++)
+        dropped += slots[i].length and slots[i].hour < limit;
+    if (dropped > 0 and not rebuild(header->capacity, limit))
+        return;
+
+    std::error_code err;
+    for (auto &file : std::filesystem::directory_iterator(dir, err))
+    {
+        struct tm utc = {};
+        if (file.path().extension() != ".pack" or
+            sscanf(file.path().stem().c_str(), "%4d%2d%2d%2d", &utc.tm_year, &utc.tm_mon, &utc.tm_mday,
+                   &utc.tm_hour) != 4)
+            continue;
+        utc.tm_year -= 1900;
+        utc.tm_mon -= 1;
+        uint32_t hour = timegm(&utc) / 3600;
+        if (hour >= limit)
+            continue;
+        if (packs.count(hour))
+        {
+            ::close(packs[hour].fd);
+            packs.erase(hour);
+            unsynced.erase(hour);
+        }
+        std::filesystem::remove(file.path(), err);
+    }
+}
+
+void SegmentStore::print_stats(std::ostream &out)
+{
+    uint64_t indexed = 0;
+    {
+        std::shared_lock lock(storeMutex);
+        if (header)
+            indexed = header->count;
+    }
+    out << "\nSegment store: " << indexed << " segments, " << stored << " stored and "
+        << deduplicated << " deduplicated this run, " << bytes_stored / (1024 * 1024) << " MiB written, "
+        << reads << " reads, " << failures << " failed";
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <shared_mutex>
+#include <string>
+
+// A segment's 128-bit content hash, which is also its name in the store
+struct SegmentId
+{
+    uint64_t high = 0, low = 0;
+
+    bool operator==(const SegmentId &other) const { return high == other.high and low == other.low; }
+    // As it appears in audioPath, "segment:" and 32 hex digits
+    std::string ref() const;
+    // Reads a ref back; false if audio_path is a plain file
+    static bool parse(const std::string &audio_path, SegmentId &id);
+};
+
+/*
+ * Content-addressed store for encoded audio segments, so that archived
+ * transmissions take a few large files instead of an inode each.
+ *
+ * Segments are appended to one pack file per hour of recording, named
+ * like 2023010214.pack in UTC. The index file maps segment ids to (pack,
+ * offset, length): a small header, then an open-addressed table of
+ * fixed-size slots with linear probing. It is used through mmap, and
+ * rewritten into a new file, doubled, before it would pass 70% full, or
+ * without the segments drop_before() removes. Fetching a segment
+ * is one probe of the mapping and one pread, and the bytes read are
+ * checked against the id.
+ *
+ * Storing a segment that is already there only verifies the bytes match,
+ * unless it comes from a later hour; then it is written again to the later
+ * pack, which is the one dropped last.
+ * sync() flushes packs and index together; call it before removing the
+ * files that were stored.
+ */
+class SegmentStore
+{
+public:
+    bool open(const std::string &dir);
+    void close();
+
+    // Stores data recorded at start; false on an I/O error or if another
+    // segment already has the same hash
+    bool put(const std::string &data, time_t start, SegmentId &id);
+    bool put_file(const std::string &path, time_t start, SegmentId &id);
+    bool get(const SegmentId &id, std::string &data);
+    // Makes everything stored so far durable
+    bool sync();
+    // Deletes the packs of hours that began before before, and their
+    // segments with them
+    void drop_before(time_t before);
+
+    void print_stats(std::ostream &out);
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint64_t capacity;
+        uint64_t count;
+    };
+    // length 0 marks an empty slot
+    struct Slot
+    {
+        uint64_t high, low;
+        uint64_t offset;
+        uint32_t hour;
+        uint32_t length;
+    };
+    struct Pack
+    {
+        int fd;
+        uint64_t size;
+    };
+
+    // The slot holding id, or the empty slot where it would go
+    Slot *find(Header *header, Slot *slots, const SegmentId &id);
+    // Maps a new index of capacity slots at index_path() + suffix
+    bool create_index(const std::string &suffix, uint64_t capacity, int &fd, Header *&header, Slot *&slots);
+    // Replaces the index with one of capacity slots holding the segments
+    // of hour limit and later
+    bool rebuild(uint64_t capacity, uint32_t limit);
+    void unmap_index();
+    // The open pack for hour, opened or created as needed; nullptr on error
+    Pack *pack(uint32_t hour);
+    std::string index_path() const { return dir + "/index"; }
+    std::string pack_path(uint32_t hour) const;
+
+    std::string dir;
+    int index_fd = -1;
+    Header *header = nullptr;
+    Slot *slots = nullptr;
+    std::map<uint32_t, Pack> packs;
+    std::set<uint32_t> unsynced;
+    // Use this mutex to lock the index and the open packs. Reads share it;
+    // stores, growing and dropping packs take it alone.
+    std::shared_mutex storeMutex;
+
+    std::atomic<unsigned long> stored = 0;
+    std::atomic<unsigned long> deduplicated = 0;
+    std::atomic<unsigned long long> bytes_stored = 0;
+    std::atomic<unsigned long> reads = 0;
+    std::atomic<unsigned long> failures = 0;
+};
@@ -0,0 +1,425 @@
+#include "sinks.h"
+#include "config.h"
+#include "json.h"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <netdb.h>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+using namespace std::chrono;
+
+string record_json(const TranscriptRecord &record)
+{
+    return "{\"segment\": " + json_string(record.segment) +
+           ", \"channel\": " + json_string(record.channel) +
+           ", \"time\": " + std::to_string(record.time) +
+           ", \"text\": " + json_string(record.text) + "}";
+}
+
+// Writes all of data, retrying short writes
+static bool write_all(int fd, const string &data, int flags = MSG_NOSIGNAL)
+{
+    for (size_t done = 0; done < data.size();)
+    {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, flags);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+void Sink::start()
+{
+    // Already running
+    if (worker.joinable())
+        return;
+
+    max_queue = config_get_int("SINK_QUEUE_MAX", 10000);
+    batch_max = std::max<long>(config_get_int("SINK_BATCH_MAX", 100), 1);
+    batch_wait = milliseconds(config_get_int("SINK_BATCH_MILLIS", 200));
+    do_stop = false;
+    worker = std::thread(&Sink::run, this);
+}
+
+void Sink::stop()
+{
+    do_stop = true;
+    queueReady.notify_all();
+    if (worker.joinable())
+        worker.join();
+}
+
+void Sink::submit(const TranscriptRecord &record)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (queue.size() >= std::max<size_t>(max_queue, 1))
+        {
+            queue.pop_front();
+            dropped++;
+        }
+        queue.push_back(record);
+    }
+    queueReady.notify_one();
+}
+
+void Sink::run()
+{
+    open();
+    while (true)
+    {
+        vector<TranscriptRecord> batch;
+        {
+            // Wait for a full batch, or for the first record to age
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueReady.wait_for(lock, batch_wait, [this]
+                                { return do_stop or queue.size() >= batch_max; });
+            // Whatever is left gets written before stopping
+            if (do_stop and queue.empty())
+                break;
+            while (not queue.empty() and batch.size() < batch_max)
+            {
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+        }
+
+        if (not batch.empty())
+        {
+            if (write_batch(batch))
+                written += batch.size();
+            else
+                lost += batch.size();
+            batches++;
+        }
+        idle();
+    }
+    close();
+}
+
+void Sink::print_stats(std::ostream &out)
+{
+    size_t queued;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queued = queue.size();
+    }
+    out << "\n  " << name << ": " << written << " written in " << batches << " batches, "
+        << lost << " lost, " << dropped << " dropped, " << queued << " queued";
+}
+
+JsonlFileSink::JsonlFileSink() : Sink("jsonl")
+{
+    dir = config_get("SINK_JSONL_DIR", "/home/corey/scannerbot/transcripts/jsonl/");
+    max_bytes = config_get_int("SINK_JSONL_MAX_BYTES", 64 << 20);
+}
+
+bool JsonlFileSink::rotate()
+{
+    close();
+
+    std::error_code err;
+    std::filesystem::create_directories(dir, err);
+
+    // The sequence number keeps files started in the same second apart
+    char name[64];
+    time_t now = time(nullptr);
+    strftime(name, sizeof(name), "transcripts-%Y%m%d-%H%M%S", localtime(&now));
+    string file_path = (std::filesystem::path(dir) / name).string() + "-" +
+                       std::to_string(files++) + ".jsonl";
+
+    fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror("jsonl sink open");
+        return false;
+    }
+    bytes = lseek(fd, 0, SEEK_END);
+    return true;
+}
+
+bool JsonlFileSink::write_batch(const vector<TranscriptRecord> &batch)
+{
+    if ((fd == -1 or bytes >= max_bytes) and not rotate())
+        return false;
+
+    // One write per batch
+    string lines;
+    for (auto &record : batch)
+        lines += record_json(record) + '\n';
+
+    for (size_t done = 0; done < lines.size();)
+    {
+        ssize_t n = write(fd, lines.data() + done, lines.size() - done);
+        if (n <= 0)
+        {
+            perror("jsonl sink write");
+            close();
+            return false;
+        }
+        done += n;
+    }
+    bytes += lines.size();
+    return true;
+}
+
+void JsonlFileSink::close()
+{
+    if (fd != -1)
+        ::close(fd);
+    fd = -1;
+}
+
+UnixSocketSink::UnixSocketSink() : Sink("socket")
+{
+    socket_path = config_get("SINK_SOCKET_PATH", "/tmp/scannerbot_transcripts.sock");
+}
+
+void UnixSocketSink::open()
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(socket_path.c_str());
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener == -1 or bind(listener, (sockaddr *)&addr, sizeof(addr)) == -1 or
+        listen(listener, 16) == -1)
+    {
+        perror("socket sink listen");
+        if (listener != -1)
+            ::close(listener);
+        listener = -1;
+    }
+}
+
+void UnixSocketSink::idle()
+{
+    if (listener == -1)
+        return;
+
+    int client;
+    while ((client = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+        clients.push_back(client);
+}
+
+bool UnixSocketSink::write_batch(const vector<TranscriptRecord> &batch)
+{
+    idle();
+
+    string lines;
+    for (auto &record : batch)
+        lines += record_json(record) + '\n';
+
+    // Clients are non-blocking, so a full socket buffer means the client
+    // has fallen behind; drop it instead of stalling the others.
+    for (auto client = clients.begin(); client != clients.end();)
+    {
+        if (write_all(*client, lines, MSG_NOSIGNAL | MSG_DONTWAIT))
+        {
+            client++;
+            continue;
+        }
+        ::close(*client);
+        client = clients.erase(client);
+    }
+    return true;
+}
+
+void UnixSocketSink::close()
+{
+    for (int client : clients)
+        ::close(client);
+    clients.clear();
+    if (listener != -1)
+    {
+        ::close(listener);
+        unlink(socket_path.c_str());
+    }
+    listener = -1;
+}
+
+WebhookSink::WebhookSink() : Sink("webhook")
+{
+    // http://host[:port][/path]
+    string url = config_get("SINK_WEBHOOK_URL", "http://127.0.0.1:8089/webhook");
+    if (url.rfind("http://", 0) == 0)
+        url = url.substr(7);
+    else
+        std::cerr << "\nWebhook sink only speaks plain http://, got " << url;
+
+    size_t slash = url.find('/');
+    if (slash != string::npos)
+        target = url.substr(slash);
+    host = url.substr(0, slash);
+    size_t colon = host.find(':');
+    if (colon != string::npos)
+    {
+        port = host.substr(colon + 1);
+        host = host.substr(0, colon);
+    }
+}
+
+bool WebhookSink::connect_server()
+{
+    if (sock != -1)
+        return true;
+
+    addrinfo hints{}, *found;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0)
+    {
+        std::cerr << "\nWebhook sink can't resolve " << host;
+        return false;
+    }
+    for (addrinfo *addr = found; addr != nullptr; addr = addr->ai_next)
+    {
+        sock = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+        if (sock == -1)
+            continue;
+        // Don't let a hung server hold the sink forever
+        timeval timeout{10, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0)
+            break;
+        ::close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(found);
+    return sock != -1;
+}
+
+bool WebhookSink::post(const string &body)
+{
+    if (not connect_server())
+        return false;
+
+    string request = "POST " + target + " HTTP/1.1\r\n"
+                     "Host: " + host + "\r\n"
+                     "Content-Type: application/json\r\n"
+                     "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                     "Connection: keep-alive\r\n\r\n" + body;
+    if (not write_all(sock, request))
+        return false;
+
+    // Read the headers, then skip the body so the connection can be reused
+    string response;
+    size_t header_end;
+    char buf[4096];
+    while ((header_end = response.find("\r\n\r\n")) == string::npos)
+    {
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return false;
+        response.append(buf, n);
+    }
+
+    string headers = response.substr(0, header_end);
+    for (auto &c : headers)
+        c = tolower(c);
+    size_t length = 0;
+    size_t length_at = headers.find("content-length:");
+    if (length_at != string::npos)
+        length = strtoul(headers.c_str() + length_at + 15, nullptr, 10);
+    size_t body_read = response.size() - header_end - 4;
+    while (body_read < length)
+    {
+        ssize_t n = recv(sock, buf, std::min(sizeof(buf), length - body_read), 0);
+        if (n <= 0)
+            return false;
+        body_read += n;
+    }
+    // Without a length the body can't be skipped reliably
+    if (headers.find("connection: close") != string::npos or length_at == string::npos)
+        close();
+
+    int status = atoi(headers.c_str() + headers.find(' ') + 1);
+    if (status < 200 or status >= 300)
+    {
+        std::cerr << "\nWebhook answered " << status;
+        return false;
+    }
+    return true;
+}
+
+bool WebhookSink::write_batch(const vector<TranscriptRecord> &batch)
+{
+    string body = "[";
+    for (auto &record : batch)
+        body += (body.size() > 1 ? ", " : "") + record_json(record);
+    body += "]";
+
+    // A kept-alive connection may have been closed by the server since the
+    // last batch; reconnect once before giving up.
+    if (post(body))
+        return true;
+    close();
+    if (post(body))
+        return true;
+    close();
+    return false;
+}
+
+void WebhookSink::close()
+{
+    if (sock != -1)
+        ::close(sock);
+    sock = -1;
+}
+
+void SinkSet::configure()
+{
+    sinks.clear();
+    std::stringstream names(config_get("SINKS", "twitter"));
+    string name;
+    while (getline(names, name, ','))
+    {
+        if (name == "jsonl")
+            sinks.push_back(std::make_unique<JsonlFileSink>());
+        else if (name == "socket")
+            sinks.push_back(std::make_unique<UnixSocketSink>());
+        else if (name == "webhook")
+            sinks.push_back(std::make_unique<WebhookSink>());
+        else if (name != "twitter")
+            std::cerr << "\nUnknown sink " << name;
+    }
+}
+
+void SinkSet::start()
+{
+    for (auto &sink : sinks)
+        sink->start();
+}
+
+void SinkSet::stop()
+{
+    for (auto &sink : sinks)
+        sink->stop();
+}
+
+void SinkSet::submit(const TranscriptRecord &record)
+{
+    for (auto &sink : sinks)
+        sink->submit(record);
+}
+
+void SinkSet::print_stats(std::ostream &out)
+{
+    if (sinks.empty())
+        return;
+    out << "\nSinks:";
+    for (auto &sink : sinks)
+        sink->print_stats(out);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A finished transcript as handed to the output sinks
+struct TranscriptRecord
+{
+    std::string segment;
+    std::string channel;
+    std::string text;
+    // Unix time the transcript was picked up
+    long long time;
+};
+
+// One JSON object, without a trailing newline
+std::string record_json(const TranscriptRecord &record);
+
+/*
+ * An output for transcripts with its own bounded queue and writer thread,
+ * so a slow consumer only ever backs up its own queue. Records are handed
+ * to write_batch() in groups of up to SINK_BATCH_MAX, or whatever has
+ * arrived after SINK_BATCH_MILLIS.
+ */
+class Sink
+{
+public:
+    explicit Sink(std::string name) : name(std::move(name)) {}
+    virtual ~Sink() = default;
+
+    void start();
+    void stop();
+    // Never waits; drops the oldest record once the queue is full
+    void submit(const TranscriptRecord &record);
+    void print_stats(std::ostream &out);
+
+    const std::string name;
+
+protected:
+    // Called on the sink's thread. Returns false if the batch was lost.
+    virtual bool write_batch(const std::vector<TranscriptRecord> &batch) = 0;
+    virtual void open() {}
+    virtual void close() {}
+    // Called on the sink's thread between batches
+    virtual void idle() {}
+
+private:
+    void run();
+
+    std::deque<TranscriptRecord> queue;
+    size_t max_queue = 10000;
+    size_t batch_max = 100;
+    std::chrono::milliseconds batch_wait{200};
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    std::thread worker;
+    std::atomic<bool> do_stop = false;
+
+    std::atomic<unsigned long> written = 0;
+    std::atomic<unsigned long> batches = 0;
+    std::atomic<unsigned long> lost = 0;
+    std::atomic<unsigned long> dropped = 0;
+};
+
+// Appends records to JSONL files in a directory, starting a new file once
+// the current one passes SINK_JSONL_MAX_BYTES.
+class JsonlFileSink : public Sink
+{
+public:
+    JsonlFileSink();
+
+protected:
+    bool write_batch(const std::vector<TranscriptRecord> &batch) override;
+    void close() override;
+
+private:
+    bool rotate();
+
+    std::string dir;
+    size_t max_bytes;
+    int fd = -1;
+    size_t bytes = 0;
+    unsigned files = 0;
+};
+
+// Streams records as JSON lines to every client connected to a Unix
+// socket. A client that can't keep up is disconnected rather than waited
+// on.
+class UnixSocketSink : public Sink
+{
+public:
+    UnixSocketSink();
+
+protected:
+    bool write_batch(const std::vector<TranscriptRecord> &batch) override;
+    void open() override;
+    void close() override;
+    void idle() override;
+
+private:
+    std::string socket_path;
+    int listener = -1;
+    std::vector<int> clients;
+};
+
+// POSTs each batch as a JSON array to SINK_WEBHOOK_URL over a kept-alive
+// connection. Plain http:// only.
+class WebhookSink : public Sink
+{
+public:
+    WebhookSink();
+
+protected:
+    bool write_batch(const std::vector<TranscriptRecord> &batch) override;
+    void close() override;
+
+private:
+    bool connect_server();
+    bool post(const std::string &body);
+
+    std::string host;
+    std::string port = "80";
+    std::string target = "/";
+    int sock = -1;
+};
+
+// The sinks named in SINKS, fed together
+class SinkSet
+{
+public:
+    // "twitter" is handled by the outbox and skipped here
+    void configure();
+    void start();
+    void stop();
+    void submit(const TranscriptRecord &record);
+    void print_stats(std::ostream &out);
+
+private:
+    std::vector<std::unique_ptr<Sink>> sinks;
+};
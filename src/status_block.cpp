@@ -0,0 +1,121 @@
+#include "status_block.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MAGIC[8] = "SBSTAT1";
+
+bool StatusBlock::create(const char *name)
+{
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1 or ftruncate(fd, sizeof(Block)) == -1 or not map(fd, true))
+    {
+        perror("status block create");
+        if (fd != -1)
+            ::close(fd);
+        return false;
+    }
+    ::close(fd);
+
+    // The block outlives recorders, so readers that mapped it keep
+    // working; a recorder that died mid-update left the sequence odd
+    memcpy(block->magic, MAGIC, sizeof(MAGIC));
+    uint64_t sequence = block->sequence.load(std::memory_order_relaxed);
+    if (sequence & 1)
+        block->sequence.store(sequence + 1, std::memory_order_release);
+    update([](RecorderStatus &status) { status = RecorderStatus(); });
+    return true;
+}
+
+bool StatusBlock::open(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1)
+        return false;
+    struct stat block_stat;
+    bool ok = fstat(fd, &block_stat) == 0 and block_stat.st_size >= (off_t)sizeof(Block) and map(fd, false);
+    ::close(fd);
+    if (ok and memcmp(block->magic, MAGIC, sizeof(MAGIC)) != 0)
+    {
+        close();
+        ok = false;
+    }
+    return ok;
+}
+
+bool StatusBlock::map(int fd, bool writable)
+{
+    void *memory = mmap(nullptr, sizeof(Block), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED)
+        return false;
+    block = (Block *)memory;
+    return true;
+}
+
+void StatusBlock::close()
+{
+    if (block)
+        munmap(block, sizeof(Block));
+    block = nullptr;
+}
+
+void StatusBlock::store(const RecorderStatus &status)
+{
+    uint64_t words[WORDS];
+    memcpy(words, &status, sizeof(words));
+    for (size_t i = 0; i < WORDS; i++)
+        block->words[i].store(words[i], std::memory_order_relaxed);
+}
+
+bool StatusBlock::read(RecorderStatus &status) const
+{
+    if (not block)
+        return false;
+
+    // Lets a writer that was preempted mid-update finish now and then, and
+    // gives up rather than spin forever on one that died
+    for (int tries = 0; tries < 100000; tries++)
+    {
+        if (tries % 64 == 63)
+            sched_yield();
+        uint64_t before = block->sequence.load(std::memory_order_acquire);
+        if (before & 1)
+            continue;
+        uint64_t words[WORDS];
+        for (size_t i = 0; i < WORDS; i++)
+            words[i] = block->words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (block->sequence.load(std::memory_order_relaxed) == before)
+        {
+            memcpy(&status, words, sizeof(words));
+            return true;
+        }
+    }
+    return false;
+}
+
+void StatusBlock::print(std::ostream &out) const
+{
+    RecorderStatus status;
+    if (not read(status) or status.shell_pid == -1)
+    {
+        out << "\nRecorder: not recording";
+        return;
+    }
+    char line[256];
+    snprintf(line, sizeof(line),
+             "\nRecorder: %.7gM, signal %.1f dBFS, noise floor %.1f dBFS, %llu samples, "
+             "%llu overruns, %llu segments",
+             status.freq_hz / 1e6, status.signal_dbfs, status.noise_floor_dbfs,
+             (unsigned long long)status.samples, (unsigned long long)status.overruns,
+             (unsigned long long)status.segments);
+    out << line;
+    if (status.gain_tenths_db != INT32_MIN)
+        out << ", gain " << status.gain_tenths_db / 10.0 << " dB";
+    if (status.squelch != INT32_MIN)
+        out << ", squelch " << status.squelch;
+}
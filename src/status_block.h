@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <type_traits>
+
+// The recorder's shared memory object, under /dev/shm
+const char *const STATUS_SHM_NAME = "/sb_recorder_status";
+
+// Live telemetry from the recorder. Levels are of the demodulated audio,
+// in dB relative to full scale.
+struct RecorderStatus
+{
+    uint64_t freq_hz = 0;
+    int32_t gain_tenths_db = INT32_MIN;
+    int32_t squelch = INT32_MIN;
+    int32_t shell_pid = -1;
+    // Of the audio measured, after rtl_fm's resampling
+    uint32_t sample_rate = 0;
+    float signal_dbfs = -100;
+    float noise_floor_dbfs = -100;
+    uint64_t samples = 0;
+    // Times the recorder fell a whole pipe behind rtl_fm
+    uint64_t overruns = 0;
+    // Audio files closed since the recorder started
+    uint64_t segments = 0;
+    int64_t updated_us = 0;
+};
+
+/*
+ * A RecorderStatus in shared memory, written by the recorder and read by
+ * the bus or any monitoring tool that maps STATUS_SHM_NAME.
+ *
+ * It is a seqlock. The block is "SBSTAT1\0", a 64-bit sequence and then
+ * the status as 64-bit words. A writer makes the sequence odd, stores the
+ * words, and makes it even again. A reader copies the words between two
+ * reads of the sequence and tries again if the two differ or are odd.
+ * Neither side makes a syscall or takes a lock the other waits on, so
+ * an update is a handful of stores and a reader can never hold up the
+ * recorder.
+ */
+class StatusBlock
+{
+public:
+    // The recorder's side: maps the block for writing, creating it if
+    // need be, and clears it
+    bool create(const char *name = STATUS_SHM_NAME);
+    // Everyone else's: maps an existing block read only
+    bool open(const char *name = STATUS_SHM_NAME);
+    void close();
+    bool is_open() const { return block != nullptr; }
+
+    // Applies change to the status and publishes it. Only the recorder's
+    // epoll thread writes, so nothing else moves the sequence meanwhile.
+    template <class F>
+    void update(F &&change)
+    {
+        if (not block)
+            return;
+        uint64_t sequence = block->sequence.load(std::memory_order_relaxed);
+        block->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        change(current);
+        store(current);
+        block->sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    // A consistent copy of the status; false if the block isn't mapped
+    bool read(RecorderStatus &status) const;
+
+    void print(std::ostream &out) const;
+
+private:
+    static constexpr size_t WORDS = sizeof(RecorderStatus) / sizeof(uint64_t);
+    static_assert(sizeof(RecorderStatus) % sizeof(uint64_t) == 0 and std::is_trivially_copyable_v<RecorderStatus>);
+
+    struct Block
+    {
+        char magic[8];
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint64_t> words[WORDS];
+    };
+
+    void store(const RecorderStatus &status);
+    bool map(int fd, bool writable);
+
+    Block *block = nullptr;
+    // The writer's own copy, so an update only has to store
+    RecorderStatus current;
+};
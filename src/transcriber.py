@@ -2,8 +2,19 @@
 #
 # Receives any audio file, sending it through the speech-to-text
 # library/API, and returns the output as a text file.
+import fcntl
+import json
+import os
 import sys
+import threading
+import time
+import numpy
 import whisper
+from dotenv import dotenv_values
+
+config = dotenv_values("/home/corey/scannerbot/config/scannerbot.env")
+
+SAMPLE_RATE = whisper.audio.SAMPLE_RATE
 
 def write_file(audioPath, transcription):
     audioPathDirs = audioPath.split('/')
@@ -12,7 +23,7 @@ def write_file(audioPath, transcription):
         file.write(transcription)
 
 class Transcriber:
-    def __init__(self, input_path, model="large"):
+    def __init__(self, input_path, model="tiny"):
         self.input_path = input_path
         # initialize whisper
         self.model = whisper.load_model(model)
@@ -23,24 +34,229 @@ class Transcriber:
         return self.output_text.get("text")
 
 
+class CascadeTranscriber:
+    """
+    Transcribes with a small model, then re-runs only the segments that look
+    doubtful on a larger model. The large model is loaded lazily so files
+    the small model handles on its own never pay for it.
+    """
+    def __init__(self, input_path, small_model="tiny", large_model="large"):
+        self.input_path = input_path
+        self.min_avg_logprob = float(config.get("CASCADE_MIN_AVG_LOGPROB", -1.0))
+        self.max_no_speech_prob = float(config.get("CASCADE_MAX_NO_SPEECH_PROB", 0.6))
+        self.max_compression_ratio = float(config.get("CASCADE_MAX_COMPRESSION_RATIO", 2.4))
+        self.large_model_name = large_model
+        self.large_model = None
+        self.escalated = 0
+
+        audio = whisper.load_audio(input_path)
+        self.model = whisper.load_model(small_model)
+        result = self.model.transcribe(audio, verbose=False)
+        self.segments = result.get("segments", [])
+
+        texts = []
+        for segment in self.segments:
+            if self.needs_escalation(segment):
+                texts.append(self.escalate(audio, segment))
+            else:
+                texts.append(segment["text"])
+        self.output_text = {"text": "".join(texts)}
+
+    def needs_escalation(self, segment):
+        return (segment["avg_logprob"] < self.min_avg_logprob
+                or segment["no_speech_prob"] > self.max_no_speech_prob
+                or segment["compression_ratio"] > self.max_compression_ratio)
+
+    def escalate(self, audio, segment):
+        if self.large_model is None:
+            self.large_model = whisper.load_model(self.large_model_name)
+        self.escalated += 1
+        clip = audio[int(segment["start"] * SAMPLE_RATE):int(segment["end"] * SAMPLE_RATE)]
+        result = self.large_model.transcribe(clip, verbose=False)
+        return result.get("text", "")
+
+    def __str__(self):
+        return self.output_text.get("text")
+
+
+class StreamTranscriber:
+    """
+    Transcribes a growing stream of raw signed 16-bit mono PCM while the
+    transmission is still open. Every STREAM_STEP_SECONDS the open segment
+    is re-transcribed and the partial hypothesis written to the live
+    directory; the segment is finalized after STREAM_SILENCE_SECONDS of
+    quiet. Audio that falls out of the rolling window is committed so the
+    cost of each partial stays bounded.
+    """
+    def __init__(self, stream, rate, model="tiny"):
+        self.stream = stream
+        self.rate = rate
+        self.model = whisper.load_model(model)
+        self.live_dir = config.get("STREAM_LIVE_DIR", "/home/corey/scannerbot/transcripts/live/")
+        self.step = float(config.get("STREAM_STEP_SECONDS", 1.0))
+        self.window = float(config.get("STREAM_WINDOW_SECONDS", 15.0))
+        self.silence = float(config.get("STREAM_SILENCE_SECONDS", 1.0))
+        self.threshold = float(config.get("STREAM_SILENCE_THRESHOLD", 0.01))
+        os.makedirs(self.live_dir, exist_ok=True)
+
+        # Filled by the reader thread so that slow inference never backs up
+        # the pipe into sox.
+        self.pending = []
+        self.pending_lock = threading.Lock()
+        self.eof = False
+
+    def read_stream(self):
+        chunk_bytes = int(self.rate / 10) * 2
+        while True:
+            data = self.stream.read(chunk_bytes)
+            if not data:
+                break
+            samples = numpy.frombuffer(data[:len(data) - len(data) % 2], numpy.int16)
+            with self.pending_lock:
+                self.pending.append(samples.astype(numpy.float32) / 32768.0)
+        self.eof = True
+
+    def take_pending(self):
+        with self.pending_lock:
+            chunks, self.pending = self.pending, []
+        return chunks
+
+    def resample(self, samples):
+        if self.rate == SAMPLE_RATE or len(samples) == 0:
+            return samples
+        count = int(len(samples) * SAMPLE_RATE / self.rate)
+        positions = numpy.linspace(0, len(samples) - 1, count)
+        return numpy.interp(positions, numpy.arange(len(samples)), samples).astype(numpy.float32)
+
+    def transcribe(self, samples):
+        if len(samples) == 0:
+            return ""
+        return self.model.transcribe(self.resample(samples), verbose=False,
+                                     condition_on_previous_text=False).get("text", "")
+
+    def emit(self, name, start, text, final):
+        hypothesis = {"segment": name, "start": start, "text": text.strip(), "final": final}
+        # Write then rename so readers never see a half-written file
+        path = os.path.join(self.live_dir, name + ".json")
+        with open(path + ".tmp", 'w') as file:
+            json.dump(hypothesis, file)
+        os.replace(path + ".tmp", path)
+        print(json.dumps(hypothesis), flush=True)
+
+    def run(self):
+        threading.Thread(target=self.read_stream, daemon=True).start()
+
+        segment = None      # Samples of the open segment
+        committed = ""      # Text of audio that has left the rolling window
+        window_start = 0    # Index in segment where the rolling window begins
+        quiet = 0           # Trailing samples below the silence threshold
+        name = None
+        start = 0.0
+        last_partial = 0.0
+
+        while not (self.eof and not self.pending):
+            for chunk in self.take_pending():
+                loud = numpy.sqrt(numpy.mean(chunk * chunk)) >= self.threshold
+                if segment is None:
+                    if not loud:
+                        continue
+                    segment, committed, window_start, quiet = chunk, "", 0, 0
+                    start = time.time()
+                    name = time.strftime("%m-%d-%Y-%H:%M:%S", time.localtime(start))
+                else:
+                    segment = numpy.concatenate((segment, chunk))
+                    quiet = 0 if loud else quiet + len(chunk)
+
+                if segment is not None and quiet >= self.silence * self.rate:
+                    text = committed + self.transcribe(segment[window_start:len(segment) - quiet])
+                    self.emit(name, start, text, True)
+                    segment = None
+
+            if segment is not None and time.time() - last_partial >= self.step:
+                if len(segment) - window_start > self.window * self.rate:
+                    window_end = window_start + int(self.window * self.rate)
+                    committed += self.transcribe(segment[window_start:window_end])
+                    window_start = window_end
+                self.emit(name, start, committed + self.transcribe(segment[window_start:]), False)
+                last_partial = time.time()
+            else:
+                time.sleep(0.05)
+
+        if segment is not None:
+            self.emit(name, start, committed + self.transcribe(segment[window_start:]), True)
+
+
+def parse_rate(rate):
+    """Accepts sample rates written the way rtl_fm and sox take them, e.g. 8k."""
+    if rate.lower().endswith('k'):
+        return int(float(rate[:-1]) * 1000)
+    return int(rate)
+
+
+def record_escalations(segments, escalated):
+    """Adds this file's counts to the running totals in the stats file."""
+    statsPath = config.get("CASCADE_STATS_PATH", "/home/corey/scannerbot/db/cascade_stats.json")
+    with open(statsPath, 'a+') as file:
+        # Several transcribers may finish at once
+        fcntl.flock(file, fcntl.LOCK_EX)
+        file.seek(0)
+        try:
+            stats = json.load(file)
+        except ValueError:
+            stats = {}
+        stats["files"] = stats.get("files", 0) + 1
+        stats["files_escalated"] = stats.get("files_escalated", 0) + (escalated > 0)
+        stats["segments"] = stats.get("segments", 0) + segments
+        stats["segments_escalated"] = stats.get("segments_escalated", 0) + escalated
+        if stats["segments"] > 0:
+            stats["escalation_rate"] = stats["segments_escalated"] / stats["segments"]
+        file.seek(0)
+        file.truncate()
+        json.dump(stats, file, indent=2)
+
+    print("Escalated {} of {} segments ({:.1%} overall)".format(
+        escalated, segments, stats.get("escalation_rate", 0.0)), file=sys.stderr)
+
+
 def main():
     try:
         if (len(sys.argv) < 2):
-            print("Missing filename.\nUsage:\n\ttranscriber.py filename")
+            print("Missing filename.\nUsage:\n\ttranscriber.py filename [model|cascade]"
+                  "\n\ttranscriber.py --stream rate [model]")
             sys.exit()
-        elif (len(sys.argv) > 3):
+
+        if sys.argv[1] == "--stream":
+            if len(sys.argv) < 3:
+                print("Missing sample rate.")
+                sys.exit()
+            elif (len(sys.argv) > 4):
+                print("Too many arguments.")
+                sys.exit()
+            model = config.get("STREAM_MODEL", "tiny")
+            if len(sys.argv) > 3:
+                model = sys.argv[3]
+            StreamTranscriber(sys.stdin.buffer, parse_rate(sys.argv[2]), model).run()
+            return
+
+        if (len(sys.argv) > 3):
             print("Too many arguments.")
             sys.exit()
-        
+
         audioFilePath = sys.argv[1]
-        model = "tiny"
+        model = config.get("TRANSCRIBE_MODEL", "tiny")
         if(len(sys.argv) == 3):
             model=sys.argv[2]
-        
-        t = Transcriber(audioFilePath, model)
+
+        if model == "cascade":
+            t = CascadeTranscriber(audioFilePath,
+                                   config.get("CASCADE_SMALL_MODEL", "tiny"),
+                                   config.get("CASCADE_LARGE_MODEL", "large"))
+            record_escalations(len(t.segments), t.escalated)
+        else:
+            t = Transcriber(audioFilePath, model)
         write_file(audioFilePath, t.output_text.get("text"))
     except KeyboardInterrupt:
         exit()
 
 if __name__ == "__main__":
-    main()
\ No newline at end of file
+    main()